@@ -0,0 +1,55 @@
+/* config.h.  Generated from config.h.in by configure.  */
+/* config.h.in.  Generated from configure.ac by autoheader.  */
+
+/* Atlas for matrix multiplication */
+/* #undef HAVE_ATLAS */
+
+/* If a matrix multiplication library exists */
+#define HAVE_BLAS 1
+
+/* Define to 1 if you have the `m' library (-lm). */
+#define HAVE_LIBM 1
+
+/* Define to 1 if you have the `mmap' function. */
+#define HAVE_MMAP 1
+
+/* OpenBLAS for matrix multiplication */
+#define HAVE_OPENBLAS 1
+
+/* Number of values simulator will generate before modifying lambda value */
+#define LAMBDA_PERTURBATION_STEP_SIZE 50
+
+/* Number of times optimizer will restart if it fails to find legal values */
+#define NUM_OPTIMIZER_INITIALIZATION_ATTEMPTS 100
+
+/* Precision of values optimizer will use before abandoning a set of values */
+#define OPTIMIZER_HIGH_PRECISION 1e-6
+
+/* Precision of values optimizer will use before abandoning a set of values */
+#define OPTIMIZER_LOW_PRECISION 1e-3
+
+/* Optimizer will stop after 12 iterations with no significant change in -ln
+   likelihood
+ */
+#define OPTIMIZER_STRATEGY_SIMILARITY_CUTOFF /**/
+
+/* Define to the address where bug reports for this package should be sent. */
+#define PACKAGE_BUGREPORT ""
+
+/* Define to the full name of this package. */
+#define PACKAGE_NAME "cafexp"
+
+/* Define to the full name and version of this package. */
+#define PACKAGE_STRING "cafexp 1.0"
+
+/* Define to the one symbol short name of this package. */
+#define PACKAGE_TARNAME "cafexp"
+
+/* Define to the home page for this package. */
+#define PACKAGE_URL ""
+
+/* Define to the version of this package. */
+#define PACKAGE_VERSION "1.0"
+
+/* Number of attempts optimizer will make to initialize to a good value */
+#define PHASED_OPTIMIZER_PHASE1_ATTEMPTS 4
@@ -4,10 +4,13 @@
 #include <random>
 #include <sstream>
 #include <algorithm>
+#include <omp.h>
 
 #include "base_model.h"
 #include "gene_family_reconstructor.h"
 #include "matrix_cache.h"
+#include "pruning_workspace.h"
+#include "compiled_tree.h"
 #include "gene_family.h"
 #include "user_data.h"
 #include "root_equilibrium_distribution.h"
@@ -24,41 +27,16 @@ base_model::base_model(lambda* p_lambda, const clade *p_tree, const vector<gene_
 
 }
 
+//! For each family, returns the index of the first family with the same species sizes (possibly itself)
 vector<size_t> build_reference_list(const vector<gene_family>& families)
 {
-    const size_t invalid_index = std::numeric_limits<size_t>::max();
-
-    vector<size_t> reff;
-    const int num_families = families.size();
-    reff.resize(num_families, invalid_index);
-    for (int i = 0; i < num_families; ++i) {
-        if (reff[i] != invalid_index) continue;
-
-        reff[i] = i;
-
-        for (int j = i + 1; j < num_families; ++j) {
-            if (reff[j] == invalid_index)
-            {
-                if (families[i].species_size_match(families[j]))
-                {
-                    reff[j] = i;
-                }
-            }
-        }
-    }
-
-    return reff;
+    vector<size_t> rows;
+    auto p_table = tabulate(families, rows);
+    return build_reference_list(*p_table, rows);
 }
 
-double base_model::infer_family_likelihoods(root_equilibrium_distribution *prior, const std::map<int, int>& root_distribution_map, const lambda *p_lambda) {
-    _monitor.Event_InferenceAttempt_Started();
-
-    if (!_p_lambda->is_valid())
-    {
-        _monitor.Event_InferenceAttempt_InvalidValues();
-        return -log(0);
-    }
-
+static void initialize_prior(root_equilibrium_distribution *prior, const std::map<int, int>& root_distribution_map, int max_root_family_size)
+{
     root_distribution rd;
     if (root_distribution_map.size() > 0)
     {
@@ -66,40 +44,115 @@ double base_model::infer_family_likelihoods(root_equilibrium_distribution *prior
     }
     else
     {
-        rd.vectorize_uniform(_max_root_family_size);
+        rd.vectorize_uniform(max_root_family_size);
     }
 //    initialize_rootdist_if_necessary();
     prior->initialize(&rd);
+}
+
+double base_model::infer_family_likelihoods(root_equilibrium_distribution *prior, const std::map<int, int>& root_distribution_map, const lambda *p_lambda) {
+    _monitor.Event_InferenceAttempt_Started();
+
+    if (!_p_lambda->is_valid())
+    {
+        _monitor.Event_InferenceAttempt_InvalidValues();
+        return -log(0);
+    }
+
+    initialize_prior(prior, root_distribution_map, _max_root_family_size);
 
     results.resize(_p_gene_families->size());
     std::vector<double> all_families_likelihood(_p_gene_families->size());
 
-    matrix_cache calc(max(_max_root_family_size, _max_family_size) + 1);
+    matrix_cache& calc = get_inference_cache();
     calc.precalculate_matrices(get_lambda_values(_p_lambda), _p_tree->get_branch_lengths());
 
-    vector<vector<double>> partial_likelihoods(_p_gene_families->size());
-#pragma omp parallel for
+    vector<size_t> unique_families;
     for (size_t i = 0; i < _p_gene_families->size(); ++i) {
         if (references[i] == i)
-            partial_likelihoods[i] = inference_prune(_p_gene_families->at(i), calc, _p_lambda, _p_error_model, _p_tree, 1.0, _max_root_family_size, _max_family_size);
-            // probabilities of various family sizes
+            unique_families.push_back(i);
+    }
+
+    auto block_starts = make_pruning_blocks(*_p_family_table, _family_rows, unique_families, _max_root_family_size, _max_family_size);
+    auto bounds = [this](size_t row) { return pruning_bounds(_p_family_table->max_count(row), _max_root_family_size, _max_family_size); };
+    vector<size_t> slot(_p_gene_families->size());
+    vector<size_t> unique_rows(unique_families.size());
+    for (size_t u = 0; u < unique_families.size(); ++u) {
+        slot[unique_families[u]] = u;
+        unique_rows[u] = _family_rows[unique_families[u]];
+    }
+
+    // prune the distinct families in blocks, so each branch costs one matrix-matrix product per block.
+    // Unless blocks keep workspaces of their own (below), each thread prunes into its own workspace,
+    // so no memory is allocated per family
+    size_t root_size = _max_root_family_size;
+    vector<double> partial_likelihoods(unique_families.size() * root_size);
+    int num_blocks = block_starts.size() - 1;
+    auto& workspaces = get_pruning_workspaces();
+
+    // With several lambdas an optimizer step often moves only some of them. If it fits, each block
+    // keeps its likelihoods in a workspace of its own, so that only the nodes above branches whose
+    // lambda changed are pruned again
+    bool keep_likelihoods = _p_lambda->count() > 1;
+    if (keep_likelihoods)
+    {
+        size_t internal_nodes = 0;
+        _p_tree->apply_prefix_order([&internal_nodes](const clade *c) { if (!c->is_leaf()) internal_nodes++; });
+        size_t bytes = 0;
+        for (int b = 0; b < num_blocks; ++b)
+            bytes += internal_nodes * (bounds(unique_rows[block_starts[b]]).second + 1) * (block_starts[b + 1] - block_starts[b]) * sizeof(double);
+        keep_likelihoods = bytes <= PRUNING_CACHE_MEMORY_BUDGET;
+    }
+    if (keep_likelihoods)
+        _block_workspaces.resize(num_blocks);
+    else
+        _block_workspaces.clear();
+
+    // every block uses the same matrix on each branch, so each is looked up once
+    const branch_matrices matrices(compiled_tree(_p_tree), calc, &_p_lambda, 1);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < num_blocks; ++b) {
+        size_t first = block_starts[b];
+        int n = block_starts[b + 1] - first;
+        auto block_bounds = bounds(unique_rows[first]);
+
+        pruning_workspace *p_workspace;
+        if (keep_likelihoods)
+        {
+            p_workspace = &_block_workspaces[b];
+            p_workspace->prepare(_p_tree, n, block_bounds.first, block_bounds.second);
+            p_workspace->reprune(*_p_family_table, &unique_rows[first], n, matrices, _p_error_model, block_bounds.first, block_bounds.second);
+        }
+        else
+        {
+            p_workspace = &workspaces[omp_get_thread_num()];
+            p_workspace->prepare(_p_tree, PRUNING_BLOCK_SIZE, _max_root_family_size, _max_family_size);
+            p_workspace->prune_categories(*_p_family_table, &unique_rows[first], n, matrices, _p_error_model, block_bounds.first, block_bounds.second);
+        }
+
+        // sizes above the bounds are left with a likelihood of zero
+        const double *root = p_workspace->root_likelihoods();
+        for (int j = 0; j < n; ++j)
+            for (int s = 0; s < block_bounds.first; ++s)
+                partial_likelihoods[(first + j) * root_size + s] = root[s * n + j]; // probabilities of various family sizes
     }
 
     // prune all the families with the same lambda
 #pragma omp parallel for
     for (size_t i = 0; i < _p_gene_families->size(); ++i) {
 
-        auto& partial_likelihood = partial_likelihoods[references[i]];
-        std::vector<double> full(partial_likelihood.size());
+        const double *partial_likelihood = &partial_likelihoods[slot[references[i]] * root_size];
+        double best = -std::numeric_limits<double>::infinity();
 
-        for (size_t j = 0; j < partial_likelihood.size(); ++j) {
+        for (size_t j = 0; j < root_size; ++j) {
             double eq_freq = prior->compute(j);
 
-            full[j] = std::log(partial_likelihood[j]) + std::log(eq_freq);
+            best = max(best, std::log(partial_likelihood[j]) + std::log(eq_freq));
         }
 
         //        all_families_likelihood[i] = accumulate(full.begin(), full.end(), 0.0); // sum over all sizes (Felsenstein's approach)
-        all_families_likelihood[i] = *max_element(full.begin(), full.end()); // get max (CAFE's approach)
+        all_families_likelihood[i] = best; // get max (CAFE's approach)
                                                                              // cout << i << " contribution " << scientific << all_families_likelihood[i] << endl;
         
         results[i] = family_info_stash(_p_gene_families->at(i).id(), 0.0, 0.0, 0.0, all_families_likelihood[i], false);
@@ -111,6 +164,109 @@ double base_model::infer_family_likelihoods(root_equilibrium_distribution *prior
     return final_likelihood;
 }
 
+vector<double> base_model::infer_family_likelihoods(root_equilibrium_distribution *prior, const std::map<int, int>& root_distribution_map, const vector<const lambda *>& lambdas)
+{
+    vector<double> scores(lambdas.size(), -log(0));
+    vector<const lambda *> valid;
+    vector<size_t> positions;
+    for (size_t k = 0; k < lambdas.size(); ++k)
+    {
+        _monitor.Event_InferenceAttempt_Started();
+        if (lambdas[k]->is_valid())
+        {
+            valid.push_back(lambdas[k]);
+            positions.push_back(k);
+        }
+        else
+            _monitor.Event_InferenceAttempt_InvalidValues();
+    }
+    if (valid.empty())
+        return scores;
+
+    initialize_prior(prior, root_distribution_map, _max_root_family_size);
+
+    vector<size_t> unique_families;
+    for (size_t i = 0; i < _p_gene_families->size(); ++i) {
+        if (references[i] == i)
+            unique_families.push_back(i);
+    }
+    auto block_starts = make_pruning_blocks(*_p_family_table, _family_rows, unique_families, _max_root_family_size, _max_family_size);
+    vector<size_t> slot(_p_gene_families->size());
+    vector<size_t> unique_rows(unique_families.size());
+    for (size_t u = 0; u < unique_families.size(); ++u) {
+        slot[unique_families[u]] = u;
+        unique_rows[u] = _family_rows[unique_families[u]];
+    }
+
+    int num_blocks = block_starts.size() - 1;
+    size_t root_size = _max_root_family_size;
+    auto& workspaces = get_pruning_workspaces();
+    matrix_cache& calc = get_inference_cache();
+    compiled_tree tree(_p_tree);
+    vector<double> partial_likelihoods;
+    vector<double> all_families_likelihood(_p_gene_families->size());
+
+    // the lambdas are scored in chunks whose matrices fit in the cache and whose categories fit in the workspaces
+    int chunk_size = batch_size(valid[0]);
+    for (size_t chunk = 0; chunk < valid.size(); chunk += chunk_size) {
+        const lambda * const *chunk_lambdas = &valid[chunk];
+        int categories = min<size_t>(chunk_size, valid.size() - chunk);
+
+        // the matrices of every lambda in the chunk are calculated together, so there are enough to keep every thread busy
+        vector<double> lambda_values;
+        for (int k = 0; k < categories; ++k)
+        {
+            auto values = get_lambda_values(chunk_lambdas[k]);
+            lambda_values.insert(lambda_values.end(), values.begin(), values.end());
+        }
+        calc.precalculate_matrices(lambda_values, _p_tree->get_branch_lengths());
+        const branch_matrices matrices(tree, calc, chunk_lambdas, categories);
+
+        // entry [(k * unique families + u) * root_size + s]: likelihood of size s for distinct family u under lambda k
+        partial_likelihoods.assign(size_t(categories) * unique_families.size() * root_size, 0.0);
+
+#pragma omp parallel for schedule(dynamic)
+        for (int b = 0; b < num_blocks; ++b) {
+            pruning_workspace& workspace = workspaces[omp_get_thread_num()];
+            workspace.prepare(_p_tree, PRUNING_BLOCK_SIZE, _max_root_family_size, _max_family_size, categories);
+
+            size_t first = block_starts[b];
+            int n = block_starts[b + 1] - first;
+            auto bounds = pruning_bounds(_p_family_table->max_count(unique_rows[first]), _max_root_family_size, _max_family_size);
+            workspace.prune_categories(*_p_family_table, &unique_rows[first], n, matrices, _p_error_model, bounds.first, bounds.second);
+
+            for (int k = 0; k < categories; ++k) {
+                const double *root = workspace.root_likelihoods(k);
+                double *partial = &partial_likelihoods[(size_t(k) * unique_families.size() + first) * root_size];
+                for (int j = 0; j < n; ++j)
+                    for (int s = 0; s < bounds.first; ++s)
+                        partial[j * root_size + s] = root[s * n + j];
+            }
+        }
+
+        for (int k = 0; k < categories; ++k) {
+            const double *partial = &partial_likelihoods[size_t(k) * unique_families.size() * root_size];
+
+#pragma omp parallel for
+            for (size_t i = 0; i < _p_gene_families->size(); ++i) {
+                const double *partial_likelihood = &partial[slot[references[i]] * root_size];
+                double best = -std::numeric_limits<double>::infinity();
+                for (size_t j = 0; j < root_size; ++j) {
+                    double eq_freq = prior->compute(j);
+                    best = max(best, std::log(partial_likelihood[j]) + std::log(eq_freq));
+                }
+                all_families_likelihood[i] = best;
+            }
+            double final_likelihood = -std::accumulate(all_families_likelihood.begin(), all_families_likelihood.end(), 0.0);
+
+            _monitor.Event_InferenceAttempt_Complete(final_likelihood);
+            scores[positions[chunk + k]] = final_likelihood;
+        }
+    }
+
+    return scores;
+}
+
 void base_model::write_family_likelihoods(std::ostream& ost)
 {
     ost << "#FamilyID\tLikelihood of Family" << endl;
@@ -148,12 +304,25 @@ reconstruction* base_model::reconstruct_ancestral_states(const vector<gene_famil
 
     auto result = new base_model_reconstruction();
 
-    p_calc->precalculate_matrices(get_lambda_values(_p_lambda), _p_tree->get_branch_lengths());
+    if (!p_calc->is_on_demand())
+        p_calc->precalculate_matrices(get_lambda_values(_p_lambda), _p_tree->get_branch_lengths());
 
+    compiled_tree tree(_p_tree);
+    vector<size_t> rows;
+    auto p_table = tabulate(families, rows);
+    auto family_references = build_reference_list(*p_table, rows);
     for (size_t i = 0; i< families.size(); ++i)
     {
-        reconstruct_gene_family(_p_lambda, _p_tree, _max_family_size, _max_root_family_size,
-            &families[i], p_calc, p_prior, result->_reconstructions[families[i].id()]);
+        if (family_references[i] == i)
+            reconstruct_gene_family(_p_lambda, tree, _max_family_size, _max_root_family_size,
+                *p_table, rows[i], p_calc, p_prior, result->_reconstructions[families[i].id()]);
+    }
+
+    // families with identical counts have identical reconstructions
+    for (size_t i = 0; i < families.size(); ++i)
+    {
+        if (family_references[i] != i)
+            result->_reconstructions[families[i].id()] = result->_reconstructions[families[family_references[i]].id()];
     }
 
     _monitor.Event_Reconstruction_Complete();
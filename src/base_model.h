@@ -25,6 +25,10 @@ public:
 
     virtual double infer_family_likelihoods(root_equilibrium_distribution *prior, const std::map<int, int>& root_distribution_map, const lambda *p_lambda);
 
+    //! Prunes every family once for all the lambdas, each lambda a category of the same walk over the tree.
+    /// Lambdas are taken in chunks of \ref batch_size, each with its own matrices and workspaces
+    virtual std::vector<double> infer_family_likelihoods(root_equilibrium_distribution *prior, const std::map<int, int>& root_distribution_map, const std::vector<const lambda *>& lambdas);
+
     virtual std::string name() const {
         return "Base";
     }
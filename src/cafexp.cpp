@@ -11,6 +11,8 @@
 #include "user_data.h"
 #include "root_equilibrium_distribution.h"
 #include "core.h"
+#include "matrix_cache.h"
+#include "matrix_store.h"
 
 using namespace std;
 
@@ -26,7 +28,7 @@ input_parameters read_arguments(int argc, char *const argv[])
     int args; // getopt_long returns int or char
     int prev_arg;
 
-    while (prev_arg = optind, (args = getopt_long(argc, argv, "i:e::o:t:y:n:f:E:R:P:I:l:m:k:a:s::p::r:zb", longopts, NULL)) != -1) {
+    while (prev_arg = optind, (args = getopt_long(argc, argv, "i:e::o:t:y:n:f:E:R:P:I:K:M:T:S:l:m:k:a:s::p::r:zb", longopts, NULL)) != -1) {
         // while ((args = getopt_long(argc, argv, "i:t:y:n:f:l:e::s::", longopts, NULL)) != -1) {
         if (optind == prev_arg + 2 && optarg && *optarg == '-') {
             cout << "You specified option " << argv[prev_arg] << " but it requires an argument. Exiting..." << endl;
@@ -90,6 +92,18 @@ input_parameters read_arguments(int argc, char *const argv[])
         case 'I':
             my_input_parameters.optimizer_params.neldermead_iterations = atoi(optarg);
             break;
+        case 'K':
+            my_input_parameters.optimizer_params.concurrent_starts = atoi(optarg);
+            break;
+        case 'M':
+            my_input_parameters.matrix_method = optarg;
+            break;
+        case 'T':
+            my_input_parameters.matrix_tolerance = atof(optarg);
+            break;
+        case 'S':
+            my_input_parameters.matrix_store_path = optarg;
+            break;
         case 'f':
             my_input_parameters.rootdist = optarg;
             break;
@@ -165,6 +179,10 @@ void show_help()
         "   --zero_root, -z\t\t\tInclude gene families that don't exist at the root, not recommended.\n"
         "   --Expansion, -E\t\tExpansion parameter for Nelder-Mead optimizer.\n"
         "   --Reflection, -R\t\tReflection parameter for Nelder-Mead optimizer.\n"
+        "   --optimizer_starts, -K\tNumber of starting points the multi-start optimizer strategies search at the same\n \t\t\t\t  time. Searches that reach the optimum of a better one stop early.\n"
+        "   --matrix_method, -M\t\tHow transition matrices are calculated: 'sum' (default) evaluates each entry\n \t\t\t\t  independently, 'recurrence' builds each row from the previous one.\n"
+        "   --matrix_tolerance, -T\tProbability mass each row of a transition matrix may drop (default 0). Above zero,\n \t\t\t\t  matrices only store the band of sizes around the parent size that holds the rest.\n"
+        "   --matrix_store, -S		File to keep transition matrices in between runs. Matrices found there are read\n \t\t\t\t  instead of calculated, and newly calculated ones are added to it.\n"
         "   --lambda_per_family, -b\tEstimate lambda by family (for testing purposes only).\n\n\n";
 
         std::cout << text;
@@ -183,6 +201,18 @@ int cafexp(int argc, char *const argv[]) {
             show_help();
             return 0;
         }
+
+        if (user_input.matrix_method == "recurrence")
+            matrix_cache::set_default_generator(Recurrence);
+        matrix_cache::set_default_tolerance(user_input.matrix_tolerance);
+
+        unique_ptr<matrix_store> p_store;
+        if (!user_input.matrix_store_path.empty())
+        {
+            p_store.reset(new matrix_store(user_input.matrix_store_path));
+            matrix_cache::set_default_store(p_store.get());
+        }
+
         user_data data;
         data.read_datafiles(user_input);
 
@@ -73,7 +73,7 @@ public:
 
     double find_branch_length(std::string some_taxon_name);
 
-    std::string get_taxon_name() const { return _taxon_name; }
+    const std::string& get_taxon_name() const { return _taxon_name; }
 
     void write_newick(std::ostream& ost, std::function<std::string(const clade *c)> textwriter) const;
 
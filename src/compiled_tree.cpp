@@ -0,0 +1,46 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "compiled_tree.h"
+#include "clade.h"
+
+using namespace std;
+
+compiled_tree::compiled_tree(const clade *p_tree)
+{
+    p_tree->apply_prefix_order([this](const clade *c) {
+        _index[c] = _nodes.size();
+        _nodes.push_back(c);
+    });
+
+    size_t n = _nodes.size();
+    _parent.resize(n);
+    _first_child.resize(n + 1);
+    _branch_length.resize(n);
+    _leaf_column.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        const clade *c = _nodes[i];
+        _parent[i] = i == 0 ? -1 : _index.at(c->get_parent());
+        _branch_length[i] = c->get_branch_length();
+        _leaf_column[i] = c->is_leaf() ? _leaf_count++ : -1;
+
+        _first_child[i] = _children.size();
+        c->apply_to_descendants([this](const clade *child) { _children.push_back(_index.at(child)); });
+    }
+    _first_child[n] = _children.size();
+
+    _preorder.resize(n);
+    for (size_t i = 0; i < n; ++i)
+        _preorder[i] = i;
+    _postorder.assign(_preorder.rbegin(), _preorder.rend());
+}
+
+int compiled_tree::index(const clade *c) const
+{
+    auto it = _index.find(c);
+    if (it == _index.end())
+        throw runtime_error("Node " + c->get_taxon_name() + " is not part of the compiled tree");
+
+    return it->second;
+}
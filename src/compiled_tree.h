@@ -0,0 +1,90 @@
+#ifndef COMPILED_TREE_H
+#define COMPILED_TREE_H
+
+#include <vector>
+#include <map>
+
+class clade;
+
+//! A flattened, index-based copy of the structure of a tree
+/*!
+Built once from a parsed \ref clade, it keeps the data the hot traversals need in plain arrays
+indexed by node number. Nodes are numbered in the order \ref clade::apply_prefix_order visits them,
+so the root is node 0 and every parent is numbered before its children.
+
+\ref preorder visits parents before children (the order simulation needs), and \ref postorder
+visits children before parents (the order pruning and reconstruction need). Per-node state can be
+kept in a std::vector of \ref size elements instead of a \ref clademap.
+
+The compiled tree refers to the clades it was built from, so it must not outlive the tree.
+*/
+class compiled_tree {
+    std::vector<const clade *> _nodes;
+    std::vector<int> _parent;               //!< -1 for the root
+    std::vector<size_t> _first_child;       //!< children of node i are _children[_first_child[i]] to _children[_first_child[i+1]-1]
+    std::vector<int> _children;
+    std::vector<double> _branch_length;
+    std::vector<int> _leaf_column;          //!< position of the node among the leaves, -1 for internal nodes
+    std::vector<int> _preorder;
+    std::vector<int> _postorder;
+    std::map<const clade *, int> _index;
+    size_t _leaf_count = 0;
+public:
+    compiled_tree(const clade *p_tree);
+
+    size_t size() const {
+        return _nodes.size();
+    }
+
+    size_t leaf_count() const {
+        return _leaf_count;
+    }
+
+    //! the clade that node i was built from
+    const clade *node(int i) const {
+        return _nodes[i];
+    }
+
+    //! the node number of the given clade. Throws if the clade is not part of the tree
+    int index(const clade *c) const;
+
+    int parent(int i) const {
+        return _parent[i];
+    }
+
+    const int *children_begin(int i) const {
+        return _children.data() + _first_child[i];
+    }
+
+    const int *children_end(int i) const {
+        return _children.data() + _first_child[i + 1];
+    }
+
+    double branch_length(int i) const {
+        return _branch_length[i];
+    }
+
+    bool is_root(int i) const {
+        return _parent[i] < 0;
+    }
+
+    bool is_leaf(int i) const {
+        return _first_child[i] == _first_child[i + 1];
+    }
+
+    int leaf_column(int i) const {
+        return _leaf_column[i];
+    }
+
+    //! node numbers with parents before children
+    const std::vector<int>& preorder() const {
+        return _preorder;
+    }
+
+    //! node numbers with children before parents
+    const std::vector<int>& postorder() const {
+        return _postorder;
+    }
+};
+
+#endif
@@ -5,6 +5,9 @@
 #include <assert.h>
 #include <numeric>
 #include <iomanip>
+#include <limits>
+#include <algorithm>
+#include <omp.h>
 
 #include "core.h"
 #include "user_data.h"
@@ -12,6 +15,8 @@
 #include "gamma_core.h"
 #include "base_model.h"
 #include "error_model.h"
+#include "compiled_tree.h"
+#include "family_table.h"
 
 std::vector<model *> build_models(const input_parameters& user_input, user_data& user_data) {
 
@@ -64,15 +69,83 @@ model::model(lambda* p_lambda,
     error_model *p_error_model) :
     _ost(cout), _p_lambda(p_lambda), _p_tree(p_tree), _p_gene_families(p_gene_families), _max_family_size(max_family_size),
     _max_root_family_size(max_root_family_size), _p_error_model(p_error_model) 
+{
+    index_families();
+}
+
+void model::index_families()
 {
     if (_p_gene_families)
-        references = build_reference_list(*_p_gene_families);
+    {
+        _p_family_table = tabulate(*_p_gene_families, _family_rows);
+        references = build_reference_list(*_p_family_table, _family_rows);
+    }
+    else
+    {
+        _p_family_table.reset();
+        _family_rows.clear();
+    }
+}
+
+void model::set_families(const std::vector<gene_family>* p_gene_families)
+{
+    _p_gene_families = p_gene_families;
+    index_families();
+
+    // likelihoods kept between inferences belong to the old families
+    _block_workspaces.clear();
+}
+
+model::~model()
+{
+}
+
+matrix_cache& model::get_inference_cache()
+{
+    if (!_p_inference_cache)
+        _p_inference_cache.reset(new matrix_cache(max(_max_root_family_size, _max_family_size) + 1));
+
+    return *_p_inference_cache;
+}
+
+std::vector<pruning_workspace>& model::get_pruning_workspaces()
+{
+    if (_pruning_workspaces.size() < size_t(omp_get_max_threads()))
+        _pruning_workspaces.resize(omp_get_max_threads());
+
+    return _pruning_workspaces;
+}
+
+int model::batch_size(const lambda *p_lambda)
+{
+    matrix_cache& calc = get_inference_cache();
+    size_t matrix_bytes = size_t(calc.get_matrix_size()) * calc.get_matrix_size() * sizeof(double);
+    size_t cache_bytes = get_lambda_values(p_lambda).size() * _p_tree->get_branch_lengths().size() * matrix_bytes;
+
+    size_t internal_nodes = 0;
+    _p_tree->apply_prefix_order([&internal_nodes](const clade *c) { if (!c->is_leaf()) internal_nodes++; });
+    size_t workspace_bytes = internal_nodes * max(_max_root_family_size, _max_family_size + 1) * PRUNING_BLOCK_SIZE * sizeof(double)
+        * omp_get_max_threads();
+
+    size_t n = min(calc.get_memory_budget() / max<size_t>(cache_bytes, 1), PRUNING_BATCH_MEMORY_BUDGET / max<size_t>(workspace_bytes, 1));
+    return int(max<size_t>(min<size_t>(n, std::numeric_limits<int>::max()), 1));
 }
 
 std::size_t model::get_gene_family_count() const {
     return _p_gene_families->size();
 }
 
+std::vector<double> model::configuration() const {
+    double families = _p_gene_families ? double(_p_gene_families->size()) : 0.0;
+    std::vector<double> result{ families, double(_max_family_size), double(_max_root_family_size) };
+    if (_p_error_model)
+    {
+        auto epsilons = _p_error_model->get_epsilons();
+        result.insert(result.end(), epsilons.begin(), epsilons.end());
+    }
+    return result;
+}
+
 void model::initialize_lambda(clade *p_lambda_tree)
 {
     lambda *p_lambda = NULL;
@@ -108,6 +181,8 @@ void model::write_vital_statistics(std::ostream& ost, double final_likelihood)
 
     get_monitor().summarize(ost);
 
+    if (_p_inference_cache)
+        _p_inference_cache->write_statistics(ost);
 }
 
 lambda* model::get_simulation_lambda()
@@ -127,20 +202,68 @@ void model::write_error_model(std::ostream& ost) const
 }
 
 //! Computes likelihoods for the given tree and a single family. Uses a lambda value based on the provided lambda
-/// and a given multiplier. Works by calling \ref compute_node_probability on all nodes of the tree
-/// using the species counts for the family. 
+/// and a given multiplier. Works by pruning a block of one family in a \ref pruning_workspace
+/// using the species counts for the family. Only sizes within the \ref pruning_bounds of the
+/// family are calculated; larger root sizes get a likelihood of zero.
 /// \returns a vector of probabilities for gene counts at the root of the tree 
 std::vector<double> inference_prune(const gene_family& gf, matrix_cache& calc, const lambda *p_lambda, const error_model* p_error_model, const clade *p_tree, double lambda_multiplier, int max_root_family_size, int max_family_size)
 {
+    pruning_workspace workspace;
+    std::vector<double> result;
+    inference_prune(gf, calc, p_lambda, p_error_model, p_tree, lambda_multiplier, max_root_family_size, max_family_size, workspace, result);
+    return result;
+}
+
+//! As above, pruning in a workspace the caller keeps from one family to the next. The family is
+/// pruned from the row of its own table, so once the workspace is prepared for the tree and result
+/// has room for the root sizes, nothing is allocated (unless the lambda needs a multiplier)
+void inference_prune(const gene_family& gf, matrix_cache& calc, const lambda *p_lambda, const error_model* p_error_model, const clade *p_tree, double lambda_multiplier, int max_root_family_size, int max_family_size,
+    pruning_workspace& workspace, std::vector<double>& result)
+{
+    unique_ptr<lambda> multiplied;
+    if (lambda_multiplier != 1.0)
+    {
+        multiplied.reset(p_lambda->multiply(lambda_multiplier));
+        p_lambda = multiplied.get();
+    }
+
+    size_t row;
+    auto p_table = tabulate(gf, row);
+    auto bounds = pruning_bounds(gf.get_max_size(), max_root_family_size, max_family_size);
+    workspace.prepare(p_tree, 1, max_root_family_size, max_family_size);
+    workspace.prune(*p_table, &row, 1, calc, p_lambda, p_error_model, bounds.first, bounds.second);
+
+    const double *root = workspace.root_likelihoods();
+    result.assign(max_root_family_size, 0.0);
+    copy(root, root + bounds.first, result.begin()); // likelihood of the whole tree = multiplication of likelihood of all nodes
+}
+
+//! Computes likelihoods for a block of families at once. Returns the same values as calling
+/// \ref inference_prune on each family, but each branch is handled by a single matrix-matrix
+/// product for the whole block (see \ref pruning_workspace).
+/// \returns a vector of root probabilities for each family, in the order given
+std::vector<std::vector<double>> inference_prune_block(const std::vector<const gene_family *>& families, matrix_cache& calc, const lambda *p_lambda, const error_model* p_error_model, const clade *p_tree, double lambda_multiplier, int max_root_family_size, int max_family_size)
+{
+    int n = families.size();
     unique_ptr<lambda> multiplier(p_lambda->multiply(lambda_multiplier));
-    clademap<std::vector<double>> probabilities;
-    auto init_func = [&](const clade* node) { probabilities[node].resize(node->is_root() ? max_root_family_size : max_family_size + 1); };
-    p_tree->apply_reverse_level_order(init_func);
+    pruning_workspace workspace;
+    workspace.prepare(p_tree, n, max_root_family_size, max_family_size);
+    family_table table(workspace.tree(), n);
+    std::vector<size_t> rows(n);
+    for (int j = 0; j < n; ++j)
+    {
+        table.set_family(j, *families[j]);
+        rows[j] = j;
+    }
+    workspace.prune(table, rows.data(), n, calc, multiplier.get(), p_error_model);
 
-    auto compute_func = [&](const clade *c) { compute_node_probability(c, gf, p_error_model, probabilities, max_root_family_size, max_family_size, multiplier.get(), calc); };
-    p_tree->apply_reverse_level_order(compute_func);
+    const double *root = workspace.root_likelihoods();
+    std::vector<std::vector<double>> result(n, std::vector<double>(max_root_family_size));
+    for (int s = 0; s < max_root_family_size; ++s)
+        for (int j = 0; j < n; ++j)
+            result[j][s] = root[s * n + j];
 
-    return probabilities.at(p_tree); // likelihood of the whole tree = multiplication of likelihood of all nodes
+    return result;
 }
 
 void event_monitor::Event_InferenceAttempt_Started() 
@@ -177,6 +300,8 @@ void event_monitor::summarize(std::ostream& ost) const
         return;
     }
     ost << this->attempts << " values were attempted (" << round(double(rejects) / double(attempts) * 100) << "% rejected)\n";
+    if (memo_hits > 0)
+        ost << memo_hits << " repeated values were scored from earlier attempts\n";
     if (!failure_count.empty())
     {
         auto failures = [](const pair<string, int>& a, const pair<string, int>& b) { return a.second < b.second; };
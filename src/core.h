@@ -2,10 +2,13 @@
 #define CORE_H
 
 #include <set>
+#include <memory>
 
 #include "clade.h"
 #include "probability.h"
 #include "root_distribution.h"
+#include "pruning_workspace.h"
+#include "family_table.h"
 
 class simulation_data;
 class inference_process;
@@ -103,6 +106,7 @@ class event_monitor
     std::map<string, int> failure_count;
     int attempts = 0;
     int rejects = 0;
+    int memo_hits = 0;
 public:
     void summarize(std::ostream& ost) const;
 
@@ -110,6 +114,8 @@ public:
     void Event_InferenceAttempt_InvalidValues() { rejects++; }
     void Event_InferenceAttempt_Saturation(std::string family) { failure_count[family]++; }
     void Event_InferenceAttempt_Complete(double final_likelihood);
+    //! Values were not inferred again, having been scored before
+    void Event_InferenceAttempt_Memoized() { memo_hits++; }
 
     void Event_Reconstruction_Started(std::string model);
     void Event_Reconstruction_Complete();
@@ -137,12 +143,47 @@ protected:
 
     event_monitor _monitor;
 
+    //! Transition matrices used while inferring likelihoods. Kept for the lifetime of the model so that
+    /// matrices calculated for one set of optimizer values can be reused by later ones
+    std::unique_ptr<matrix_cache> _p_inference_cache;
+
+    //! Returns the model's long-lived matrix cache, creating it if necessary
+    matrix_cache& get_inference_cache();
+
+    //! Counts of the model's gene families. Families read from a file share the table they were read into
+    std::shared_ptr<const family_table> _p_family_table;
+
+    //! Row of each of the model's gene families in _p_family_table
+    std::vector<size_t> _family_rows;
+
+    //! One pruning workspace per OpenMP thread, reused by every inference
+    std::vector<pruning_workspace> _pruning_workspaces;
+
+    //! One pruning workspace per block of families, keeping its likelihoods between inferences. Empty
+    /// unless the model has several lambdas and the likelihoods fit in PRUNING_CACHE_MEMORY_BUDGET
+    std::vector<pruning_workspace> _block_workspaces;
+
+    //! Returns the per-thread pruning workspaces, indexed by omp_get_thread_num()
+    std::vector<pruning_workspace>& get_pruning_workspaces();
+
+    //! Number of lambdas like the given one that can be pruned together as categories
+    /*!
+    The matrices of the lambdas must fit in the inference cache's memory budget, as the cache never
+    evicts the matrices of its latest request, and the per-thread workspaces prepared for that many
+    categories must fit in PRUNING_BATCH_MEMORY_BUDGET. Always at least one.
+    */
+    int batch_size(const lambda *p_lambda);
+
     //! Create a lambda based on the lambda tree model the user passed.
     /// Called when the user has provided no lambda value and one must
     /// be estimated. If the p_lambda_tree is NULL, uses a single
     /// lambda; otherwise uses the number of unique lambdas in the provided
     /// tree
     void initialize_lambda(clade *p_lambda_tree);
+
+    //! Finds the table holding the current families (copying them into one only if they are not
+    /// rows of a single table already) and the references to identical families
+    void index_families();
 public:
     model(lambda* p_lambda,
         const clade *p_tree,
@@ -151,13 +192,11 @@ public:
         int max_root_family_size,
         error_model *p_error_model);
     
-    virtual ~model() {}
+    virtual ~model();
     
-    /// Allows the replacement of the current set of families with a new set
-    void set_families(const std::vector<gene_family>* p_gene_families)
-    {
-        _p_gene_families = p_gene_families;
-    }
+    /// Allows the replacement of the current set of families with a new set. The family table
+    /// and references are found again for the new families
+    void set_families(const std::vector<gene_family>* p_gene_families);
 
     lambda * get_lambda() const {
         return _p_lambda;
@@ -169,6 +208,16 @@ public:
     virtual void prepare_matrices_for_simulation(matrix_cache& cache) = 0;
 
     virtual double infer_family_likelihoods(root_equilibrium_distribution *prior, const std::map<int, int>& root_distribution_map, const lambda *p_lambda) = 0;  // return vector of likelihoods
+
+    //! Scores several lambdas at once without changing the model's own lambda, returning -lnL for each
+    /*!
+    Returns an empty vector if the model can only score the lambda it holds, which is the default.
+    Models that return scores do not change the results reported by \ref write_family_likelihoods.
+    */
+    virtual std::vector<double> infer_family_likelihoods(root_equilibrium_distribution *prior, const std::map<int, int>& root_distribution_map, const std::vector<const lambda *>& lambdas)
+    {
+        return std::vector<double>();
+    }
     
     virtual std::string name() const = 0;
     virtual void write_family_likelihoods(std::ostream& ost) = 0;
@@ -182,7 +231,11 @@ public:
 
     std::size_t get_gene_family_count() const;
 
-    const event_monitor& get_monitor() { return _monitor;  }
+    event_monitor& get_monitor() { return _monitor;  }
+
+    //! Everything besides lambda that inferred likelihoods depend on, as numbers. A score
+    /// calculated for one configuration is not reused for another
+    virtual std::vector<double> configuration() const;
 };
 
 //! @brief Creates a list of families that are identical in all values
@@ -205,5 +258,10 @@ inline std::string filename(std::string base, std::string suffix)
 
 std::vector<double> inference_prune(const gene_family& gf, matrix_cache& calc, const lambda *_lambda, const error_model *p_error_model, const clade *_p_tree, double _lambda_multiplier, int _max_root_family_size, int _max_family_size);
 
+void inference_prune(const gene_family& gf, matrix_cache& calc, const lambda *_lambda, const error_model *p_error_model, const clade *_p_tree, double _lambda_multiplier, int _max_root_family_size, int _max_family_size,
+    pruning_workspace& workspace, std::vector<double>& result);
+
+std::vector<std::vector<double>> inference_prune_block(const std::vector<const gene_family *>& families, matrix_cache& calc, const lambda *_lambda, const error_model *p_error_model, const clade *_p_tree, double _lambda_multiplier, int _max_root_family_size, int _max_family_size);
+
 #endif /* CORE_H */
 
@@ -3,6 +3,7 @@
 #include <cassert>
 #include <algorithm>
 #include <cmath>
+#include <stdexcept>
 
 #include "error_model.h"
 
@@ -15,10 +16,12 @@ error_model::error_model()
 
 void error_model::set_max_family_size(size_t max_cnt) {
     _max_family_size = max_cnt;
+    _revision++;
 }
 
 void error_model::set_deviations(std::vector<std::string> deviations) {
     _deviations.resize(deviations.size());
+    _revision++;
     transform(deviations.begin(), deviations.end(), _deviations.begin(), [](const string& s) {return std::stoi(s); });
 }
 
@@ -47,9 +50,10 @@ void error_model::set_probabilities(size_t fam_size, std::vector<double> probs_d
         _error_dists.resize(fam_size + 1, _error_dists.back());
     }
     _error_dists[fam_size] = probs_deviation; // fam_size starts at 0 at tips, so fam_size = index of vector
+    _revision++;
 }
 
-std::vector<double> error_model::get_probs(size_t fam_size) const {
+const std::vector<double>& error_model::get_probs(size_t fam_size) const {
     if (fam_size >= _error_dists.size() && fam_size <= _max_family_size)
         return _error_dists.back();
 
@@ -33,6 +33,8 @@ private:
 
     std::vector<std::vector<double> > _error_dists; //!< Each vector element will be a gene family size; the vector of doubles inside (e.g., 0.1 0.8 0.1) will be the probs of deviating from the true value
 
+    size_t _revision = 0; //!< Incremented whenever the model changes
+
 public:
     error_model();
 
@@ -46,7 +48,7 @@ public:
     void set_probabilities(size_t fam_size, std::vector<double>);
 
     //! Get deviation probability vector for a certain family size
-    std::vector<double> get_probs(size_t fam_size) const;
+    const std::vector<double>& get_probs(size_t fam_size) const;
 
     size_t n_deviations() const {
         return _deviations.size();
@@ -55,6 +57,11 @@ public:
     size_t get_max_family_size() const {
         return _error_dists.size();
     }
+    //! Changes whenever the model does, so results calculated with it can tell if they are stale
+    size_t revision() const {
+        return _revision;
+    }
+
     std::vector<double> get_epsilons() const;
     void replace_epsilons(std::map<double, double>* new_epsilons);
     void update_single_epsilon(double new_epsilon);
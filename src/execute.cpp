@@ -155,8 +155,9 @@ void estimator::execute(std::vector<model *>& models)
                 /// For Gamma models, we tried using the most rapidly changing lambda multiplier here, but that
                 /// caused issues in the pvalue calculation. It should be best to use the original lambda
                 /// instead
+                /// The matrices are calculated as they are needed, as the reconstruction may use multiplied lambdas
                 matrix_cache cache(max(data.max_family_size, data.max_root_family_size) + 1);
-                cache.precalculate_matrices(get_lambda_values(p_model->get_lambda()), data.p_tree->get_branch_lengths());
+                cache.set_on_demand(true);
 
                 auto pvalues = compute_pvalues(data.p_tree, data.gene_families, p_model->get_lambda(), cache, 1000, data.max_family_size, data.max_root_family_size);
 
@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <stdexcept>
+
+#include "family_table.h"
+#include "gene_family.h"
+#include "compiled_tree.h"
+#include "clade.h"
+
+using namespace std;
+
+//! Gives each new column layout a number of its own
+static size_t next_layout()
+{
+    static atomic<size_t> layouts(0);
+    return ++layouts;
+}
+
+family_table::family_table() : _layout(next_layout())
+{
+}
+
+family_table::family_table(const std::vector<std::string>& species, size_t num_families) : _layout(next_layout())
+{
+    for (auto& s : species)
+        add_species(s);
+
+    _ids.resize(num_families);
+    _descs.resize(num_families);
+    _counts.resize(num_families * _species.size(), -1);
+    _max_counts.resize(num_families);
+}
+
+family_table::family_table(const compiled_tree& tree, size_t num_families) : _layout(next_layout())
+{
+    _species.resize(tree.leaf_count());
+    for (size_t i = 0; i < tree.size(); ++i)
+    {
+        if (tree.is_leaf(i))
+            _species[tree.leaf_column(i)] = tree.node(i)->get_taxon_name();
+    }
+    for (size_t column = 0; column < _species.size(); ++column)
+        _columns.emplace(_species[column], column);
+
+    _ids.resize(num_families);
+    _descs.resize(num_families);
+    _counts.resize(num_families * _species.size());
+    _max_counts.resize(num_families);
+}
+
+family_table::family_table(const compiled_tree& tree, const std::vector<gene_family>& families) : family_table(tree, families.size())
+{
+    for (size_t i = 0; i < families.size(); ++i)
+        set_family(i, families[i]);
+}
+
+size_t family_table::add_family()
+{
+    _ids.emplace_back();
+    _descs.emplace_back();
+    _counts.resize(_counts.size() + _species.size(), -1);
+    _max_counts.push_back(0);
+    return _max_counts.size() - 1;
+}
+
+int family_table::add_species(const std::string& species)
+{
+    auto it = _columns.find(species);
+    if (it != _columns.end())
+        return it->second;
+
+    // widen every row by one missing count
+    size_t width = _species.size();
+    vector<int32_t> widened(size() * (width + 1), -1);
+    for (size_t family = 0; family < size(); ++family)
+        copy(counts(family), counts(family) + width, widened.data() + family * (width + 1));
+    _counts.swap(widened);
+
+    _species.push_back(species);
+    _columns.emplace(species, width);
+    _layout = next_layout();
+    return width;
+}
+
+int family_table::column(const std::string& species) const
+{
+    auto it = _columns.find(species);
+    return it == _columns.end() ? -1 : it->second;
+}
+
+void family_table::set_family(size_t family, const gene_family& gf)
+{
+    _ids[family] = gf.id();
+    _descs[family] = gf.desc();
+    _max_counts[family] = 0;
+    for (size_t column = 0; column < _species.size(); ++column)
+    {
+        // a missing count is only an error if someone reads it
+        int32_t c = gf.has_species(_species[column]) ? gf.get_species_size(_species[column]) : -1;
+        _counts[family * _species.size() + column] = c;
+        _max_counts[family] = max(_max_counts[family], c);
+    }
+}
+
+void family_table::set_count(size_t family, int column, int32_t count)
+{
+    int32_t& c = _counts[family * _species.size() + column];
+    bool was_max = c == _max_counts[family];
+    c = count;
+    if (count >= _max_counts[family])
+        _max_counts[family] = count;
+    else if (was_max)
+        _max_counts[family] = max(0, *max_element(counts(family), counts(family) + _species.size()));
+}
+
+bool family_table::counts_match(size_t a, size_t b) const
+{
+    return equal(counts(a), counts(a) + _species.size(), counts(b));
+}
+
+void family_table::missing(size_t family, const std::string& species) const
+{
+    throw std::runtime_error(species + " was not found in gene family " + _ids[family]);
+}
+
+size_t family_table::hash(size_t family) const
+{
+    // FNV-1a over the counts
+    uint64_t h = 14695981039346656037ULL;
+    const int32_t *c = counts(family);
+    for (size_t i = 0; i < _species.size(); ++i)
+    {
+        h ^= uint32_t(c[i]);
+        h *= 1099511628211ULL;
+    }
+    return size_t(h);
+}
+
+void leaf_columns::resolve(const compiled_tree& tree, const family_table& families)
+{
+    if (_p_tree == &tree && _layout == families.layout())
+        return;
+
+    _columns.resize(tree.leaf_count());
+    _nodes.resize(tree.leaf_count());
+    for (size_t i = 0; i < tree.size(); ++i)
+    {
+        if (tree.is_leaf(i))
+        {
+            _columns[tree.leaf_column(i)] = families.column(tree.node(i)->get_taxon_name());
+            _nodes[tree.leaf_column(i)] = i;
+        }
+    }
+    _p_tree = &tree;
+    _layout = families.layout();
+}
+
+void leaf_columns::missing(const family_table& families, size_t family, int leaf) const
+{
+    families.missing(family, _p_tree->node(_nodes[leaf])->get_taxon_name());
+}
+
+//! For each family, returns the index of the first family with identical counts (possibly itself).
+/// Families that share a reference have the same likelihood, so only references need to be pruned
+vector<size_t> build_reference_list(const family_table& families)
+{
+    return hashed_reference_list(families.size(),
+        [&families](size_t i) { return families.hash(i); },
+        [&families](size_t a, size_t b) { return families.counts_match(a, b); });
+}
+
+vector<size_t> build_reference_list(const family_table& families, const vector<size_t>& rows)
+{
+    return hashed_reference_list(rows.size(),
+        [&](size_t i) { return families.hash(rows[i]); },
+        [&](size_t a, size_t b) { return families.counts_match(rows[a], rows[b]); });
+}
+
+shared_ptr<const family_table> tabulate(const vector<gene_family>& families, vector<size_t>& rows)
+{
+    rows.resize(families.size());
+    shared_ptr<const family_table> p_shared;
+    if (!families.empty())
+        p_shared = families[0].table();
+    bool shared = p_shared != nullptr && all_of(families.begin(), families.end(), [&p_shared](const gene_family& gf) {
+        return gf.table() == p_shared;
+    });
+    if (shared)
+    {
+        for (size_t i = 0; i < families.size(); ++i)
+            rows[i] = families[i].row();
+        return p_shared;
+    }
+
+    // species in the order the families first mention them
+    vector<string> species;
+    set<string, ci_less> seen;
+    for (auto& gf : families)
+    {
+        for (auto& s : gf.get_species())
+        {
+            if (seen.insert(s).second)
+                species.push_back(s);
+        }
+    }
+
+    auto p_table = make_shared<family_table>(species, families.size());
+    for (size_t i = 0; i < families.size(); ++i)
+    {
+        p_table->set_family(i, families[i]);
+        rows[i] = i;
+    }
+    return p_table;
+}
+
+shared_ptr<const family_table> tabulate(const gene_family& family, size_t& row)
+{
+    row = family.row();
+    if (family.table())
+        return family.table();
+
+    row = 0;
+    auto p_table = make_shared<family_table>(vector<string>(), 1);
+    p_table->set_family(0, family);
+    return p_table;
+}
@@ -0,0 +1,222 @@
+#ifndef FAMILY_TABLE_H
+#define FAMILY_TABLE_H
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cctype>
+#include <unordered_map>
+
+class gene_family;
+class compiled_tree;
+
+struct ci_less
+{
+    // case-independent (ci) compare_less binary function
+    struct nocase_compare
+    {
+        bool operator() (const unsigned char& c1, const unsigned char& c2) const {
+            return tolower(c1) < tolower(c2);
+        }
+    };
+    bool operator() (const std::string& s1, const std::string& s2) const {
+        return std::lexicographical_compare
+        (s1.begin(), s1.end(),   // source range
+            s2.begin(), s2.end(),   // dest range
+            nocase_compare());  // comparison
+    }
+};
+
+//! Gene family counts stored as a dense families x species table
+/*!
+Each row holds the counts of one family, and each column belongs to one species. Species names
+are resolved to columns once (case-insensitively), when the table is filled, so the hot loops read
+counts by index instead of looking up names. The largest count of each family is kept alongside.
+
+A table read from a file holds every family of the file, and each \ref gene_family is a view of
+one of its rows, so the counts are stored once however many models use them. A table built for a
+tree has one column per leaf, in the order of \ref compiled_tree::leaf_column. Other tables are
+matched to a tree's leaves with a \ref leaf_columns.
+
+A species that a family does not mention is stored as a missing value. Reading it through
+\ref count throws the same error \ref gene_family::get_species_size does.
+*/
+class family_table {
+    std::vector<std::string> _species;      //!< name of the species in each column
+    std::map<std::string, int, ci_less> _columns;   //!< column of each species
+    std::vector<std::string> _ids;
+    std::vector<std::string> _descs;
+    std::vector<int32_t> _counts;
+    std::vector<int32_t> _max_counts;
+    size_t _layout;                         //!< identifies the species and their order. See \ref layout
+public:
+    //! Creates a table with no species and no families
+    family_table();
+
+    //! Creates a table of num_families families with the given species, all counts missing
+    family_table(const std::vector<std::string>& species, size_t num_families);
+
+    //! Creates a table of num_families families with a column for each leaf of the tree, all counts zero
+    family_table(const compiled_tree& tree, size_t num_families);
+
+    family_table(const compiled_tree& tree, const std::vector<gene_family>& families);
+
+    //! Adds a family with every count missing, returning its row
+    size_t add_family();
+
+    //! Returns the column of the species, adding a column (with every count missing) if there is none
+    int add_species(const std::string& species);
+
+    //! The column of the species, or -1 if the table has none
+    int column(const std::string& species) const;
+
+    //! Copies the counts of the given family into the given row. Species the table has no column for are ignored
+    void set_family(size_t family, const gene_family& gf);
+
+    //! Sets a single count, keeping the family's max count up to date
+    void set_count(size_t family, int column, int32_t count);
+
+    void set_id(size_t family, const std::string& id) {
+        _ids[family] = id;
+    }
+
+    void set_desc(size_t family, const std::string& desc) {
+        _descs[family] = desc;
+    }
+
+    size_t size() const {
+        return _max_counts.size();
+    }
+
+    size_t species_count() const {
+        return _species.size();
+    }
+
+    const std::string& species(int column) const {
+        return _species[column];
+    }
+
+    //! count for the given family in the given column
+    int count(size_t family, int column) const
+    {
+        int32_t c = _counts[family * _species.size() + column];
+        if (c < 0)
+            missing(family, _species[column]);
+        return c;
+    }
+
+    //! all counts of a family, one per column. Missing counts are negative
+    const int32_t *counts(size_t family) const {
+        return _counts.data() + family * _species.size();
+    }
+
+    int max_count(size_t family) const {
+        return _max_counts[family];
+    }
+
+    const std::string& id(size_t family) const {
+        return _ids[family];
+    }
+
+    const std::string& desc(size_t family) const {
+        return _descs[family];
+    }
+
+    //! Returns true if every count of the two families is identical
+    bool counts_match(size_t a, size_t b) const;
+
+    //! A hash of the counts of a family. Families whose counts match have the same hash
+    size_t hash(size_t family) const;
+
+    //! Changes whenever columns are added. Tables with the same layout have the same species in the same columns
+    size_t layout() const {
+        return _layout;
+    }
+
+    //! Throws the error for a family that has no count for the species
+    [[noreturn]] void missing(size_t family, const std::string& species) const;
+};
+
+//! The column of a table holding each leaf of a tree
+/*!
+Leaves are matched to columns by name once, in \ref resolve, which does nothing while the tree
+and the table's layout stay the same. Counts are then read by leaf number.
+*/
+class leaf_columns {
+    const compiled_tree *_p_tree = nullptr;
+    size_t _layout = 0;
+    std::vector<int> _columns;      //!< column of each leaf, -1 if the table has no such species
+    std::vector<int> _nodes;        //!< node number of each leaf in _p_tree, for naming a missing species
+public:
+    //! Matches the leaves of the tree to the columns of the table
+    void resolve(const compiled_tree& tree, const family_table& families);
+
+    //! Forgets the last resolution, for when the tree it was made for goes away
+    void reset() {
+        _p_tree = nullptr;
+    }
+
+    //! count of the family at the leaf in the given position (see \ref compiled_tree::leaf_column)
+    int count(const family_table& families, size_t family, int leaf) const
+    {
+        int column = _columns[leaf];
+        int32_t c = column < 0 ? -1 : families.counts(family)[column];
+        if (c < 0)
+            missing(families, family, leaf);
+        return c;
+    }
+
+private:
+    [[noreturn]] void missing(const family_table& families, size_t family, int leaf) const;
+};
+
+//! For each of count items, returns the index of the first item equal to it (possibly itself)
+/*!
+Items are bucketed by hash(i), and equal(a, b) is only called for items in the same bucket, so
+the expected time is linear in the number of items.
+*/
+template<typename Hash, typename Equal>
+std::vector<size_t> hashed_reference_list(size_t count, Hash hash, Equal equal)
+{
+    std::vector<size_t> references(count);
+    std::unordered_multimap<size_t, size_t> first_of_hash;
+    first_of_hash.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t h = hash(i);
+        references[i] = i;
+        auto range = first_of_hash.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (equal(it->second, i))
+            {
+                references[i] = it->second;
+                break;
+            }
+        }
+        if (references[i] == i)
+            first_of_hash.emplace(h, i);
+    }
+
+    return references;
+}
+
+std::vector<size_t> build_reference_list(const family_table& families);
+
+//! For families given as rows of a table, returns the index of the first family with identical counts (possibly itself)
+std::vector<size_t> build_reference_list(const family_table& families, const std::vector<size_t>& rows);
+
+//! The table holding the given families, and the row of each
+/*!
+Families read from one file are already rows of one table, which is returned without copying.
+Otherwise the families are copied into a new table, one row each.
+*/
+std::shared_ptr<const family_table> tabulate(const std::vector<gene_family>& families, std::vector<size_t>& rows);
+
+//! The table holding the given family, and its row. A family with no counts gets a table of its own
+std::shared_ptr<const family_table> tabulate(const gene_family& family, size_t& row);
+
+#endif
@@ -7,12 +7,16 @@
 #include <iterator>
 #include <algorithm>
 #include <fstream>
+#include <omp.h>
 
 #include "gamma_core.h"
 #include "gamma.h"
 #include "root_equilibrium_distribution.h"
 #include "gene_family_reconstructor.h"
 #include "matrix_cache.h"
+#include "compiled_tree.h"
+#include "pruning_workspace.h"
+#include "family_table.h"
 #include "gene_family.h"
 #include "user_data.h"
 #include "optimizer_scorer.h"
@@ -63,6 +67,14 @@ void gamma_model::set_alpha(double alpha) {
 
 }
 
+std::vector<double> gamma_model::configuration() const
+{
+    auto result = model::configuration();
+    result.insert(result.end(), _gamma_cat_probs.begin(), _gamma_cat_probs.end());
+    result.insert(result.end(), _lambda_multipliers.begin(), _lambda_multipliers.end());
+    return result;
+}
+
 string comma_separated(const std::vector<double>& items)
 {
     string s;
@@ -141,30 +153,52 @@ bool gamma_model::can_infer() const
     return true;
 }
 
-bool gamma_model::prune(const gene_family& family, root_equilibrium_distribution *eq, matrix_cache& calc, const lambda *p_lambda,
-    std::vector<double>& category_likelihoods) 
+bool gamma_model::category_likelihoods_at_root(const pruning_workspace& workspace, int n, int j, int root_size, root_equilibrium_distribution *eq, std::vector<double>& category_likelihoods) const
 {
     category_likelihoods.clear();
 
     for (size_t k = 0; k < _gamma_cat_probs.size(); ++k)
     {
-        auto partial_likelihood = inference_prune(family, calc, p_lambda, _p_error_model, _p_tree, _lambda_multipliers[k], _max_root_family_size, _max_family_size);
-        if (accumulate(partial_likelihood.begin(), partial_likelihood.end(), 0.0) == 0.0)
-            return false;   // saturation
-
-        std::vector<double> full(partial_likelihood.size());
-        for (size_t j = 0; j < partial_likelihood.size(); ++j) {
-            double eq_freq = eq->compute(j);
-            full[j] = partial_likelihood[j] * eq_freq;
+        const double *partial_likelihood = workspace.root_likelihoods(k);
+        double total = 0.0;
+        double best = 0.0;
+        for (int s = 0; s < root_size; ++s) {
+            total += partial_likelihood[s * n + j];
+            best = max(best, partial_likelihood[s * n + j] * eq->compute(s));
         }
+        if (total == 0.0)
+            return false;   // saturation
 
         //        _category_likelihoods.push_back(accumulate(full.begin(), full.end(), 0.0) * _gamma_cat_probs[k]); // sum over all sizes (Felsenstein's approach)
-        category_likelihoods.push_back(*max_element(full.begin(), full.end()) * _gamma_cat_probs[k]); // get max (CAFE's approach)
+        category_likelihoods.push_back(best * _gamma_cat_probs[k]); // get max (CAFE's approach)
     }
 
     return true;
 }
 
+//! Computes the likelihood of each gamma category for a single family, pruning all categories in one walk over the tree
+bool gamma_model::prune(const gene_family& family, root_equilibrium_distribution *eq, matrix_cache& calc, const lambda *p_lambda,
+    std::vector<double>& category_likelihoods) 
+{
+    vector<unique_ptr<lambda>> multiplied;
+    vector<const lambda *> category_lambdas;
+    for (double multiplier : _lambda_multipliers)
+    {
+        multiplied.emplace_back(p_lambda->multiply(multiplier));
+        category_lambdas.push_back(multiplied.back().get());
+    }
+
+    // the family is pruned from its own table, in the calling thread's workspace
+    size_t row;
+    auto p_table = tabulate(family, row);
+    auto bounds = pruning_bounds(family.get_max_size(), _max_root_family_size, _max_family_size);
+    pruning_workspace& workspace = get_pruning_workspaces()[omp_get_thread_num()];
+    workspace.prepare(_p_tree, PRUNING_BLOCK_SIZE, _max_root_family_size, _max_family_size, category_lambdas.size());
+    workspace.prune_categories(*p_table, &row, 1, calc, category_lambdas.data(), _p_error_model, bounds.first, bounds.second);
+
+    return category_likelihoods_at_root(workspace, 1, 0, bounds.first, eq, category_likelihoods);
+}
+
 //! Infer bundle
 double gamma_model::infer_family_likelihoods(root_equilibrium_distribution *prior, const std::map<int, int>& root_distribution_map, const lambda *p_lambda) {
 
@@ -192,38 +226,86 @@ double gamma_model::infer_family_likelihoods(root_equilibrium_distribution *prio
     prior->initialize(&rd);
     vector<double> all_bundles_likelihood(_p_gene_families->size());
 
-    vector<bool> failure(_p_gene_families->size());
-    matrix_cache calc(max(_max_root_family_size, _max_family_size) + 1);
+    vector<char> failure(_p_gene_families->size());
+    matrix_cache& calc = get_inference_cache();
     prepare_matrices_for_simulation(calc);
 
     vector<vector<family_info_stash>> pruning_results(_p_gene_families->size());
 
-#pragma omp parallel for
-    for (size_t i = 0; i < _p_gene_families->size(); i++) {
-        auto& cat_likelihoods = _category_likelihoods[i];
-
-        if (prune(_p_gene_families->at(i), prior, calc, p_lambda, cat_likelihoods))
-        {
-            double family_likelihood = accumulate(cat_likelihoods.begin(), cat_likelihoods.end(), 0.0);
-
-            vector<double> posterior_probabilities = get_posterior_probabilities(cat_likelihoods);
+    // the lambda of each category, shared by every family
+    vector<unique_ptr<lambda>> multiplied;
+    vector<const lambda *> category_lambdas;
+    for (double multiplier : _lambda_multipliers)
+    {
+        multiplied.emplace_back(p_lambda->multiply(multiplier));
+        category_lambdas.push_back(multiplied.back().get());
+    }
 
-            pruning_results[i].resize(cat_likelihoods.size());
-            for (size_t k = 0; k < cat_likelihoods.size(); ++k)
+    vector<size_t> unique_families;
+    for (size_t i = 0; i < _p_gene_families->size(); ++i) {
+        if (references[i] == i)
+            unique_families.push_back(i);
+    }
+    auto block_starts = make_pruning_blocks(*_p_family_table, _family_rows, unique_families, _max_root_family_size, _max_family_size);
+    vector<size_t> unique_rows(unique_families.size());
+    for (size_t u = 0; u < unique_families.size(); ++u)
+        unique_rows[u] = _family_rows[unique_families[u]];
+    int num_blocks = block_starts.size() - 1;
+    auto& workspaces = get_pruning_workspaces();
+    const branch_matrices matrices(compiled_tree(_p_tree), calc, category_lambdas.data(), category_lambdas.size());
+
+    // prune blocks of distinct families, every category of a block in a single walk over the tree
+#pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < num_blocks; ++b) {
+        pruning_workspace& workspace = workspaces[omp_get_thread_num()];
+        workspace.prepare(_p_tree, PRUNING_BLOCK_SIZE, _max_root_family_size, _max_family_size, category_lambdas.size());
+
+        size_t first = block_starts[b];
+        int n = block_starts[b + 1] - first;
+        auto bounds = pruning_bounds(_p_family_table->max_count(unique_rows[first]), _max_root_family_size, _max_family_size);
+        workspace.prune_categories(*_p_family_table, &unique_rows[first], n, matrices, _p_error_model, bounds.first, bounds.second);
+
+        for (int j = 0; j < n; ++j) {
+            size_t i = unique_families[first + j];
+            auto& cat_likelihoods = _category_likelihoods[i];
+
+            if (category_likelihoods_at_root(workspace, n, j, bounds.first, prior, cat_likelihoods))
             {
-                pruning_results[i][k] = family_info_stash(_p_gene_families->at(i).id(),_lambda_multipliers[k], cat_likelihoods[k],
-                    family_likelihood, posterior_probabilities[k], posterior_probabilities[k] > 0.95);
-                //            cout << "Bundle " << i << " Process " << k << " family likelihood = " << family_likelihood << endl;
+                double family_likelihood = accumulate(cat_likelihoods.begin(), cat_likelihoods.end(), 0.0);
+
+                vector<double> posterior_probabilities = get_posterior_probabilities(cat_likelihoods);
+
+                pruning_results[i].resize(cat_likelihoods.size());
+                for (size_t k = 0; k < cat_likelihoods.size(); ++k)
+                {
+                    pruning_results[i][k] = family_info_stash(_p_gene_families->at(i).id(),_lambda_multipliers[k], cat_likelihoods[k],
+                        family_likelihood, posterior_probabilities[k], posterior_probabilities[k] > 0.95);
+                    //            cout << "Bundle " << i << " Process " << k << " family likelihood = " << family_likelihood << endl;
+                }
+                all_bundles_likelihood[i] = std::log(family_likelihood);
+            }
+            else
+            {
+                // we got here because one of the gamma categories was saturated - reject this 
+                failure[i] = true;
             }
-            all_bundles_likelihood[i] = std::log(family_likelihood);
-        }
-        else
-        {
-            // we got here because one of the gamma categories was saturated - reject this 
-            failure[i] = true;
         }
     }
 
+    // families with identical counts get the results of the first of them
+    for (size_t i = 0; i < _p_gene_families->size(); i++) {
+        size_t r = references[i];
+        if (r == i)
+            continue;
+
+        _category_likelihoods[i] = _category_likelihoods[r];
+        failure[i] = failure[r];
+        all_bundles_likelihood[i] = all_bundles_likelihood[r];
+        pruning_results[i] = pruning_results[r];
+        for (auto& stash : pruning_results[i])
+            stash.family_id = _p_gene_families->at(i).id();
+    }
+
     if (find(failure.begin(), failure.end(), true) != failure.end())
     {
         for (size_t i = 0; i < _p_gene_families->size(); i++) {
@@ -312,7 +394,8 @@ reconstruction* gamma_model::reconstruct_ancestral_states(const vector<gene_fami
         }
     }
 
-    calc->precalculate_matrices(all, _p_tree->get_branch_lengths());
+    if (!calc->is_on_demand())
+        calc->precalculate_matrices(all, _p_tree->get_branch_lengths());
 
     gamma_model_reconstruction* result = new gamma_model_reconstruction(_lambda_multipliers);
     vector<gamma_model_reconstruction::gamma_reconstruction *> recs(families.size());
@@ -324,6 +407,10 @@ reconstruction* gamma_model::reconstruct_ancestral_states(const vector<gene_fami
     }
 
 
+    compiled_tree tree(_p_tree);
+    vector<size_t> rows;
+    auto p_table = tabulate(families, rows);
+    auto family_references = build_reference_list(*p_table, rows);
     for (size_t k = 0; k < _gamma_cat_probs.size(); ++k)
     {
         unique_ptr<lambda> ml(_p_lambda->multiply(_lambda_multipliers[k]));
@@ -331,10 +418,18 @@ reconstruction* gamma_model::reconstruct_ancestral_states(const vector<gene_fami
 #pragma omp parallel for
         for (size_t i = 0; i < families.size(); ++i)
         {
-            reconstruct_gene_family(ml.get(), _p_tree, _max_family_size, _max_root_family_size, &families[i], calc, prior, recs[i]->category_reconstruction[k]);
+            if (family_references[i] == i)
+                reconstruct_gene_family(ml.get(), tree, _max_family_size, _max_root_family_size, *p_table, rows[i], calc, prior, recs[i]->category_reconstruction[k]);
         }
     }
 
+    // families with identical counts have identical reconstructions
+    for (size_t i = 0; i < families.size(); ++i)
+    {
+        if (family_references[i] != i)
+            recs[i]->category_reconstruction = recs[family_references[i]]->category_reconstruction;
+    }
+
     for (auto reconstruction : recs)
     {
         // multiply every reconstruction by gamma_cat_prob
@@ -53,6 +53,10 @@ private:
     double _alpha;
 
     std::vector<double> get_posterior_probabilities(std::vector<double> cat_likelihoods);
+
+    //! Fills in the likelihood of each category for family j of a block pruned by \ref pruning_workspace::prune_categories.
+    /// Returns false if one of the categories is saturated
+    bool category_likelihoods_at_root(const pruning_workspace& workspace, int n, int j, int root_size, root_equilibrium_distribution *eq, std::vector<double>& category_likelihoods) const;
 public:
 
     //! Calculate gamma categories and lambda multipliers based on category count and a fixed alpha
@@ -98,6 +102,9 @@ public:
 
     void prepare_matrices_for_simulation(matrix_cache& cache) override;
 
+    //! The model's configuration includes the gamma categories and their lambda multipliers
+    std::vector<double> configuration() const override;
+
     bool can_infer() const;
 
     bool prune(const gene_family& family, root_equilibrium_distribution *eq, matrix_cache& calc, const lambda *p_lambda,
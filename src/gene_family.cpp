@@ -1,20 +1,59 @@
 #include <algorithm>
 #include <set>
+#include <stdexcept>
+#include <functional>
+#include <cmath>
 
 #include "gene_family.h"
 #include "clade.h"
 
 using namespace std;
 
-// these functions are intended to work with maps (key, value pairs)
-template <typename T, typename U>
-bool max_key(const std::pair<T, U>& p1, const std::pair<T, U>& p2) {
-	return p1.first < p2.first;
+family_table& gene_family::own_table()
+{
+    if (!_p_table)
+    {
+        _p_table = make_shared<family_table>();
+        _row = _p_table->add_family();
+    }
+    else if (_p_table.use_count() > 1 || _p_table->size() > 1)
+    {
+        // move the family's row to a table of its own
+        auto species = get_species();
+        auto p_table = make_shared<family_table>(species, 1);
+        p_table->set_family(0, *this);
+        _p_table = p_table;
+        _row = 0;
+    }
+    return *_p_table;
 }
 
-template <typename T, typename U>
-bool max_value(const std::pair<T, U>& p1, const std::pair<T, U>& p2) {
-	return p1.second < p2.second;
+void gene_family::set_desc(std::string desc)
+{
+    auto& table = own_table();
+    table.set_desc(_row, desc);
+}
+
+void gene_family::set_id(std::string id)
+{
+    auto& table = own_table();
+    table.set_id(_row, id);
+}
+
+void gene_family::set_species_size(std::string species, int gene_count)
+{
+    auto& table = own_table();
+    table.set_count(_row, table.add_species(species), gene_count);
+}
+
+std::string gene_family::id() const
+{
+    return _p_table ? _p_table->id(_row) : string();
+}
+
+std::string gene_family::desc() const
+{
+    return _p_table ? _p_table->desc(_row) : string();
 }
 
 //! Find and set _max_family_size and _parsed_max_family_size for this family
@@ -23,39 +62,73 @@ CAFE had a not_root_max (which we use = _parsed_max_family_size; see below) and
 */
 int gene_family::get_max_size() const {
     // Max family size can only be found if there is data inside the object in the first place
-    int max_family_size = 0;
-    if (!_species_size_map.empty()) {
-        max_family_size = (*max_element(_species_size_map.begin(), _species_size_map.end(), max_value<string, int>)).second;
-        //_parsed_max_family_size = _max_family_size + std::max(50, _max_family_size/5);
-    }
-    return max_family_size;
+    return _p_table ? _p_table->max_count(_row) : 0;
 }
 
 
 //! Mainly for debugging: In case one want to grab the gene count for a given species
-int gene_family::get_species_size(std::string species) const {
-    // First checks if species data has been entered (i.e., is key in map?)
-    if (_species_size_map.find(species) == _species_size_map.end()) {
-        throw std::runtime_error(species + " was not found in gene family " + _id);
+int gene_family::get_species_size(const std::string& species) const {
+    // First checks if species data has been entered
+    if (!has_species(species)) {
+        throw std::runtime_error(species + " was not found in gene family " + id());
     }
 
-    return _species_size_map.at(species);
+    return _p_table->counts(_row)[_p_table->column(species)];
 }
 
-//! Return first element of pair
-template <typename type1, typename type2>
-type1 do_get_species(const std::pair<type1, type2> & p1) {
-    return p1.first;
+bool gene_family::has_species(const std::string& species) const
+{
+    if (!_p_table)
+        return false;
+
+    int column = _p_table->column(species);
+    return column >= 0 && _p_table->counts(_row)[column] >= 0;
 }
 
-//! Return vector of species names
+//! Return vector of species names, in case-insensitive order
 vector<std::string> gene_family::get_species() const {
-    vector<std::string> species_names(_species_size_map.size());
-    transform(_species_size_map.begin(), _species_size_map.end(), species_names.begin(), do_get_species<string, int>); // Transform performs an operation on all elements of a container (here, the operation is the template)
+    vector<std::string> species_names;
+    if (!_p_table)
+        return species_names;
+
+    const int32_t *counts = _p_table->counts(_row);
+    for (size_t column = 0; column < _p_table->species_count(); ++column)
+    {
+        if (counts[column] >= 0)
+            species_names.push_back(_p_table->species(column));
+    }
+    sort(species_names.begin(), species_names.end(), ci_less());
 
     return species_names;
 }
 
+bool gene_family::species_size_match(const gene_family& other) const
+{
+    if (_p_table && _p_table == other._p_table)
+        return _p_table->counts_match(_row, other._row);
+
+    auto species = get_species();
+    if (species.size() != other.get_species().size())
+        return false;
+
+    return all_of(species.begin(), species.end(), [&](const string& s) {
+        return other.has_species(s) && other.get_species_size(s) == get_species_size(s);
+    });
+}
+
+size_t gene_family::species_size_hash() const
+{
+    // summed over the species, so the order of the columns does not matter
+    size_t h = 0;
+    for (auto& s : get_species())
+    {
+        string name(s);
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        h += std::hash<string>()(name) * 31 + std::hash<int>()(get_species_size(s));
+    }
+    return h;
+}
+
 /// returns true if the family exists at the root, according to their parsimony reconstruction.
 bool gene_family::exists_at_root(const clade *p_tree) const
 {
@@ -90,9 +163,24 @@ bool gene_family::exists_at_root(const clade *p_tree) const
 
 int gene_family::species_size_differential() const
 {
-    auto compare = [](const std::pair<string, int>& a, const std::pair<string, int>& b) { return a.second < b.second; };
-    int max_species_size = max_element(_species_size_map.begin(), _species_size_map.end(), compare)->second;
-    int min_species_size = min_element(_species_size_map.begin(), _species_size_map.end(), compare)->second;
+    int max_species_size = 0;
+    int min_species_size = 0;
+    bool first = true;
+    for (auto& s : get_species())
+    {
+        int size = get_species_size(s);
+        max_species_size = first ? size : max(max_species_size, size);
+        min_species_size = first ? size : min(min_species_size, size);
+        first = false;
+    }
     return max_species_size - min_species_size;
 }
 
+
+/// The margins are wide enough that sizes beyond them have negligible probability
+std::pair<int, int> family_size_limits(int max_count)
+{
+    int max_root_family_size = std::max(30, static_cast<int>(std::rint(max_count*1.25)));
+    int max_family_size = max_count + std::max(50, max_count / 5);
+    return std::make_pair(max_root_family_size, max_family_size);
+}
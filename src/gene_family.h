@@ -2,60 +2,58 @@
 #define GENE_FAMILY_H
 
 #include <string>
-#include <map>
 #include <vector>
+#include <utility>
+#include <memory>
 
-class clade;
-
-struct ci_less
-{
-    // case-independent (ci) compare_less binary function
-    struct nocase_compare
-    {
-        bool operator() (const unsigned char& c1, const unsigned char& c2) const {
-            return tolower(c1) < tolower(c2);
-        }
-    };
-    bool operator() (const std::string& s1, const std::string& s2) const {
-        return std::lexicographical_compare
-        (s1.begin(), s1.end(),   // source range
-            s2.begin(), s2.end(),   // dest range
-            nocase_compare());  // comparison
-    }
-};
+#include "family_table.h"
 
+class clade;
 
+//! One gene family: its ID, description and the count of each species
+/*!
+A family is a view of one row of a \ref family_table. Families read from a file are all rows of
+the same table, so their counts are stored once, in columns, and copying a family only copies
+the reference to its row. Changing a family that shares its table with others first moves its
+row to a table of its own, so copies of a family never change each other.
+*/
 class gene_family {
 private:
-    std::string _id; //!< Gene family ID
-    std::string _desc; //!< Gene family description
+    std::shared_ptr<family_table> _p_table; //!< Table holding the family's counts. Null until one is set
+    size_t _row = 0;                        //!< Row of the family in _p_table
 
-    std::map<std::string, int, ci_less> _species_size_map; //!< Map that stores each species gene family count: {sp1_name:count1, ...}
+    //! The table, after making sure that changing the family's row changes no other family
+    family_table& own_table();
 
 public:
     gene_family() { }
 
-    void set_desc(std::string desc) { _desc = desc; }
+    //! A view of the given row of the table
+    gene_family(std::shared_ptr<family_table> p_table, size_t row) : _p_table(p_table), _row(row) { }
 
-    void set_id(std::string id) { _id = id; }
+    void set_desc(std::string desc);
 
-    void set_species_size(std::string species, int gene_count) {
-        _species_size_map[species] = gene_count;
-    }
+    void set_id(std::string id);
+
+    void set_species_size(std::string species, int gene_count);
 
     std::vector<std::string> get_species() const;
 
     int get_max_size() const;
 
-    std::string id() const { return _id; }
+    std::string id() const;
+
+    std::string desc() const;
 
-    int get_species_size(std::string species) const;
+    int get_species_size(const std::string& species) const;
+
+    bool has_species(const std::string& species) const;
 
     //! Returns true if every species size for both gene families are identical
-    bool species_size_match(const gene_family& other) const
-    {
-        return _species_size_map == other._species_size_map;
-    }
+    bool species_size_match(const gene_family& other) const;
+
+    //! A hash of the species and sizes. Families whose species sizes match have the same hash
+    size_t species_size_hash() const;
 
     /// returns true if the family exists at the root of the given tree, according to their parsimony reconstruction.
     bool exists_at_root(const clade *p_tree) const;
@@ -63,5 +61,18 @@ public:
     //! Returns largest species size minus smallest species size
     int species_size_differential() const;
 
+    //! The table holding the family's counts, null if it has none
+    std::shared_ptr<const family_table> table() const {
+        return _p_table;
+    }
+
+    //! The row of the family in \ref table
+    size_t row() const {
+        return _row;
+    }
 };
+
+//! The largest root family size and family size worth calculating for families whose counts are at most max_count
+std::pair<int, int> family_size_limits(int max_count);
+
 #endif
@@ -9,6 +9,8 @@
 #include "root_equilibrium_distribution.h"
 #include "gene_family.h"
 #include "user_data.h"
+#include "compiled_tree.h"
+#include "family_table.h"
 
 void reconstruct_leaf_node(const clade * c, const lambda * _lambda, clademap<std::vector<int>>& all_node_Cs, clademap<std::vector<double>>& all_node_Ls, int _max_family_size, const gene_family* _gene_family, const matrix_cache *_p_calc)
 {
@@ -135,33 +137,120 @@ void reconstruct_gene_family(const lambda* lambda, const clade *p_tree,
     matrix_cache *p_calc,
     root_equilibrium_distribution* p_prior, clademap<int>& reconstructed_states)
 {
-    clademap<std::vector<int>> all_node_Cs;
-
-    /// Ls hold a probability for each family size (values are probabilities of any given family size)
-    clademap<std::vector<double>> all_node_Ls;
+    compiled_tree tree(p_tree);
+    vector<size_t> rows;
+    auto p_table = tabulate(vector<gene_family>{ *gf }, rows);
+    reconstruct_gene_family(lambda, tree, max_family_size, max_root_family_size, *p_table, rows[0], p_calc, p_prior, reconstructed_states);
+}
 
-    std::function <void(const clade *)> pupko_reconstructor;
-    pupko_reconstructor = [&](const clade *c) {
-        reconstruct_at_node(c, lambda, all_node_Cs, all_node_Ls, max_family_size, max_root_family_size, p_calc, p_prior, gf);
+/// Pupko's joint reconstruction algorithm on the compiled tree. Does the same work as
+/// \ref reconstruct_at_node on each node, but keeps the C and L vectors in arrays indexed by node number
+void reconstruct_gene_family(const lambda* lambda, const compiled_tree& tree,
+    int max_family_size,
+    int max_root_family_size,
+    const family_table& families, size_t family,
+    matrix_cache *p_calc,
+    root_equilibrium_distribution* p_prior, clademap<int>& reconstructed_states)
+{
+    size_t sz = max_family_size + 1;
+
+    /// Cs hold the best child size for each parent size, Ls hold a probability for each family size
+    vector<int> all_node_Cs(tree.size() * sz);
+    vector<double> all_node_Ls(tree.size() * sz);
+    vector<double> children_product(sz);
+    leaf_columns columns;
+    columns.resolve(tree, families);
+
+    auto product_of_children = [&](int node, size_t n) {
+        fill(children_product.begin(), children_product.begin() + n, 1.0);
+        for (auto child = tree.children_begin(node); child != tree.children_end(node); ++child)
+        {
+            const double *child_L = &all_node_Ls[*child * sz];
+            for (size_t j = 0; j < n; ++j)
+                children_product[j] *= child_L[j];
+        }
     };
 
-    std::function<void(const clade *child)> backtracker;
-    backtracker = [&reconstructed_states, &all_node_Cs, &backtracker](const clade *child) {
-        if (!child->is_leaf())
+    for (int node : tree.postorder())
+    {
+        int *C = &all_node_Cs[node * sz];
+        double *L = &all_node_Ls[node * sz];
+        const clade *c = tree.node(node);
+        if (tree.is_leaf(node))
         {
-            auto& C = all_node_Cs[child];
-            int parent_c = reconstructed_states[child->get_parent()];
-            reconstructed_states[child] = C[parent_c];
-            child->apply_to_descendants(backtracker);
+            int observed_count = columns.count(families, family, tree.leaf_column(node));
+            fill(C, C + sz, observed_count);
+
+            auto matrix = p_calc->get_matrix(tree.branch_length(node), lambda->get_value_for_clade(c));
+            // i will be the parent size
+            for (size_t i = 1; i < sz; ++i)
+            {
+                L[i] = matrix->get(i, observed_count);
+            }
         }
-        };
+        else if (tree.is_root(node))
+        {
+            // At the root, we pick a single reconstructed state (step 4 of Pupko)
+            size_t n = min(max_family_size, max_root_family_size) + 1;
+            product_of_children(node, n);
 
-    // Pupko's joint reconstruction algorithm
-    p_tree->apply_reverse_level_order(pupko_reconstructor);
+            double max_val = -1;
+            for (size_t j = 1; j < n; ++j)
+            {
+                double val = children_product[j] * p_prior->compute(j);
+                if (val > max_val)
+                {
+                    max_val = val;
+                    C[0] = j;
+                }
+            }
+
+            if (max_val == 0.0)
+            {
+                cerr << "WARNING: failed to calculate L value at root" << endl;
+            }
+        }
+        else
+        {
+            auto matrix = p_calc->get_matrix(tree.branch_length(node), lambda->get_value_for_clade(c));
 
-    reconstructed_states[p_tree] = all_node_Cs[p_tree][0];
-    p_tree->apply_to_descendants(backtracker);
+            if (matrix->is_zero())
+                throw runtime_error("Zero matrix found");
 
+            product_of_children(node, sz);
+            // i is the parent, j is the child
+            for (size_t i = 0; i < sz; ++i)
+            {
+                size_t max_j = 0;
+                double max_val = -1;
+                for (size_t j = 0; j < sz; ++j)
+                {
+                    double val = children_product[j] * matrix->get(i, j);
+                    if (val > max_val)
+                    {
+                        max_j = j;
+                        max_val = val;
+                    }
+                }
+
+                L[i] = max_val;
+                C[i] = max_j;
+            }
+        }
+    }
+
+    // walk back down the tree, picking the best size for each internal node given its parent's size
+    vector<int> states(tree.size());
+    states[0] = all_node_Cs[0];
+    reconstructed_states[tree.node(0)] = states[0];
+    for (int node : tree.preorder())
+    {
+        if (tree.is_root(node) || tree.is_leaf(node))
+            continue;
+
+        states[node] = all_node_Cs[node * sz + states[tree.parent(node)]];
+        reconstructed_states[tree.node(node)] = states[node];
+    }
 }
 
 string newick_node(const clade *node, const cladevector& order, bool significant, std::function<std::string(const clade *c)> textwriter)
@@ -5,6 +5,8 @@
 #include <map>
 
 class matrix_cache;
+class compiled_tree;
+class family_table;
 
 void reconstruct_leaf_node(const clade * c, const lambda * _lambda, clademap<std::vector<int>>& all_node_Cs, clademap<std::vector<double>>& all_node_Ls, int _max_family_size, const gene_family* _gene_family, const matrix_cache *_p_calc);
 void reconstruct_at_node(const clade *c, const lambda *_lambda, clademap<std::vector<int>>& all_node_Cs, clademap<std::vector<double>>& all_node_Ls, int max_family_size, int max_root_family_size, const matrix_cache* p_calc, const root_equilibrium_distribution* p_prior, const gene_family *p_family);
@@ -19,6 +21,15 @@ void reconstruct_gene_family(const lambda* lambda, const clade *p_tree,
     matrix_cache *p_calc,
     root_equilibrium_distribution* p_prior, clademap<int>& reconstructed_states);
 
+/// As above, on a tree that has already been compiled, for one row of a family table.
+/// Used when reconstructing many families on the same tree.
+void reconstruct_gene_family(const lambda* lambda, const compiled_tree& tree,
+    int max_family_size,
+    int max_root_family_size,
+    const family_table& families, size_t family,
+    matrix_cache *p_calc,
+    root_equilibrium_distribution* p_prior, clademap<int>& reconstructed_states);
+
 branch_probabilities::branch_probability compute_viterbi_sum(const clade* c, const gene_family& family, const reconstruction* rec, int max_family_size, const matrix_cache& cache, const lambda* p_lambda);
 
 void print_branch_probabilities(std::ostream& ost, const cladevector& order, const vector<gene_family>& gene_families, const branch_probabilities& branch_probabilities);
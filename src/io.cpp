@@ -41,6 +41,10 @@ struct option longopts[] = {
   { "optimizer_expansion", optional_argument, NULL, 'E' },
   { "optimizer_reflection", optional_argument, NULL, 'R' },
   { "optimizer_iterations", optional_argument, NULL, 'I' },
+  { "optimizer_starts", required_argument, NULL, 'K' },
+  { "matrix_method", required_argument, NULL, 'M' },
+  { "matrix_tolerance", required_argument, NULL, 'T' },
+  { "matrix_store", required_argument, NULL, 'S' },
   { "help", no_argument, NULL, 'h'},
   { 0, 0, 0, 0 }
 };
@@ -56,6 +60,16 @@ void input_parameters::check_input() {
         throw runtime_error("Multiple lambda values (-m) specified with no lambda tree (-y)");
     }
     
+    //! Option -M must name a known transition matrix generator
+    if (matrix_method != "sum" && matrix_method != "recurrence") {
+        throw runtime_error("Unknown matrix method '" + matrix_method + "'. Use 'sum' or 'recurrence'.");
+    }
+
+    //! Option -T is a probability mass, so it must be at least zero and below one
+    if (matrix_tolerance < 0.0 || matrix_tolerance >= 1.0) {
+        throw runtime_error("Matrix tolerance must be at least 0 and less than 1.");
+    }
+
     //! Options -l and -i have to be both specified (if estimating and not simulating).
     if (fixed_lambda > 0.0 && input_file_path.empty() && !is_simulating) {
         throw runtime_error("Options -l and -i must both be provided an argument.");
@@ -130,10 +144,15 @@ clade* read_tree(string tree_file_path, bool lambda_tree) {
 //! Read gene family data from user-provided tab-delimited file
 /*!
   This function is called by execute::read_gene_family_data, which is itself called by CAFExp's main function when "--infile"/"-i" is specified  
+
+  The counts of every family read are stored in a single \ref family_table, and each family
+  appended to gene_families is a view of its row
 */
 void read_gene_families(std::istream& input_file, clade *p_tree, std::vector<gene_family> &gene_families) {
     map<int, std::string> sp_col_map; // For dealing with CAFE input format, {col_idx: sp_name} 
     map<int, string> leaf_indices; // For dealing with CAFExp input format, {idx: sp_name}, idx goes from 0 to number of species
+    map<int, int> table_columns; // {col_idx: column of the species in the table}
+    auto p_table = make_shared<family_table>();
     std::string line;
     bool is_header = true;
     int index = 0;
@@ -156,7 +175,10 @@ void read_gene_families(std::istream& input_file, clade *p_tree, std::vector<gen
                 auto p_descendant = p_tree->find_descendant(taxon_name); // Searches (from root down) and grabs clade "taxon_name" root
                 
                 if (p_descendant == NULL) { throw std::runtime_error(taxon_name + " not located in tree"); }
-                if (p_descendant->is_leaf()) { leaf_indices[index] = taxon_name; } // Only leaves matter for computation or estimation
+                if (p_descendant->is_leaf()) { // Only leaves matter for computation or estimation
+                    leaf_indices[index] = taxon_name;
+                    table_columns[index] = p_table->add_species(taxon_name);
+                }
                 index++;
             }
             
@@ -169,6 +191,7 @@ void read_gene_families(std::istream& input_file, clade *p_tree, std::vector<gen
                     for (size_t i = 0; i < tokens.size(); ++i) {
                         if (i == 0 || i == 1) {} // Ignoring description and ID columns
                         sp_col_map[i] = tokens[i];
+                        if (i > 1) table_columns[i] = p_table->add_species(tokens[i]);
                     }
                 }
             }
@@ -176,16 +199,17 @@ void read_gene_families(std::istream& input_file, clade *p_tree, std::vector<gen
         
         // Header has ended, reading gene family counts
         else {
-            gene_family genfam; 
+            size_t row = p_table->add_family();
             
             for (size_t i = 0; i < tokens.size(); ++i) {                
                 // If reading CAFE input format, leaf_indices (which is for CAFExp input format) should be empty
                 if (leaf_indices.empty()) {
-                    if (i == 0) { genfam.set_desc(tokens[i]); }
-                    else if (i == 1) { genfam.set_id(tokens[i]); }
+                    if (i == 0) { p_table->set_desc(row, tokens[i]); }
+                    else if (i == 1) { p_table->set_id(row, tokens[i]); }
                     else {
-                        std::string sp_name = sp_col_map[i];
-                        genfam.set_species_size(sp_name, atoi(tokens[i].c_str()));
+                        if (table_columns.find(i) == table_columns.end())
+                            table_columns[i] = p_table->add_species(sp_col_map[i]);
+                        p_table->set_count(row, table_columns[i], atoi(tokens[i].c_str()));
                         // cout << "Species " << sp_name << " has " << tokens[i] << "gene members." << endl;
                     }
                 }
@@ -194,19 +218,18 @@ void read_gene_families(std::istream& input_file, clade *p_tree, std::vector<gen
                 else {
                     // If index i is in leaf_indices
                     if (leaf_indices.find(i) != leaf_indices.end()) { // This should always be true...
-                        std::string sp_name = leaf_indices[i];
-                        genfam.set_species_size(sp_name, atoi(tokens[i].c_str()));
+                        p_table->set_count(row, table_columns[i], atoi(tokens[i].c_str()));
                         // cout << "Species " << sp_name << " has " << tokens[i] << "gene members." << endl;
                     }
                     else
                     {
                         if (i == tokens.size() - 1)
-                            genfam.set_id(tokens[i]);
+                            p_table->set_id(row, tokens[i]);
                     }
                 }
             }
             
-            gene_families.push_back(genfam);
+            gene_families.push_back(gene_family(p_table, row));
         }
     }
 
@@ -28,6 +28,9 @@ public:
     std::string fixed_multiple_lambdas;
     std::string chisquare_compare;
     std::string rootdist;
+    std::string matrix_method = "sum";
+    double matrix_tolerance = 0.0;
+    std::string matrix_store_path;
     double fixed_lambda = 0.0;
     double fixed_alpha = -1.0;
     double poisson_lambda = 0.0;
@@ -26,7 +26,7 @@ public:
     virtual int count() const = 0;
     virtual std::string to_string() const = 0;
     virtual double get_value_for_clade(const clade *c) const = 0;
-    virtual bool is_valid() = 0;
+    virtual bool is_valid() const = 0;
     virtual lambda* clone() const = 0;
 
     virtual ~lambda() {}
@@ -55,7 +55,7 @@ public:
     virtual double get_value_for_clade(const clade *c) const override {
         return _lambda;
     }
-    virtual bool is_valid() override {
+    virtual bool is_valid() const override {
         return _lambda > 0;
     }
     virtual lambda *clone() const override {
@@ -88,7 +88,7 @@ public:
     }
     virtual std::string to_string() const override;
     virtual double get_value_for_clade(const clade *c) const override;
-    virtual bool is_valid() override;
+    virtual bool is_valid() const override;
 
     std::vector<double> get_lambdas() const {
         return _lambdas;
@@ -52,13 +52,15 @@ namespace LikelihoodRatioTest
         auto references = build_reference_list(data.gene_families);
 
         matrix_cache cache(max(data.max_root_family_size, data.max_family_size) + 1);
+        pruning_workspace workspace;
+        vector<double> values;
         for (size_t i = 0; i < data.gene_families.size(); i += 1)
         {
             auto& pitem = data.gene_families[i];
             if (references[i] != i) continue;
 
             cache.precalculate_matrices(get_lambda_values(data.p_lambda), data.p_tree->get_branch_lengths());
-            auto values = inference_prune(pitem, cache, data.p_lambda, data.p_error_model, data.p_tree, 1.0, data.max_root_family_size, data.max_family_size);
+            inference_prune(pitem, cache, data.p_lambda, data.p_error_model, data.p_tree, 1.0, data.max_root_family_size, data.max_family_size, workspace, values);
             double maxlh1 = *max_element(values.begin(), values.end());
             double prev = -1;
             double next = get_likelihood_for_diff_lambdas(pitem, data.p_tree, data.p_lambda_tree, 0, lambda_cache, p_opt, data.max_root_family_size, data.max_family_size);
@@ -71,6 +73,13 @@ namespace LikelihoodRatioTest
             pvalues[i] = (prev == maxlh1) ? 1 : 2 * (log(prev) - log(maxlh1));
             lambda_index[i] = j - 2;
         }
+
+        // families with identical counts get the results of the first of them
+        for (size_t i = 0; i < data.gene_families.size(); ++i)
+        {
+            pvalues[i] = pvalues[references[i]];
+            lambda_index[i] = lambda_index[references[i]];
+        }
     }
 
     void likelihood_ratio_report(std::ostream & ost, const std::vector<gene_family> & families,
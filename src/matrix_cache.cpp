@@ -3,9 +3,12 @@
 #include <iostream>
 #include <algorithm>
 #include <sstream>
+#include <cstring>
 
 #include "matrix_cache.h"
+#include "matrix_store.h"
 #include "probability.h"
+#include "error_model.h"
 
 #ifdef HAVE_BLAS
 #ifdef HAVE_OPENBLAS
@@ -15,9 +18,142 @@
 #endif
 #endif
 
+matrix_generator matrix_cache::_default_generator = BirthDeathSum;
+double matrix_cache::_default_tolerance = 0.0;
+matrix_store *matrix_cache::_p_default_store = nullptr;
+
 bool matrix::is_zero() const
 {
-    return *max_element(values.begin(), values.end()) == 0;
+    return values.empty() || *max_element(values.begin(), values.end()) == 0;
+}
+
+/*!
+The entries dropped from a row are always the smaller of its two ends, so each row keeps the
+narrowest band that still holds all but tolerance of its mass. With a tolerance of zero only
+exact zeros are dropped. Dropped entries read as zero afterwards, and the matrix can no longer be
+\ref set.
+*/
+void matrix::truncate(double tolerance)
+{
+    if (is_banded())
+        return;
+
+    vector<int> row_begin(_size), row_end(_size);
+    vector<size_t> row_offset(_size);
+    size_t total = 0;
+    for (int s = 0; s < _size; ++s)
+    {
+        const double *row = &values[size_t(s) * _size];
+        int begin = 0, end = _size;
+        double dropped = 0.0;
+        while (begin < end)
+        {
+            bool left = row[begin] <= row[end - 1];
+            double smallest = left ? row[begin] : row[end - 1];
+            if (dropped + smallest > tolerance)
+                break;
+
+            dropped += smallest;
+            if (left)
+                ++begin;
+            else
+                --end;
+        }
+        record_dropped_mass(dropped);
+
+        row_begin[s] = begin;
+        row_end[s] = end;
+        row_offset[s] = total;
+        total += end - begin;
+    }
+
+    vector<double> banded(total);
+    for (int s = 0; s < _size; ++s)
+        copy(values.begin() + size_t(s) * _size + row_begin[s], values.begin() + size_t(s) * _size + row_end[s], banded.begin() + row_offset[s]);
+
+    values.swap(banded);
+    _row_begin.swap(row_begin);
+    _row_end.swap(row_end);
+    _row_offset.swap(row_offset);
+}
+
+/*!
+The layout is the largest dropped mass, a flag telling whether the matrix is banded, the first and
+end column of each row if it is, and then the stored values.
+*/
+size_t matrix::serialized_size() const
+{
+    return sizeof(double) + 2 * sizeof(int32_t) + _row_begin.size() * 2 * sizeof(int32_t) + values.size() * sizeof(double);
+}
+
+void matrix::serialize(char *out) const
+{
+    int32_t banded[2] = { is_banded(), 0 };
+    memcpy(out, &_dropped_mass, sizeof(double));
+    out += sizeof(double);
+    memcpy(out, banded, sizeof(banded));
+    out += sizeof(banded);
+    for (size_t s = 0; s < _row_begin.size(); ++s)
+    {
+        int32_t row[2] = { _row_begin[s], _row_end[s] };
+        memcpy(out, row, sizeof(row));
+        out += sizeof(row);
+    }
+    if (!values.empty())
+        memcpy(out, values.data(), values.size() * sizeof(double));
+}
+
+bool matrix::deserialize(const char *in, size_t length)
+{
+    const char *end = in + length;
+    double dropped_mass;
+    int32_t banded[2];
+    if (length < sizeof(dropped_mass) + sizeof(banded))
+        return false;
+    memcpy(&dropped_mass, in, sizeof(dropped_mass));
+    in += sizeof(dropped_mass);
+    memcpy(banded, in, sizeof(banded));
+    in += sizeof(banded);
+
+    vector<int> row_begin, row_end;
+    vector<size_t> row_offset;
+    size_t total = size_t(_size) * _size;
+    if (banded[0])
+    {
+        if (size_t(end - in) < size_t(_size) * 2 * sizeof(int32_t))
+            return false;
+
+        row_begin.resize(_size);
+        row_end.resize(_size);
+        row_offset.resize(_size);
+        total = 0;
+        for (int s = 0; s < _size; ++s)
+        {
+            int32_t row[2];
+            memcpy(row, in, sizeof(row));
+            in += sizeof(row);
+            if (row[0] < 0 || row[0] > row[1] || row[1] > _size)
+                return false;
+            row_begin[s] = row[0];
+            row_end[s] = row[1];
+            row_offset[s] = total;
+            total += row[1] - row[0];
+        }
+    }
+
+    if (size_t(end - in) != total * sizeof(double))
+        return false;
+
+    vector<double> stored(total);
+    if (total > 0)
+        memcpy(stored.data(), in, total * sizeof(double));
+
+    values.swap(stored);
+    _row_begin.swap(row_begin);
+    _row_end.swap(row_end);
+    _row_offset.swap(row_offset);
+    _dropped_mass = dropped_mass;
+    return true;
 }
 
 //! Take in a matrix and a vector, compute product, return it
@@ -32,6 +168,17 @@ vector<double> matrix::multiply(const vector<double>& v, int s_min_family_size,
     assert(c_min_family_size < c_max_family_size);
     assert(v.size() > size_t(c_max_family_size - c_min_family_size));
 
+    if (is_banded())
+    {
+        for (int s = s_min_family_size; s <= s_max_family_size; s++) {
+            int c_end = min(row_end(s), c_max_family_size + 1);
+            for (int c = max(row_begin(s), c_min_family_size); c < c_end; c++) {
+                result[s - s_min_family_size] += get(s, c) * v[c - c_min_family_size];
+            }
+        }
+        return result;
+    }
+
 #ifdef HAVE_BLAS
     double alpha = 1.0, beta = 0.;
     int m = s_max_family_size - s_min_family_size + 1;
@@ -56,12 +203,124 @@ vector<double> matrix::multiply(const vector<double>& v, int s_min_family_size,
     return result;
 }
 
+//! Take in a block of vectors, one per column, and multiply each of them by the matrix
+/*!
+v holds n likelihood vectors side by side: v[(c - c_min_family_size) * n + j] is the likelihood of
+size c for vector j. The result is written the same way, with one row per parent size from
+s_min_family_size to s_max_family_size, and must have room for that many rows of n values.
+Multiplying a whole block at once turns n matrix-vector products into a single matrix-matrix
+product, which is far friendlier to the cache and to BLAS. Nothing is allocated.
+*/
+void matrix::multiply_block(const double* v, int n, int s_min_family_size, int s_max_family_size, int c_min_family_size, int c_max_family_size, double* result) const
+{
+    int m = s_max_family_size - s_min_family_size + 1;
+    int k = c_max_family_size - c_min_family_size + 1;
+
+    assert(c_min_family_size < c_max_family_size);
+
+    if (is_banded())
+    {
+        // each row only touches the rows of v inside its band
+        for (int s = s_min_family_size; s <= s_max_family_size; ++s) {
+            double *r = result + size_t(s - s_min_family_size) * n;
+            int c_begin = std::max(row_begin(s), c_min_family_size);
+            int c_end = std::min(row_end(s), c_max_family_size + 1);
+            std::fill(r, r + n, 0.0);
+            if (c_begin >= c_end)
+                continue;
+
+            const double *a = &values[_row_offset[s] + c_begin - _row_begin[s]];
+            const double *x = v + size_t(c_begin - c_min_family_size) * n;
+#ifdef HAVE_BLAS
+            cblas_dgemv(CblasRowMajor, CblasTrans, c_end - c_begin, n, 1.0, x, n, a, 1, 0.0, r, 1);
+#else
+            for (int c = 0; c < c_end - c_begin; ++c) {
+                for (int j = 0; j < n; ++j)
+                    r[j] += a[c] * x[size_t(c) * n + j];
+            }
+#endif
+        }
+        return;
+    }
+
+#ifdef HAVE_BLAS
+    double alpha = 1.0, beta = 0.;
+    const double *sub = &values[0] + s_min_family_size*_size + c_min_family_size;
+    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, alpha, sub, _size, v, n, beta, result, n);
+#else
+    std::fill(result, result + size_t(m) * n, 0.0);
+
+    // reference kernel: work on tiles of the matrix so the rows of v being accumulated stay in cache
+    const int tile = 32;
+    for (int s0 = s_min_family_size; s0 <= s_max_family_size; s0 += tile) {
+        int s1 = std::min(s0 + tile, s_max_family_size + 1);
+        for (int c0 = c_min_family_size; c0 <= c_max_family_size; c0 += tile) {
+            int c1 = std::min(c0 + tile, c_max_family_size + 1);
+            for (int s = s0; s < s1; ++s) {
+                double *r = result + size_t(s - s_min_family_size) * n;
+                for (int c = c0; c < c1; ++c) {
+                    double a = get(s, c);
+                    if (a == 0.0)
+                        continue;
+                    const double *x = v + size_t(c - c_min_family_size) * n;
+                    for (int j = 0; j < n; ++j)
+                        r[j] += a * x[j];
+                }
+            }
+        }
+    }
+#endif
+}
+
+//! Multiplies the matrix by the probability vectors of n leaves, given by their species sizes
+/*!
+Without an error model a leaf's vector has a single 1 at its species size, so the product is that
+column of the matrix. With one, it is a weighted sum of the few columns the error model covers.
+Either way only those columns are read, instead of the whole matrix. Layout of the result is as
+in \ref multiply_block. Columns above c_max_family_size are ignored, as they would be by the product.
+*/
+void matrix::multiply_leaf_block(const int* species_sizes, int n, const error_model* p_error_model, int s_min_family_size, int s_max_family_size, int c_max_family_size, double* result) const
+{
+    if (p_error_model == NULL)
+    {
+        for (int s = s_min_family_size; s <= s_max_family_size; ++s) {
+            double *r = result + size_t(s - s_min_family_size) * n;
+            for (int j = 0; j < n; ++j) {
+                assert(species_sizes[j] <= c_max_family_size);
+                r[j] = get(s, species_sizes[j]);
+            }
+        }
+        return;
+    }
+
+    std::fill(result, result + size_t(s_max_family_size - s_min_family_size + 1) * n, 0.0);
+    for (int j = 0; j < n; ++j) {
+        auto& error_model_probabilities = p_error_model->get_probs(species_sizes[j]);
+        int offset = species_sizes[j] - ((p_error_model->n_deviations() - 1) / 2);
+        for (size_t i = 0; i < error_model_probabilities.size(); ++i) {
+            int c = offset + int(i);
+            double w = error_model_probabilities[i];
+            if (c < 0 || c > c_max_family_size || w == 0.0)
+                continue;
+
+            for (int s = s_min_family_size; s <= s_max_family_size; ++s)
+                result[size_t(s - s_min_family_size) * n + j] += w * get(s, c);
+        }
+    }
+}
+
+matrix_cache::matrix_cache(int matrix_size, size_t memory_budget) : _matrix_size(matrix_size), _generator(_default_generator), _tolerance(_default_tolerance), _p_store(_p_default_store), _memory_budget(memory_budget)
+{
+    // the birth-death sum for parent size s and child size c takes ln(k!) for k up to s + c - 1
+    ensure_log_factorial_table(2 * matrix_size);
+}
 
 matrix_cache::~matrix_cache()
 {
+    take_on_demand_matrices();
     for (auto m : _matrix_cache)
     {
-        delete m.second;
+        delete m.second.p_matrix;
     }
 }
 
@@ -80,11 +339,11 @@ double matrix_cache::get_from_parent_fam_size_to_c(double lambda, double branch_
 const matrix* matrix_cache::get_matrix(double branch_length, double lambda) const {
     // cout << "Matrix request " << size << "," << branch_length << "," << lambda << endl;
 
-    matrix *result = NULL;
     matrix_cache_key key(_matrix_size, lambda, branch_length);
-    if (_matrix_cache.find(key) != _matrix_cache.end())
+    const matrix *result = find(key);
+    if (result == NULL && is_on_demand())
     {
-        result = _matrix_cache.at(key);
+        return get_on_demand(key);
     }
 
     if (result == NULL)
@@ -96,6 +355,128 @@ const matrix* matrix_cache::get_matrix(double branch_length, double lambda) cons
     return result;
 }
 
+//! Looks the key up in the index over _matrix_cache. Returns NULL if the cache has no matrix for it
+const matrix* matrix_cache::find(const matrix_cache_key& key) const
+{
+    if (_index.empty())
+        return NULL;
+
+    size_t h = key.hash();
+    size_t mask = _index.size() - 1;
+    for (size_t i = h & mask; _index[i].p_item; i = (i + 1) & mask)
+    {
+        if (_index[i].hash == h && _index[i].p_item->first == key)
+            return _index[i].p_item->second.p_matrix;
+    }
+    return NULL;
+}
+
+//! Recreates the lookup table after entries were added to or removed from _matrix_cache
+void matrix_cache::rebuild_index()
+{
+    size_t slots = 1;
+    while (slots < 2 * _matrix_cache.size())
+        slots *= 2;
+
+    _index.assign(slots, index_slot{ 0, nullptr });
+    for (auto& kv : _matrix_cache)
+    {
+        size_t h = kv.first.hash();
+        size_t i = h & (slots - 1);
+        while (_index[i].p_item)
+            i = (i + 1) & (slots - 1);
+        _index[i].hash = h;
+        _index[i].p_item = &kv;
+    }
+}
+
+//! Finds or claims the key's slot in the on-demand table, and calculates its matrix if no thread has yet
+const matrix* matrix_cache::get_on_demand(const matrix_cache_key& key) const
+{
+    size_t start = key.hash() % MATRIX_CACHE_ON_DEMAND_SLOTS;
+    on_demand_entry *p_new = nullptr;
+    for (size_t probe = 0; probe < MATRIX_CACHE_ON_DEMAND_SLOTS; ++probe)
+    {
+        std::atomic<on_demand_entry*>& slot = _on_demand[(start + probe) % MATRIX_CACHE_ON_DEMAND_SLOTS];
+        on_demand_entry *p_entry = slot.load(std::memory_order_acquire);
+        if (p_entry == nullptr)
+        {
+            if (p_new == nullptr)
+                p_new = new on_demand_entry(key);
+            // on failure p_entry becomes whatever another thread put in the slot first
+            if (slot.compare_exchange_strong(p_entry, p_new, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                p_entry = p_new;
+                p_new = nullptr;
+            }
+        }
+
+        if (p_entry->key == key)
+        {
+            delete p_new;
+            std::call_once(p_entry->calculated, [this, p_entry] {
+                matrix *m = load(p_entry->key);
+                if (!m)
+                {
+                    m = new matrix(_matrix_size);
+                    fill_matrix(*m, p_entry->key.lambda_t());
+                    save(p_entry->key, *m);
+                    _on_demand_count++;
+                }
+                p_entry->p_matrix = m;
+            });
+            return p_entry->p_matrix;
+        }
+    }
+
+    delete p_new;
+    throw std::runtime_error("Too many matrices were calculated on demand without a call to precalculate_matrices");
+}
+
+void matrix_cache::set_on_demand(bool on_demand)
+{
+    if (on_demand == is_on_demand())
+        return;
+
+    if (on_demand)
+    {
+        _on_demand.reset(new std::atomic<on_demand_entry*>[MATRIX_CACHE_ON_DEMAND_SLOTS]);
+        for (size_t i = 0; i < MATRIX_CACHE_ON_DEMAND_SLOTS; ++i)
+            _on_demand[i] = nullptr;
+    }
+    else
+    {
+        take_on_demand_matrices();
+        _on_demand.reset();
+    }
+}
+
+//! Moves the matrices calculated on demand into the main map, emptying the on-demand table.
+/// Must not run while other threads are looking up matrices
+void matrix_cache::take_on_demand_matrices()
+{
+    if (!is_on_demand())
+        return;
+
+    for (size_t i = 0; i < MATRIX_CACHE_ON_DEMAND_SLOTS; ++i)
+    {
+        on_demand_entry *p_entry = _on_demand[i].exchange(nullptr);
+        if (p_entry == nullptr)
+            continue;
+
+        // a matrix whose calculation threw is missing, and will be calculated again if requested
+        if (p_entry->p_matrix)
+        {
+            auto& entry = _matrix_cache[p_entry->key];
+            entry.p_matrix = p_entry->p_matrix;
+            entry.last_used = _generation;
+            entry.sources.insert(p_entry->key.parameters());
+        }
+        delete p_entry;
+    }
+    rebuild_index();
+}
+
 vector<double> get_lambda_values(const lambda *p_lambda)
 {
     vector<double> lambdas;
@@ -118,60 +499,376 @@ bool matrix_cache::is_saturated(double branch_length, double lambda)
     return (1 - 2 * alpha) < 0;
 }
 
+//! Calculates row s of the matrix outwards from the diagonal, always extending towards the larger
+/// neighbouring probability, until the row holds all but _tolerance of its mass. Entries outside
+/// the band are left at zero, and the mass they hold is returned as dropped
+double matrix_cache::fill_band(matrix& m, double lambda_t, int s) const
+{
+    int begin = s, end = s + 1;
+    double left = begin > 0 ? get_from_parent_fam_size_to_c(lambda_t, 1.0, s, begin - 1) : -1;
+    double right = end < _matrix_size ? get_from_parent_fam_size_to_c(lambda_t, 1.0, s, end) : -1;
+    double value = get_from_parent_fam_size_to_c(lambda_t, 1.0, s, s);
+    m.set(s, s, value);
+    double mass = value;
+    while (mass < 1 - _tolerance && (left >= 0 || right >= 0))
+    {
+        if (left >= right)
+        {
+            m.set(s, --begin, left);
+            mass += left;
+            left = begin > 0 ? get_from_parent_fam_size_to_c(lambda_t, 1.0, s, begin - 1) : -1;
+        }
+        else
+        {
+            m.set(s, end++, right);
+            mass += right;
+            right = end < _matrix_size ? get_from_parent_fam_size_to_c(lambda_t, 1.0, s, end) : -1;
+        }
+    }
+
+    // a row that ran out of columns lost its remaining mass to the size limit, not to the band
+    return left >= 0 || right >= 0 ? 1 - mass : 0.0;
+}
+
+//! Calculates row s of a matrix with the BirthDeathSum generator. Matrices are keyed by lambda*t,
+/// so they are calculated with the product on a unit branch
+double matrix_cache::fill_row(matrix& m, double lambda_t, int s) const
+{
+    if (s == 0)
+    {
+        // the other entries of row 0 are zero, as a lost family is never regained
+        m.set(0, 0, get_from_parent_fam_size_to_c(lambda_t, 1.0, 0, 0));
+    }
+    else if (!is_saturated(1.0, lambda_t))
+    {
+        if (_tolerance > 0)
+        {
+            // only the band around the parent size that holds all but _tolerance of the row's mass is calculated
+            return fill_band(m, lambda_t, s);
+        }
+        else
+        {
+            for (int c = 0; c < _matrix_size; c++)
+                m.set(s, c, get_from_parent_fam_size_to_c(lambda_t, 1.0, s, c));
+        }
+    }
+    return 0.0;
+}
+
+//! Reads the key's matrix from the store, if there is one and it holds the matrix. Otherwise returns NULL
+matrix* matrix_cache::load(const matrix_cache_key& key) const
+{
+    if (!_p_store)
+        return NULL;
+
+    matrix_store::key k{ int32_t(_matrix_size), int32_t(_generator), key.quantized_lambda_t(), _tolerance };
+    matrix *result = _p_store->load(k);
+    if (result)
+        _loaded_count++;
+    return result;
+}
+
+//! Saves a matrix the cache calculated to the store, if there is one
+void matrix_cache::save(const matrix_cache_key& key, const matrix& m) const
+{
+    if (!_p_store)
+        return;
+
+    matrix_store::key k{ int32_t(_matrix_size), int32_t(_generator), key.quantized_lambda_t(), _tolerance };
+    _p_store->save(k, m);
+}
+
+//! Estimated number of birth-death terms summed for row s: entry (s, c) sums min(s, c) + 1 of them
+static double estimated_row_cost(int s, int matrix_size)
+{
+    if (s == 0)
+        return 1.0;
+    int below = min(s, matrix_size);
+    return 0.5 * below * (below + 1) + double(matrix_size - below) * (s + 1);
+}
+
+vector<row_block> plan_row_blocks(const vector<double>& lambda_ts, int matrix_size, int num_blocks)
+{
+    vector<double> row_costs(matrix_size);
+    double dense_cost = 0.0;
+    for (int s = 0; s < matrix_size; ++s)
+    {
+        row_costs[s] = estimated_row_cost(s, matrix_size);
+        dense_cost += row_costs[s];
+    }
+
+    double total_cost = 0.0;
+    for (double lambda_t : lambda_ts)
+        total_cost += matrix_cache::is_saturated(1.0, lambda_t) ? 1.0 : dense_cost;
+    double target = total_cost / max(num_blocks, 1);
+
+    vector<row_block> blocks;
+    for (size_t i = 0; i < lambda_ts.size(); ++i)
+    {
+        if (matrix_cache::is_saturated(1.0, lambda_ts[i]))
+        {
+            // only row 0 is calculated
+            blocks.push_back(row_block{ i, 0, matrix_size, 1.0 });
+            continue;
+        }
+
+        row_block block{ i, 0, 0, 0.0 };
+        for (int s = 0; s < matrix_size; ++s)
+        {
+            block.end = s + 1;
+            block.cost += row_costs[s];
+            if (block.cost >= target)
+            {
+                blocks.push_back(block);
+                block = row_block{ i, s + 1, s + 1, 0.0 };
+            }
+        }
+        if (block.end > block.begin)
+            blocks.push_back(block);
+    }
+
+    stable_sort(blocks.begin(), blocks.end(), [](const row_block& a, const row_block& b) {
+        return a.cost > b.cost;
+    });
+    return blocks;
+}
+
+//! Calculates a whole matrix with the cache's generator, and stores it as a band if there is a tolerance
+void matrix_cache::fill_matrix(matrix& m, double lambda_t) const
+{
+    if (_generator == Recurrence)
+    {
+        fill_matrix_by_recurrence(lambda_t, m);
+        if (_tolerance > 0)
+            m.truncate(_tolerance);
+    }
+    else
+    {
+        for (int s = 0; s < _matrix_size; ++s)
+            m.record_dropped_mass(fill_row(m, lambda_t, s));
+        if (_tolerance > 0)
+            m.truncate(0.0);
+    }
+}
+
 void matrix_cache::precalculate_matrices(const std::vector<double>& lambdas, const std::set<double>& branch_lengths)
 {
-	// build a list of required matrices
+	take_on_demand_matrices();
+	_generation++;
+
+	// build a list of required matrices, marking the ones we already have as recently used
 	vector<matrix_cache_key> keys;
+	set<matrix_cache_key> requested;
+	map<matrix_cache_key, set<pair<long, long>>> pending_sources;
 	for (double lambda : lambdas)
 	{
 		for (double branch_length : branch_lengths)
 		{
 			matrix_cache_key key(_matrix_size, lambda, branch_length);
-			if (_matrix_cache.find(key) == _matrix_cache.end())
+			auto it = _matrix_cache.find(key);
+			if (it != _matrix_cache.end())
+			{
+				if (it->second.last_used != _generation)
+					_hits++;
+				it->second.last_used = _generation;
+				it->second.sources.insert(key.parameters());
+			}
+			else
 			{
-				keys.push_back(key);
+				auto inserted = requested.insert(key);
+				if (inserted.second)
+					keys.push_back(key);
+				else
+					pending_sources[*inserted.first].insert(key.parameters());
 			}
 		}
 	}
+	_misses += keys.size();
 
-	// calculate matrices in parallel
+	// read the matrices an earlier run saved, and calculate the rest in parallel
 	vector<matrix*> matrices(keys.size());
-	generate(matrices.begin(), matrices.end(), [this] { return new matrix(this->_matrix_size); });
+	vector<matrix_cache_key> missing;
+	vector<matrix*> calculated;
+	for (size_t k = 0; k < keys.size(); ++k)
+	{
+		matrices[k] = load(keys[k]);
+		if (!matrices[k])
+		{
+			matrices[k] = new matrix(_matrix_size);
+			missing.push_back(keys[k]);
+			calculated.push_back(matrices[k]);
+		}
+	}
 
-	int s = 0;
-	size_t i = 0;
-	size_t num_keys = keys.size();
-#pragma omp parallel for private(s) collapse(2)
-	for (i = 0; i < num_keys; ++i)
+	size_t num_keys = missing.size();
+	vector<double> seconds(num_keys);
+	if (_generator == Recurrence)
+	{
+		// each matrix is built row by row from the one before, so parallelize over matrices only
+#pragma omp parallel for schedule(dynamic)
+		for (size_t i = 0; i < num_keys; ++i)
+		{
+			double start = omp_get_wtime();
+			fill_matrix(*calculated[i], missing[i].lambda_t());
+			seconds[i] = omp_get_wtime() - start;
+		}
+	}
+	else
 	{
-		for (s = 1; s < _matrix_size; s++) {
-			double lambda = keys[i].lambda();
-			double branch_length = keys[i].branch_length();
+		// rows get more costly as the parent size grows, so hand out blocks of rows of similar cost,
+		// largest first, to whichever thread is free
+		vector<double> lambda_ts(num_keys);
+		for (size_t i = 0; i < num_keys; ++i)
+			lambda_ts[i] = missing[i].lambda_t();
+		vector<row_block> blocks = plan_row_blocks(lambda_ts, _matrix_size, 8 * omp_get_max_threads());
+		vector<double> block_seconds(blocks.size());
+		vector<double> block_dropped_mass(blocks.size());
+		size_t num_blocks = blocks.size();
+
+#pragma omp parallel for schedule(dynamic)
+		for (size_t b = 0; b < num_blocks; ++b)
+		{
+			double start = omp_get_wtime();
+			const row_block& block = blocks[b];
+			for (int s = block.begin; s < block.end; ++s)
+				block_dropped_mass[b] = max(block_dropped_mass[b], fill_row(*calculated[block.matrix], lambda_ts[block.matrix], s));
+			block_seconds[b] = omp_get_wtime() - start;
+		}
 
-			matrix* m = matrices[i];
-			m->set(0, 0, get_from_parent_fam_size_to_c(lambda, branch_length, 0, 0));
-			if (!is_saturated(branch_length, lambda))
+		// blocks of one matrix may have been filled by different threads, so their dropped mass is recorded afterwards
+		for (size_t b = 0; b < num_blocks; ++b)
+		{
+			seconds[blocks[b].matrix] += block_seconds[b];
+			calculated[blocks[b].matrix]->record_dropped_mass(block_dropped_mass[b]);
+		}
+
+		if (_tolerance > 0)
+		{
+#pragma omp parallel for schedule(dynamic)
+			for (size_t i = 0; i < num_keys; ++i)
 			{
-				for (int j = 0; j < m->size(); ++j)
-				{
-					m->set(0, j, get_from_parent_fam_size_to_c(lambda, branch_length, 0, j));
-				}
-				for (int c = 0; c < _matrix_size; c++) {
-					m->set(s, c, get_from_parent_fam_size_to_c(lambda, branch_length, s, c));
-				}
+				double start = omp_get_wtime();
+				calculated[i]->truncate(0.0);
+				seconds[i] += omp_get_wtime() - start;
 			}
 		}
 	}
 
+	map<matrix_cache_key, double> calculation_seconds;
+	for (size_t k = 0; k < num_keys; ++k)
+	{
+		save(missing[k], *calculated[k]);
+		calculation_seconds[missing[k]] = seconds[k];
+		_calculation_seconds += seconds[k];
+	}
+
     // copy matrices to our internal map
     for (size_t i = 0; i < keys.size(); ++i)
     {
-        _matrix_cache[keys[i]] = matrices[i];
+        auto& entry = _matrix_cache[keys[i]];
+        entry.p_matrix = matrices[i];
+        entry.last_used = _generation;
+        entry.sources = pending_sources[keys[i]];
+        entry.sources.insert(keys[i].parameters());
+        entry.calculation_seconds = calculation_seconds[keys[i]];
+    }
+
+    evict_to_budget();
+}
+
+size_t matrix_cache::get_memory_usage() const
+{
+    size_t result = 0;
+    for (auto& kv : _matrix_cache)
+    {
+        result += kv.second.p_matrix->memory_usage();
+    }
+    return result;
+}
+
+double matrix_cache::get_dropped_mass() const
+{
+    double result = 0.0;
+    for (auto& kv : _matrix_cache)
+    {
+        result = max(result, kv.second.p_matrix->dropped_mass());
     }
+    return result;
+}
+
+double matrix_cache::get_calculation_seconds(double branch_length, double lambda) const
+{
+    auto it = _matrix_cache.find(matrix_cache_key(_matrix_size, lambda, branch_length));
+    return it == _matrix_cache.end() ? 0.0 : it->second.calculation_seconds;
+}
+
+size_t matrix_cache::get_deduplicated_count() const
+{
+    size_t result = 0;
+    for (auto& kv : _matrix_cache)
+    {
+        result += kv.second.sources.size() - 1;
+    }
+    return result;
+}
+
+void matrix_cache::set_memory_budget(size_t bytes)
+{
+    _memory_budget = bytes;
+    evict_to_budget();
+}
+
+//! Remove the least recently requested matrices until the cache fits in its memory budget.
+//! Matrices requested by the latest call to precalculate_matrices are kept regardless.
+void matrix_cache::evict_to_budget()
+{
+    size_t usage = get_memory_usage();
+    if (usage <= _memory_budget)
+    {
+        rebuild_index();
+        return;
+    }
+
+    // matrices of the current generation are in use, so only older ones are candidates
+    typedef std::map<matrix_cache_key, cache_entry>::iterator entry_iterator;
+    vector<entry_iterator> candidates;
+    for (auto it = _matrix_cache.begin(); it != _matrix_cache.end(); ++it)
+    {
+        if (it->second.last_used != _generation)
+            candidates.push_back(it);
+    }
+    stable_sort(candidates.begin(), candidates.end(), [](entry_iterator a, entry_iterator b) {
+        return a->second.last_used < b->second.last_used;
+    });
+
+    for (auto oldest : candidates)
+    {
+        if (usage <= _memory_budget)
+            break;
+
+        usage -= oldest->second.p_matrix->memory_usage();
+        delete oldest->second.p_matrix;
+        _matrix_cache.erase(oldest);
+        _evictions++;
+    }
+    rebuild_index();
+}
+
+void matrix_cache::write_statistics(std::ostream& ost) const
+{
+    ost << "Matrix cache: " << _hits << " hits, " << _misses << " misses, " << _evictions << " evictions (";
+    ost << get_cache_size() << " matrices held, " << get_deduplicated_count() << " shared by equal lambda*t)" << endl;
+    if (is_on_demand())
+        ost << "Matrices calculated on demand: " << _on_demand_count << endl;
+    if (_p_store)
+        ost << "Matrix store " << _p_store->path() << ": " << _loaded_count << " matrices read, " << _p_store->size() << " held" << endl;
+    if (_tolerance > 0)
+        ost << "Banded matrices: " << get_memory_usage() << " bytes held, at most " << get_dropped_mass() << " probability dropped from a row" << endl;
 }
 
 void matrix_cache::warn_on_saturation(std::ostream& ost)
 {
+    take_on_demand_matrices();
     for (auto& kv : _matrix_cache)
     {
         if (is_saturated(kv.first.branch_length(), kv.first.lambda()))
@@ -4,16 +4,35 @@
 #include <map>
 #include <vector>
 #include <set>
+#include <tuple>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 
 #include <assert.h>
 
 class lambda;
 class readwritelock;
+class error_model;
+class matrix_store;
 
+//! A square matrix of transition probabilities
+/*!
+A matrix starts out dense. \ref truncate turns it into a banded one: each row keeps only the
+columns between its first and last non-negligible entries, stored back to back, and everything
+outside reads as zero. On short branches the probabilities vanish a few sizes away from the
+parent's, so most of a large matrix can be dropped.
+*/
 class matrix
 {
     std::vector<double> values;
     int _size;
+    std::vector<int> _row_begin;        //!< first column stored for each row. Empty while the matrix is dense
+    std::vector<int> _row_end;          //!< one past the last column stored for each row
+    std::vector<size_t> _row_offset;    //!< position in values of each row's first stored column
+    double _dropped_mass = 0.0;         //!< largest probability mass dropped from any row
 public:
     matrix(int sz) : _size(sz)
     {
@@ -23,34 +42,88 @@ public:
     {
         assert(x < _size);
         assert(y < _size);
+        assert(!is_banded());
         values[x*_size + y] = val;
     }
     double get(int x, int y) const
     {
         assert(x < _size);
         assert(y < _size);
-        return values[x*_size + y];
+        if (_row_begin.empty())
+            return values[x*_size + y];
+        if (y < _row_begin[x] || y >= _row_end[x])
+            return 0.0;
+        return values[_row_offset[x] + y - _row_begin[x]];
     }
     int size() const {
         return _size;
     }
+    bool is_banded() const {
+        return !_row_begin.empty();
+    }
+    //! First column of the row that may be nonzero
+    int row_begin(int row) const {
+        return _row_begin.empty() ? 0 : _row_begin[row];
+    }
+    //! One past the last column of the row that may be nonzero
+    int row_end(int row) const {
+        return _row_end.empty() ? _size : _row_end[row];
+    }
+    //! Drops the smallest entries from both ends of each row, as long as the mass dropped from a row stays within tolerance
+    void truncate(double tolerance);
+    //! Records mass that was dropped from a row without being stored, for example by a generator that skipped it
+    void record_dropped_mass(double mass) {
+        _dropped_mass = std::max(_dropped_mass, mass);
+    }
+    //! Largest probability mass dropped from any row
+    double dropped_mass() const {
+        return _dropped_mass;
+    }
+    size_t memory_usage() const {
+        return values.size() * sizeof(double) + _row_begin.size() * (2 * sizeof(int) + sizeof(size_t));
+    }
     bool is_zero() const;
+    //! Number of bytes \ref serialize writes
+    size_t serialized_size() const;
+    //! Writes the matrix (its band, if any, and its values) to out
+    void serialize(char *out) const;
+    //! Restores a matrix written by \ref serialize. Returns false, leaving the matrix as it was, if the bytes do not describe a matrix of this size
+    bool deserialize(const char *in, size_t length);
     std::vector<double> multiply(const std::vector<double>& v, int s_min_family_size, int s_max_family_size, int c_min_family_size, int c_max_family_size) const;
+    void multiply_block(const double* v, int n, int s_min_family_size, int s_max_family_size, int c_min_family_size, int c_max_family_size, double* result) const;
+    void multiply_leaf_block(const int* species_sizes, int n, const error_model* p_error_model, int s_min_family_size, int s_max_family_size, int c_max_family_size, double* result) const;
 };
 
 
+//! Identifies a transition matrix.
+/*!
+The birth-death probabilities depend on lambda and the branch length only through their product
+(alpha = lambda*t / (1 + lambda*t)), so keys compare on the size and the product lambda*t. Branches
+and gamma categories with different lambda and branch length pairs but the same product share a
+matrix. The lambda and branch length that created the key are kept for reporting.
+*/
 class matrix_cache_key {
     size_t _size;
     long _lambda;
     long _branch_length;
+    long long _lambda_t;
 public:
     matrix_cache_key(int size, double some_lambda, double some_branch_length) :
         _size(size),
         _lambda(long(some_lambda * 1000000000)),    // keep 9 significant digits
-        _branch_length(long(some_branch_length * 1000)) {} // keep 3 significant digits
+        _branch_length(long(some_branch_length * 1000)), // keep 3 significant digits
+        _lambda_t((long long)_lambda * _branch_length) {}  // exact product of the two, 12 digits
 
     bool operator<(const matrix_cache_key &o) const {
-        return std::tie(_size, _branch_length, _lambda) < std::tie(o._size, o._branch_length, o._lambda);
+        return std::tie(_size, _lambda_t) < std::tie(o._size, o._lambda_t);
+    }
+    bool operator==(const matrix_cache_key &o) const {
+        return _size == o._size && _lambda_t == o._lambda_t;
+    }
+    //! A hash of the fields compared by operator==, mixed so that its low bits can index a table
+    size_t hash() const {
+        uint64_t h = uint64_t(_lambda_t) * 0x9E3779B97F4A7C15ULL ^ _size;
+        return size_t(h ^ (h >> 29));
     }
     double lambda() const {
         return double(_lambda) / 1000000000.0;
@@ -58,19 +131,134 @@ public:
     double branch_length() const {
         return double(_branch_length) / 1000.0;
     }
+    //! The product of lambda and branch length that determines the matrix
+    double lambda_t() const {
+        return double(_lambda_t) / 1000000000000.0;
+    }
+    //! The product of lambda and branch length as stored in the key, in units of 1e-12
+    long long quantized_lambda_t() const {
+        return _lambda_t;
+    }
+    //! The quantized lambda and branch length, used to tell apart requests that share a matrix
+    std::pair<long, long> parameters() const {
+        return std::make_pair(_lambda, _branch_length);
+    }
 };
 
 std::vector<double> get_lambda_values(const lambda *p_lambda);
 
+//! Consecutive rows of one matrix, calculated together by one thread
+struct row_block {
+    size_t matrix;      //!< index of the matrix among those being calculated
+    int begin;          //!< first row of the block
+    int end;            //!< one past the last row of the block
+    double cost;        //!< estimated number of birth-death terms summed to calculate the rows
+};
+
+//! Splits the rows of matrices with the given lambda*t values into blocks of roughly equal estimated cost, most costly first
+/*!
+Entry (s, c) of a BirthDeathSum matrix sums min(s, c) + 1 terms, so row s costs about s times as
+much as row 1, and rows of saturated matrices (other than row 0) cost nothing. Rows are gathered
+into blocks until a block holds about 1/num_blocks of the total cost, so the blocks can be handed
+out to threads dynamically without the largest rows of the last matrix holding everyone up.
+*/
+std::vector<row_block> plan_row_blocks(const std::vector<double>& lambda_ts, int matrix_size, int num_blocks);
+
+//! Methods available for calculating the values of a transition matrix
+enum matrix_generator {
+    BirthDeathSum,  //!< evaluate the birth-death sum separately for every entry, O(N^3) per matrix
+    Recurrence      //!< build each row from the previous one, O(N^2) per matrix. See \ref fill_matrix_by_recurrence
+};
+
+//! Default amount of memory (in bytes) a matrix cache may hold before it starts evicting matrices
+#define MATRIX_CACHE_DEFAULT_MEMORY_BUDGET (size_t(1024) * 1024 * 1024)
+
+//! Number of distinct matrices an on-demand cache can calculate between two calls to \ref matrix_cache::precalculate_matrices
+#define MATRIX_CACHE_ON_DEMAND_SLOTS 4096
+
 //! Computation of the probabilities of moving from a family size (parent) to another (child)
 /*!
-Contains a map (_cache) that serves as a hash table to store precalculated values.
+Contains a map (_cache) that stores precalculated values.
 If the given parameters have already been calculated, will return the cached value rather than calculating the value again.
+
+The map is ordered, which eviction and reporting rely on, but \ref get_matrix is called for every
+branch of every block of families, so it does not search the map. Whenever the map changes, an
+open-addressing table of pointers into it is rebuilt, with each key's hash stored beside it. A
+lookup hashes the key once and usually compares a single slot. The table is only read between
+changes, so any number of threads can look up matrices at once.
+
+The cache may be kept alive across many calls to \ref precalculate_matrices (a model keeps one for the
+lifetime of an optimization). Each call marks the matrices it requests as recently used; once the
+matrices held exceed the memory budget, the least recently requested ones are evicted. Matrices requested
+by the most recent call are never evicted.
+
+A cache can also be put in on-demand mode with \ref set_on_demand, for callers that cannot tell in
+advance which matrices they will need. \ref get_matrix then calculates a missing matrix on first
+use instead of throwing. Such matrices go into a fixed open-addressing table of atomic pointers:
+a thread claims a slot with a compare-and-swap, and std::call_once makes sure only one thread
+calculates each matrix while any others asking for it wait. Once a matrix exists, finding it takes
+only atomic loads. The next \ref precalculate_matrices (which, as always, must not run while other
+threads use the cache) moves these matrices into the main map, where they count against the budget.
+
+A cache given a \ref matrix_store looks each missing matrix up there before calculating it, and
+saves the ones it calculates, so later runs with the same lambdas and branch lengths can skip the
+calculation.
 */
 class matrix_cache {
 private:
-    std::map<matrix_cache_key, matrix*> _matrix_cache; //!< nested map that stores transition probabilities for a given lambda and branch_length (outer), then for a given parent and child size (inner)
+    struct cache_entry {
+        matrix* p_matrix;
+        unsigned long last_used;    //!< value of _generation when this matrix was last requested
+        std::set<std::pair<long, long>> sources;    //!< distinct lambda and branch length pairs that requested this matrix
+        double calculation_seconds = 0.0;   //!< thread time spent calculating the matrix in \ref precalculate_matrices, zero if it was read or calculated on demand
+    };
+    std::map<matrix_cache_key, cache_entry> _matrix_cache; //!< nested map that stores transition probabilities for a given lambda and branch_length (outer), then for a given parent and child size (inner)
+
+    //! A matrix calculated by \ref get_matrix in on-demand mode
+    struct on_demand_entry {
+        matrix_cache_key key;
+        std::once_flag calculated;
+        matrix* p_matrix = nullptr;
+        explicit on_demand_entry(const matrix_cache_key& k) : key(k) {}
+    };
+    std::unique_ptr<std::atomic<on_demand_entry*>[]> _on_demand;   //!< MATRIX_CACHE_ON_DEMAND_SLOTS slots, null unless in on-demand mode
+    mutable std::atomic<size_t> _on_demand_count{0};   //!< number of matrices calculated on demand over the cache's lifetime
+    mutable std::atomic<size_t> _loaded_count{0};      //!< number of matrices read from _p_store instead of being calculated
+
+    //! A slot of the lookup table over _matrix_cache
+    struct index_slot {
+        size_t hash;
+        const std::pair<const matrix_cache_key, cache_entry>* p_item;  //!< null for an empty slot
+    };
+    std::vector<index_slot> _index;     //!< a power of two number of slots, at most half full
+
     int _matrix_size;
+    matrix_generator _generator;
+    double _tolerance;
+    matrix_store *_p_store;
+    size_t _memory_budget;
+    unsigned long _generation = 0;
+    size_t _hits = 0;
+    size_t _misses = 0;
+    size_t _evictions = 0;
+    double _calculation_seconds = 0.0;
+
+    void evict_to_budget();
+    void rebuild_index();
+    const matrix* find(const matrix_cache_key& key) const;
+    //! Fill row s of the matrix, returning the mass dropped from it. Rows of one matrix may be filled
+    /// concurrently, so the caller records the mass with matrix::record_dropped_mass
+    double fill_band(matrix& m, double lambda_t, int s) const;
+    double fill_row(matrix& m, double lambda_t, int s) const;
+    void fill_matrix(matrix& m, double lambda_t) const;
+    matrix* load(const matrix_cache_key& key) const;
+    void save(const matrix_cache_key& key, const matrix& m) const;
+    const matrix* get_on_demand(const matrix_cache_key& key) const;
+    void take_on_demand_matrices();
+
+    static matrix_generator _default_generator;
+    static double _default_tolerance;
+    static matrix_store *_p_default_store;
 public:
     double get_from_parent_fam_size_to_c(double lambda, double branch_length, int parent_size, int child_size) const;
     const matrix* get_matrix(double branch_length, double lambda) const;
@@ -84,11 +272,108 @@ public:
         return _matrix_size;
     }
 
+    //! Number of requested matrices that were already in the cache
+    size_t get_hit_count() const {
+        return _hits;
+    }
+
+    //! Number of requested matrices that had to be calculated
+    size_t get_miss_count() const {
+        return _misses;
+    }
+
+    size_t get_eviction_count() const {
+        return _evictions;
+    }
+
+    //! Thread time, in seconds, spent calculating matrices in \ref precalculate_matrices over the cache's lifetime
+    double get_calculation_seconds() const {
+        return _calculation_seconds;
+    }
+
+    //! Thread time, in seconds, spent calculating the matrix held for lambda and branch_length. Zero if it was not calculated by \ref precalculate_matrices
+    double get_calculation_seconds(double branch_length, double lambda) const;
+
+    //! Number of matrices that \ref get_matrix had to calculate in on-demand mode
+    size_t get_on_demand_count() const {
+        return _on_demand_count;
+    }
+
+    //! In on-demand mode, \ref get_matrix calculates matrices it cannot find instead of throwing
+    void set_on_demand(bool on_demand);
+
+    bool is_on_demand() const {
+        return _on_demand != nullptr;
+    }
+
+    //! Number of lambda and branch length pairs that were served by a matrix created for a different pair with the same product
+    size_t get_deduplicated_count() const;
+
+    //! Approximate number of bytes used by the matrices currently held
+    size_t get_memory_usage() const;
+
+    void set_memory_budget(size_t bytes);
+
+    size_t get_memory_budget() const {
+        return _memory_budget;
+    }
+
+    void write_statistics(std::ostream& ost) const;
+
+    matrix_generator get_generator() const {
+        return _generator;
+    }
+
+    void set_generator(matrix_generator generator) {
+        _generator = generator;
+    }
+
+    //! Sets the method that newly constructed caches will use to calculate their matrices
+    static void set_default_generator(matrix_generator generator) {
+        _default_generator = generator;
+    }
+
+    double get_tolerance() const {
+        return _tolerance;
+    }
+
+    //! Sets the probability mass each row of a matrix may drop to be stored as a band. Zero keeps matrices dense
+    void set_tolerance(double tolerance) {
+        _tolerance = tolerance;
+    }
+
+    //! Sets the tolerance that newly constructed caches will use
+    static void set_default_tolerance(double tolerance) {
+        _default_tolerance = tolerance;
+    }
+
+    matrix_store *get_store() const {
+        return _p_store;
+    }
+
+    //! Sets a file of matrices to read matrices from before calculating them, and to save calculated ones to. May be null
+    void set_store(matrix_store *p_store) {
+        _p_store = p_store;
+    }
+
+    //! Sets the store that newly constructed caches will use. The store must outlive them
+    static void set_default_store(matrix_store *p_store) {
+        _p_default_store = p_store;
+    }
+
+    //! Number of matrices read from the store instead of being calculated
+    size_t get_loaded_count() const {
+        return _loaded_count;
+    }
+
+    //! Largest probability mass dropped from a row of any matrix held
+    double get_dropped_mass() const;
+
     void warn_on_saturation(std::ostream& ost);
 
     static bool is_saturated(double branch_length, double lambda);
 
-    matrix_cache(int matrix_size) : _matrix_size(matrix_size) {}
+    matrix_cache(int matrix_size, size_t memory_budget = MATRIX_CACHE_DEFAULT_MEMORY_BUDGET);
     ~matrix_cache();
 
     friend std::ostream& operator<<(std::ostream& ost, matrix_cache& c);
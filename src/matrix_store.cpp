@@ -0,0 +1,213 @@
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#include "matrix_store.h"
+#include "matrix_cache.h"
+
+using namespace std;
+
+namespace {
+    const char store_magic[8] = { 'C', 'A', 'F', 'E', 'M', 'A', 'T', 'S' };
+    const uint32_t byte_order_mark = 0x01020304;   //!< reads back differently on a machine of the other byte order
+
+    struct file_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+    };
+
+    struct record_header {
+        matrix_store::key k;
+        uint64_t payload_size;
+        uint64_t checksum;      //!< FNV-1a over the key and the payload
+    };
+
+    static_assert(sizeof(matrix_store::key) == 24, "matrix store keys must have no padding, as they are checksummed");
+    static_assert(sizeof(record_header) == 40, "matrix store records must have no padding");
+
+    uint64_t checksum(const matrix_store::key& k, const char *payload, size_t length)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        auto add = [&h](const char *p, size_t n) {
+            for (size_t i = 0; i < n; ++i)
+            {
+                h ^= uint8_t(p[i]);
+                h *= 1099511628211ULL;
+            }
+        };
+        add(reinterpret_cast<const char *>(&k), sizeof(k));
+        add(payload, length);
+        return h;
+    }
+}
+
+matrix_store::matrix_store(const std::string& path) : _path(path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || st.st_size == 0)
+    {
+        ofstream out(path, ios::binary | ios::trunc);
+        file_header header;
+        memcpy(header.magic, store_magic, sizeof(store_magic));
+        header.version = MATRIX_STORE_VERSION;
+        header.byte_order = byte_order_mark;
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        if (!out)
+            throw runtime_error("Failed to create matrix store " + path);
+    }
+
+    map_file();
+
+    file_header header;
+    bool valid = _mapped_size >= sizeof(header);
+    if (valid)
+    {
+        memcpy(&header, _p_data, sizeof(header));
+        valid = memcmp(header.magic, store_magic, sizeof(store_magic)) == 0 && header.version == MATRIX_STORE_VERSION && header.byte_order == byte_order_mark;
+    }
+    if (!valid)
+    {
+        unmap_file();
+        throw runtime_error(path + " is not a version " + to_string(MATRIX_STORE_VERSION) + " matrix store");
+    }
+
+    size_t end = index_records(sizeof(header));
+    if (end < _file_size)
+    {
+        // the last record was cut short. Drop it, so that new records are appended after complete ones
+        unmap_file();
+        if (truncate(path.c_str(), end) != 0)
+            throw runtime_error("Failed to repair matrix store " + path);
+        map_file();
+    }
+}
+
+matrix_store::~matrix_store()
+{
+    unmap_file();
+}
+
+void matrix_store::map_file()
+{
+#ifdef HAVE_MMAP
+    int fd = open(_path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("Failed to open matrix store " + _path);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw runtime_error("Failed to open matrix store " + _path);
+    }
+
+    _mapped_size = _file_size = st.st_size;
+    void *p = _mapped_size > 0 ? mmap(nullptr, _mapped_size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (p == MAP_FAILED)
+        throw runtime_error("Failed to map matrix store " + _path);
+    _p_data = static_cast<const char *>(p);
+#else
+    ifstream in(_path, ios::binary);
+    if (!in)
+        throw runtime_error("Failed to open matrix store " + _path);
+    _contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    _p_data = _contents.data();
+    _mapped_size = _file_size = _contents.size();
+#endif
+}
+
+void matrix_store::unmap_file()
+{
+#ifdef HAVE_MMAP
+    if (_p_data)
+        munmap(const_cast<char *>(_p_data), _mapped_size);
+#else
+    _contents.clear();
+#endif
+    _p_data = nullptr;
+    _mapped_size = 0;
+}
+
+//! Adds the records from the given position to the end of the mapped file to the index.
+/// Returns the position after the last record that fits in the file
+size_t matrix_store::index_records(size_t position)
+{
+    while (position + sizeof(record_header) <= _mapped_size)
+    {
+        record_header header;
+        memcpy(&header, _p_data + position, sizeof(header));
+        size_t payload = position + sizeof(header);
+        if (header.payload_size > _mapped_size - payload)
+            break;
+
+        if (checksum(header.k, _p_data + payload, header.payload_size) == header.checksum)
+            _index.emplace(header.k, make_pair(payload, size_t(header.payload_size)));
+        else
+            _rejected++;
+
+        position = payload + header.payload_size;
+    }
+    return position;
+}
+
+matrix* matrix_store::load(const key& k)
+{
+    lock_guard<mutex> lock(_mutex);
+    auto it = _index.find(k);
+    if (it == _index.end())
+        return nullptr;
+
+    // the record was appended after the file was mapped
+    if (it->second.first + it->second.second > _mapped_size)
+    {
+        unmap_file();
+        map_file();
+    }
+
+    unique_ptr<matrix> result(new matrix(k.size));
+    if (!result->deserialize(_p_data + it->second.first, it->second.second))
+        return nullptr;
+
+    return result.release();
+}
+
+void matrix_store::save(const key& k, const matrix& m)
+{
+    lock_guard<mutex> lock(_mutex);
+    if (_index.find(k) != _index.end())
+        return;
+
+    vector<char> payload(m.serialized_size());
+    m.serialize(payload.data());
+
+    record_header header;
+    header.k = k;
+    header.payload_size = payload.size();
+    header.checksum = checksum(k, payload.data(), payload.size());
+
+    ofstream out(_path, ios::binary | ios::app);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(payload.data(), payload.size());
+    if (!out)
+        throw runtime_error("Failed to write to matrix store " + _path);
+
+    _index.emplace(k, make_pair(_file_size + sizeof(header), payload.size()));
+    _file_size += sizeof(header) + payload.size();
+}
+
+size_t matrix_store::size() const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _index.size();
+}
@@ -0,0 +1,88 @@
+#ifndef MATRIX_STORE_H
+#define MATRIX_STORE_H
+
+#include <string>
+#include <map>
+#include <tuple>
+#include <utility>
+#include <mutex>
+#include <cstdint>
+
+class matrix;
+
+//! Current layout of a \ref matrix_store file. Files written with another version are refused
+#define MATRIX_STORE_VERSION 1
+
+//! A file of transition matrices that later runs can read instead of calculating them again
+/*!
+The file starts with a header naming the format and its version, followed by one record per
+matrix. Each record holds the key of its matrix (the matrix size, the quantized lambda*t used by
+\ref matrix_cache_key, and the generator and tolerance the matrix was calculated with), the matrix
+itself as written by \ref matrix::serialize, and a checksum over both.
+
+When the store is opened, the file is mapped into memory (or read, where mmap is not available)
+and its records are indexed. A record whose checksum does not match is skipped, and anything after
+a record that does not fit in the file, as left by a run that was killed mid-write, is cut off.
+New matrices are appended to the end of the file, and the file is mapped again when one of them
+is first read back.
+
+A store may be used by several threads at once. Separate processes should not append to the same
+file at the same time.
+*/
+class matrix_store {
+public:
+    //! Identifies a matrix in the store
+    struct key {
+        int32_t size;
+        int32_t generator;
+        int64_t lambda_t;     //!< as quantized by \ref matrix_cache_key
+        double tolerance;
+
+        bool operator<(const key& o) const {
+            return std::tie(size, generator, lambda_t, tolerance) < std::tie(o.size, o.generator, o.lambda_t, o.tolerance);
+        }
+    };
+
+    //! Opens the store at the given path, creating the file if it does not exist
+    explicit matrix_store(const std::string& path);
+    ~matrix_store();
+
+    matrix_store(const matrix_store&) = delete;
+    matrix_store& operator=(const matrix_store&) = delete;
+
+    //! Returns a new matrix read from the store, or nullptr if the store does not hold the key
+    matrix* load(const key& k);
+
+    //! Appends the matrix to the store, unless the store already holds its key
+    void save(const key& k, const matrix& m);
+
+    //! Number of matrices held
+    size_t size() const;
+
+    //! Number of records skipped because their checksum did not match
+    size_t get_rejected_count() const {
+        return _rejected;
+    }
+
+    const std::string& path() const {
+        return _path;
+    }
+
+private:
+    std::string _path;
+    mutable std::mutex _mutex;
+    std::map<key, std::pair<size_t, size_t>> _index;    //!< position and length of each matrix's serialized form in the file
+    const char *_p_data = nullptr;  //!< the mapped file
+    size_t _mapped_size = 0;
+    size_t _file_size = 0;          //!< size of the file, including records appended since it was mapped
+    size_t _rejected = 0;
+#ifndef HAVE_MMAP
+    std::string _contents;          //!< the file, read into memory
+#endif
+
+    void map_file();
+    void unmap_file();
+    size_t index_records(size_t position);
+};
+
+#endif
@@ -8,11 +8,20 @@
 #include <iomanip>
 #include <chrono>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "optimizer.h"
 #include "optimizer_scorer.h"
 
 #define PHASED_OPTIMIZER_PHASE2_PRECISION 1e-6
+#define LBFGS_GRADIENT_STEP 1e-4
+#define LBFGS_MINIMUM_SCALE 1e-3
+#define OPTIMIZER_BOUND_MARGIN 1e-9
+#define GOLDEN_RATIO 1.618034
+#define LBFGS_SUFFICIENT_DECREASE 1e-4
+#define LBFGS_MAX_BACKTRACKS 30
 
 using namespace std;
 
@@ -28,6 +37,8 @@ optimizer_parameters::optimizer_parameters() : neldermead_expansion(2.0), nelder
     strategy = Perturb;
 #elif defined(OPTIMIZER_STRATEGY_SIMILARITY_CUTOFF)
     strategy = SimilarityCutoff;
+#elif defined(OPTIMIZER_STRATEGY_LBFGS)
+    strategy = LBFGS;
 #else
     strategy = Standard;
 #endif
@@ -158,6 +169,19 @@ int __fminsearch_checkF(FMinSearch* pfm)
 	return max <= pfm->tolf;
 }
 
+/// Scores candidates first to last - 1 together, so the scorer can evaluate them concurrently
+void __fminsearch_score_candidates(FMinSearch* pfm, int first, int last)
+{
+    vector<const double*> values;
+    for (int i = first; i < last; ++i)
+        values.push_back(&pfm->candidates[i]->values[0]);
+
+    vector<double> scores(values.size());
+    pfm->scorer->calculate_scores(values, scores.data());
+    for (int i = first; i < last; ++i)
+        pfm->candidates[i]->score = scores[i - first];
+}
+
 void __fminsearch_min_init(FMinSearch* pfm, double* X0)
 {
     // run the optimizer a few times, tweaking the initial values to get an idea of what direction we should move
@@ -166,28 +190,29 @@ void __fminsearch_min_init(FMinSearch* pfm, double* X0)
 	{
 		for ( j = 0 ; j < pfm->variable_count ; j++ )
 		{
-            if ( i > 1 && std::isinf(pfm->candidates[i-1]->score)) {
-                if ( (i - 1)  == j )
-                {
-                    pfm->candidates[i]->values[j] = X0[j] ? ( 1 + pfm->delta*100 ) * X0[j] : pfm->zero_delta;
-                }
-                else
-                {
-                    pfm->candidates[i]->values[j] = X0[j];
-                }                
+            if ( (i - 1)  == j )
+            {
+                pfm->candidates[i]->values[j] = X0[j] ? ( 1 + pfm->delta ) * X0[j] : pfm->zero_delta;
             }
-            else {
-                if ( (i - 1)  == j )
-                {
-                    pfm->candidates[i]->values[j] = X0[j] ? ( 1 + pfm->delta ) * X0[j] : pfm->zero_delta;
-                }
-                else
-                {
-                    pfm->candidates[i]->values[j] = X0[j];
-                }
+            else
+            {
+                pfm->candidates[i]->values[j] = X0[j];
             }
 		}
-		pfm->candidates[i]->score = pfm->scorer->calculate_score(&pfm->candidates[i]->values[0]);
+	}
+	__fminsearch_score_candidates(pfm, 0, pfm->variable_count_plus_one);
+
+    // a vertex following one that could not be scored is moved much further from X0. That depends on
+    // the score of the vertex before it, so these are redone one at a time. Scoring every vertex in one
+    // batch first assumes each neighbour is scorable: for each vertex that is moved, its first score is
+    // wasted. Unscorable starting points are rare, so this costs less than scoring all vertices serially
+	for ( i = 2 ; i < pfm->variable_count_plus_one ; i++ )
+	{
+        if ( std::isinf(pfm->candidates[i-1]->score) && X0[i-1] )
+        {
+            pfm->candidates[i]->values[i-1] = ( 1 + pfm->delta*100 ) * X0[i-1];
+            pfm->candidates[i]->score = pfm->scorer->calculate_score(&pfm->candidates[i]->values[0]);
+        }
 	}
 	__fminsearch_sort(pfm);
 }
@@ -257,8 +282,8 @@ void __fminsearch_x_shrink(FMinSearch* pfm)
 		{
 			pfm->candidates[i]->values[j] = pfm->candidates[0]->values[j] + pfm->sigma * ( pfm->candidates[i]->values[j] - pfm->candidates[0]->values[j] );
 		}
-		pfm->candidates[i]->score = pfm->scorer->calculate_score(&pfm->candidates[i]->values[0]);
 	}
+	__fminsearch_score_candidates(pfm, 1, pfm->variable_count_plus_one);
 	__fminsearch_sort(pfm);
 }
 
@@ -328,6 +353,276 @@ candidate::candidate(int size) : values(size), score(0)
 {
 }
 
+//! @brief Collects the scores requested by concurrent searches and has the scorer calculate them as one batch
+//!
+//! Each search blocks until its scores are ready. Once every search still running has asked for scores,
+//! the serving thread scores them all together, so a model that scores a batch in parallel does so with
+//! one matrix cache and one set of workspaces.
+//!
+//! If scoring or a search throws, the batcher keeps the first exception and fails: \ref serve returns and
+//! every search waiting for scores throws, so all the threads can be joined before the exception is rethrown
+class score_batcher
+{
+    struct request {
+        const vector<const double *>* values;
+        double *scores;
+        bool done;
+    };
+
+    optimizer_scorer* _p_scorer;
+    mutex _mutex;
+    condition_variable _changed;
+    vector<request *> _pending;
+    int _searching;
+    exception_ptr _failure;
+
+public:
+    score_batcher(optimizer_scorer* p_scorer, int searches) : _p_scorer(p_scorer), _searching(searches)
+    {
+    }
+
+    //! Called by a search. Returns once the values are scored
+    void score(const vector<const double *>& values, double *scores)
+    {
+        unique_lock<mutex> lock(_mutex);
+        request r{ &values, scores, false };
+        _pending.push_back(&r);
+        _changed.notify_all();
+        _changed.wait(lock, [this, &r] { return r.done || _failure; });
+        if (!r.done)
+        {
+            _pending.erase(remove(_pending.begin(), _pending.end(), &r), _pending.end());
+            throw runtime_error("Search abandoned after another search of the multi-start optimization failed");
+        }
+    }
+
+    //! Called by a search as it ends
+    void search_finished()
+    {
+        lock_guard<mutex> lock(_mutex);
+        _searching--;
+        _changed.notify_all();
+    }
+
+    //! Called by a search (or the thread starting them) that throws. Only the first exception is kept
+    void fail(exception_ptr failure)
+    {
+        lock_guard<mutex> lock(_mutex);
+        if (!_failure)
+            _failure = failure;
+        _changed.notify_all();
+    }
+
+    //! Rethrows the exception of the first failure, if any
+    void rethrow_failure()
+    {
+        lock_guard<mutex> lock(_mutex);
+        if (_failure)
+            rethrow_exception(_failure);
+    }
+
+    //! Scores batches until every search has ended or the batcher has failed
+    void serve()
+    {
+        unique_lock<mutex> lock(_mutex);
+        while (true)
+        {
+            _changed.wait(lock, [this] { return int(_pending.size()) == _searching || _failure; });
+            if (_searching == 0 || _failure)
+                return;
+
+            vector<request *> batch;
+            batch.swap(_pending);
+            lock.unlock();
+
+            vector<double> scores;
+            try
+            {
+                vector<const double *> values;
+                for (auto r : batch)
+                    values.insert(values.end(), r->values->begin(), r->values->end());
+                scores.resize(values.size());
+                _p_scorer->calculate_scores(values, &scores[0]);
+            }
+            catch (...)
+            {
+                fail(current_exception());
+                return;
+            }
+
+            lock.lock();
+            auto next = scores.begin();
+            for (auto r : batch)
+            {
+                copy_n(next, r->values->size(), r->scores);
+                next += r->values->size();
+                r->done = true;
+            }
+            _changed.notify_all();
+        }
+    }
+};
+
+//! @brief Scorer given to each search of a multi-start optimization. It hands its values to a \ref score_batcher
+class batched_scorer : public optimizer_scorer
+{
+    optimizer_scorer* _p_scorer;
+    score_batcher& _batcher;
+public:
+    batched_scorer(optimizer_scorer* p_scorer, score_batcher& batcher) : _p_scorer(p_scorer), _batcher(batcher)
+    {
+    }
+
+    std::vector<double> initial_guesses() override
+    {
+        throw std::runtime_error("Searches of a multi-start optimization are given their initial values");
+    }
+
+    double calculate_score(const double *values) override
+    {
+        double score;
+        _batcher.score(vector<const double *>{ values }, &score);
+        return score;
+    }
+
+    void calculate_scores(const std::vector<const double *>& values, double *scores) override
+    {
+        _batcher.score(values, scores);
+    }
+
+    std::pair<double, double> bounds(int i) const override
+    {
+        return _p_scorer->bounds(i);
+    }
+};
+
+static bool same_optimum(const vector<double>& a, const vector<double>& b)
+{
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (fabs(a[i] - b[i]) > MULTISTART_SAME_OPTIMUM * max(fabs(a[i]), fabs(b[i])))
+            return false;
+    }
+    return true;
+}
+
+/*! Runs a Nelder-Mead search from each of the initial values at the same time, each search
+    on a thread of its own with the settings of pfm. The scores the searches ask for are
+    calculated together by the scorer of pfm, on the calling thread.
+
+    A search stops early once its best values are within MULTISTART_SAME_OPTIMUM of the best
+    values of a search that scores better, since both are heading for the same optimum.
+
+    If the scorer or any search throws, the other searches are stopped, every thread is
+    joined and the first exception is rethrown on the calling thread.
+*/
+std::vector<start_trace> fminsearch_multistart(FMinSearch* pfm, const std::vector<std::vector<double>>& initials)
+{
+    int num_starts = initials.size();
+    vector<start_trace> traces(num_starts);
+    vector<candidate> bests(num_starts, candidate(pfm->variable_count));
+    vector<bool> started(num_starts);
+    mutex bests_mutex;
+
+    score_batcher batcher(pfm->scorer, num_starts);
+    batched_scorer scorer(pfm->scorer, batcher);
+
+    auto search = [&](int k) {
+        FMinSearch* p = nullptr;
+        try
+        {
+            p = fminsearch_new_with_eq(&scorer, pfm->variable_count);
+            p->rho = pfm->rho;
+            p->chi = pfm->chi;
+            p->psi = pfm->psi;
+            p->sigma = pfm->sigma;
+            p->tolx = pfm->tolx;
+            p->tolf = pfm->tolf;
+            p->delta = pfm->delta;
+            p->zero_delta = pfm->zero_delta;
+            p->maxiters = pfm->maxiters;
+
+            auto threshold = [&, k](FMinSearch* searching) {
+                if (threshold_achieved(searching))
+                    return true;
+
+                auto best = get_best_result(searching);
+                lock_guard<mutex> lock(bests_mutex);
+                bests[k] = *best;
+                started[k] = true;
+                for (int j = 0; j < num_starts; ++j)
+                {
+                    if (j == k || !started[j])
+                        continue;
+                    bool better = bests[j].score < best->score || (bests[j].score == best->score && j < k);
+                    if (better && same_optimum(bests[j].values, best->values))
+                    {
+                        traces[k].duplicate = true;
+                        return true;
+                    }
+                }
+                return false;
+            };
+
+            traces[k].initial = initials[k];
+            vector<double> x = initials[k];
+            fminsearch_min(p, &x[0], threshold);
+
+            auto best = get_best_result(p);
+            traces[k].values = best->values;
+            traces[k].score = best->score;
+            traces[k].iterations = p->iters;
+            {
+                lock_guard<mutex> lock(bests_mutex);
+                bests[k] = *best;
+                started[k] = true;
+            }
+        }
+        catch (...)
+        {
+            if (p)
+                fminsearch_free(p);
+            batcher.fail(current_exception());
+            return;
+        }
+        fminsearch_free(p);
+        batcher.search_finished();
+    };
+
+    vector<thread> threads;
+    try
+    {
+        for (int k = 0; k < num_starts; ++k)
+            threads.emplace_back(search, k);
+    }
+    catch (...)
+    {
+        batcher.fail(current_exception());
+    }
+    batcher.serve();
+    for (auto& t : threads)
+        t.join();
+    batcher.rethrow_failure();
+
+    return traces;
+}
+
+std::ostream& operator<<(std::ostream& ost, const start_trace& t)
+{
+    auto list = [&ost](const vector<double>& values) {
+        for (size_t i = 0; i < values.size(); ++i)
+            ost << (i == 0 ? "" : ",") << values[i];
+    };
+    ost << "Start ";
+    list(t.initial);
+    ost << " reached ";
+    list(t.values);
+    ost << " (-lnL " << t.score << ") in " << t.iterations << " iterations";
+    if (t.duplicate)
+        ost << ", stopping at the optimum of a better start";
+    return ost;
+}
+
 optimizer::optimizer(optimizer_scorer *p_scorer) : _p_scorer(p_scorer)
 {
 #ifdef SILENT
@@ -457,11 +752,30 @@ public:
     virtual std::string Description() const override { return "Standard Nelder-Mead"; };
 };
 
+//! Searches from every initial value at the same time, returning a result for each
+static vector<optimizer::result> search_concurrently(FMinSearch *pfm, const vector<vector<double>>& initials)
+{
+    auto traces = fminsearch_multistart(pfm, initials);
+
+    vector<optimizer::result> results(traces.size());
+    for (size_t i = 0; i < traces.size(); ++i)
+    {
+#ifndef SILENT
+        cout << traces[i] << endl;
+#endif
+        results[i].values = traces[i].values;
+        results[i].score = traces[i].score;
+        results[i].num_iterations = traces[i].iterations;
+    }
+    return results;
+}
+
 class InitialVariants : public OptimizerStrategy
 {
     optimizer& _opt;
+    int _concurrent_starts;
 public:
-    InitialVariants(optimizer& opt) : _opt(opt)
+    InitialVariants(optimizer& opt, int concurrent_starts) : _opt(opt), _concurrent_starts(concurrent_starts)
     {
 
     }
@@ -469,7 +783,17 @@ public:
     {
         vector<optimizer::result> results(PHASED_OPTIMIZER_PHASE1_ATTEMPTS);
 
-        for (auto& r : results)
+        if (_concurrent_starts > 1)
+        {
+            pfm->tolf = OPTIMIZER_LOW_PRECISION;
+            pfm->tolx = OPTIMIZER_LOW_PRECISION;
+
+            vector<vector<double>> initials(_concurrent_starts);
+            for (auto& i : initials)
+                i = _opt.get_initial_guesses();
+            results = search_concurrently(pfm, initials);
+        }
+        else for (auto& r : results)
         {
             pfm->tolf = OPTIMIZER_LOW_PRECISION;
             pfm->tolx = OPTIMIZER_LOW_PRECISION;
@@ -502,7 +826,13 @@ public:
 
 class RangeWidelyThenHomeIn : public OptimizerStrategy
 {
+    optimizer& _opt;
+    int _concurrent_starts;
 public:
+    RangeWidelyThenHomeIn(optimizer& opt, int concurrent_starts) : _opt(opt), _concurrent_starts(concurrent_starts)
+    {
+
+    }
     void Run(FMinSearch *pfm, optimizer::result& r, std::vector<double>& initial) override
     {
         pfm->rho *= 1.5;				// reflection
@@ -512,7 +842,24 @@ public:
         pfm->tolf = OPTIMIZER_LOW_PRECISION;
         pfm->tolx = OPTIMIZER_LOW_PRECISION;
 
-        fminsearch_min(pfm, &initial[0]);
+        int phase1_iters;
+        if (_concurrent_starts > 1)
+        {
+            // the given initial values are one of the starts
+            vector<vector<double>> initials(_concurrent_starts, initial);
+            for (size_t i = 1; i < initials.size(); ++i)
+                initials[i] = _opt.get_initial_guesses();
+            auto results = search_concurrently(pfm, initials);
+
+            phase1_iters = accumulate(results.begin(), results.end(), 0, [](int prev, const optimizer::result& r) { return prev + r.num_iterations;  });
+            initial = min_element(results.begin(), results.end(), [](const optimizer::result& r1, const optimizer::result& r2) { return r1.score < r2.score;  })->values;
+        }
+        else
+        {
+            fminsearch_min(pfm, &initial[0]);
+            phase1_iters = pfm->iters;
+            initial = get_best_result(pfm)->values;
+        }
 
         cout << "\n*****Threshold achieved, move to Phase 2*****\n\n";
 
@@ -521,9 +868,6 @@ public:
         pfm->delta = 0.05;
         pfm->tolf = OPTIMIZER_HIGH_PRECISION;
         pfm->tolx = OPTIMIZER_HIGH_PRECISION;
-        int phase1_iters = pfm->iters;
-        auto phase1_result = get_best_result(pfm);
-        initial = phase1_result->values;
 
         fminsearch_min(pfm, &initial[0]);
 
@@ -535,15 +879,335 @@ public:
     virtual std::string Description() const override { return "Search a wider area when close to a solution"; };
 };    
 
+//! Typical size of a value, used to scale steps so that rates of 0.001 and shapes of 1 move alike
+static double value_scale(double x)
+{
+    return max(fabs(x), LBFGS_MINIMUM_SCALE);
+}
 
-optimizer::result optimizer::optimize(const optimizer_parameters& params)
+//! The scorer's bounds, pulled in slightly, since the bounds themselves are usually unscorable (a lambda of zero, a saturated matrix)
+static pair<double, double> scorable_bounds(optimizer_scorer* scorer, int i)
 {
-    unique_ptr<OptimizerStrategy> strat(get_strategy(params));
+    auto b = scorer->bounds(i);
+    if (!std::isinf(b.first))
+        b.first += OPTIMIZER_BOUND_MARGIN * max(1.0, fabs(b.first));
+    if (!std::isinf(b.second))
+        b.second -= OPTIMIZER_BOUND_MARGIN * max(1.0, fabs(b.second));
+    return b;
+}
+
+static double dot(const vector<double>& a, const vector<double>& b)
+{
+    return inner_product(a.begin(), a.end(), b.begin(), 0.0);
+}
+
+void BoundedLBFGS::project(std::vector<double>& x) const
+{
+    for (size_t i = 0; i < x.size(); ++i)
+        x[i] = min(max(x[i], lower[i]), upper[i]);
+}
+
+std::vector<double> BoundedLBFGS::gradient(optimizer_scorer* scorer, const std::vector<double>& x, double fx) const
+{
+    size_t n = x.size();
+
+    // steps are cut short where they would cross a bound, giving a one-sided difference there
+    vector<double> forward(n), backward(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        double h = LBFGS_GRADIENT_STEP * value_scale(x[i]);
+        forward[i] = min(x[i] + h, upper[i]);
+        backward[i] = max(x[i] - h, lower[i]);
+    }
+
+    vector<vector<double>> points(2 * n, x);
+    vector<const double *> values(2 * n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        points[2 * i][i] = forward[i];
+        points[2 * i + 1][i] = backward[i];
+        values[2 * i] = &points[2 * i][0];
+        values[2 * i + 1] = &points[2 * i + 1][0];
+    }
+    vector<double> scores(2 * n);
+    scorer->calculate_scores(values, &scores[0]);
+
+    vector<double> result(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        double xf = forward[i], ff = scores[2 * i];
+        double xb = backward[i], fb = scores[2 * i + 1];
+        if (xf == x[i] || std::isinf(ff))
+        {
+            xf = x[i]; ff = fx;
+        }
+        if (xb == x[i] || std::isinf(fb))
+        {
+            xb = x[i]; fb = fx;
+        }
+        result[i] = xf > xb ? (ff - fb) / (xf - xb) : 0.0;
+    }
+    return result;
+}
+
+void BoundedLBFGS::Run(FMinSearch* pfm, optimizer::result& r, std::vector<double>& initial)
+{
+    optimizer_scorer* scorer = pfm->scorer;
+    size_t n = initial.size();
+
+    lower.resize(n);
+    upper.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        auto b = scorable_bounds(scorer, i);
+        lower[i] = b.first;
+        upper[i] = b.second;
+    }
+    pfm->tolf = OPTIMIZER_HIGH_PRECISION;
+    pfm->tolx = OPTIMIZER_HIGH_PRECISION;
+
+    vector<double> x = initial;
+    project(x);
+    double fx = scorer->calculate_score(&x[0]);
+    vector<double> g = gradient(scorer, x, fx);
+
+    deque<vector<double>> s_history, y_history;
+    int iter = 0;
+    while (!std::isinf(fx) && iter < pfm->maxiters)
+    {
+        iter++;
+
+        // two-loop recursion for the quasi-Newton direction
+        vector<double> d(g);
+        vector<double> alpha(s_history.size());
+        for (int k = int(s_history.size()) - 1; k >= 0; --k)
+        {
+            alpha[k] = dot(s_history[k], d) / dot(y_history[k], s_history[k]);
+            for (size_t i = 0; i < n; ++i)
+                d[i] -= alpha[k] * y_history[k][i];
+        }
+        if (!s_history.empty())
+        {
+            double gamma = dot(s_history.back(), y_history.back()) / dot(y_history.back(), y_history.back());
+            for (auto& di : d)
+                di *= gamma;
+        }
+        for (size_t k = 0; k < s_history.size(); ++k)
+        {
+            double beta = dot(y_history[k], d) / dot(y_history[k], s_history[k]);
+            for (size_t i = 0; i < n; ++i)
+                d[i] += (alpha[k] - beta) * s_history[k][i];
+        }
+        for (auto& di : d)
+            di = -di;
+
+        // values held at a bound by the gradient do not move
+        auto hold_active = [&](vector<double>& dir) {
+            for (size_t i = 0; i < n; ++i)
+            {
+                if ((x[i] <= lower[i] && g[i] > 0) || (x[i] >= upper[i] && g[i] < 0))
+                    dir[i] = 0;
+            }
+        };
+        hold_active(d);
+        if (dot(g, d) >= 0)
+        {
+            s_history.clear();
+            y_history.clear();
+            transform(g.begin(), g.end(), d.begin(), [](double gi) { return -gi; });
+            hold_active(d);
+        }
+        if (all_of(d.begin(), d.end(), [](double di) { return di == 0; }))
+            break;
+
+        // without curvature information, the first step changes no value by more than half its size
+        double t = 1.0;
+        if (s_history.empty())
+        {
+            double largest = 0;
+            for (size_t i = 0; i < n; ++i)
+                largest = max(largest, fabs(d[i]) / value_scale(x[i]));
+            t = min(1.0, 0.5 / largest);
+        }
+
+        vector<double> xn(n);
+        double fn = -log(0);
+        bool accepted = false;
+        for (int backtrack = 0; backtrack < LBFGS_MAX_BACKTRACKS && !accepted; ++backtrack, t /= 2)
+        {
+            for (size_t i = 0; i < n; ++i)
+                xn[i] = x[i] + t * d[i];
+            project(xn);
+
+            double decrease = 0;
+            for (size_t i = 0; i < n; ++i)
+                decrease += g[i] * (xn[i] - x[i]);
+
+            fn = scorer->calculate_score(&xn[0]);
+            accepted = fn <= fx + LBFGS_SUFFICIENT_DECREASE * decrease;
+        }
+
+        if (!accepted)
+        {
+            // the curvature estimate may be stale; retry once along the gradient before giving up
+            if (s_history.empty())
+                break;
+            s_history.clear();
+            y_history.clear();
+            continue;
+        }
+
+        vector<double> gn = gradient(scorer, xn, fn);
+        vector<double> s(n), y(n);
+        bool values_settled = true;
+        for (size_t i = 0; i < n; ++i)
+        {
+            s[i] = xn[i] - x[i];
+            y[i] = gn[i] - g[i];
+            if (fabs(s[i]) > pfm->tolx * value_scale(xn[i]))
+                values_settled = false;
+        }
+        bool score_settled = fx - fn < pfm->tolf;
+
+        // only pairs with positive curvature keep the approximate inverse Hessian positive definite
+        if (dot(s, y) > 1e-10 * sqrt(dot(s, s) * dot(y, y)))
+        {
+            s_history.push_back(s);
+            y_history.push_back(y);
+            if (s_history.size() > LBFGS_HISTORY_SIZE)
+            {
+                s_history.pop_front();
+                y_history.pop_front();
+            }
+        }
 
+        x = xn;
+        fx = fn;
+        g = gn;
+
+        if (values_settled && score_settled)
+            break;
+    }
+
+    pfm->iters = iter;
+    r.values = x;
+    r.score = fx;
+    r.num_iterations = iter;
+}
+
+
+void BrentSearch::Run(FMinSearch* pfm, optimizer::result& r, std::vector<double>& initial)
+{
+    optimizer_scorer* scorer = pfm->scorer;
+    auto limits = scorable_bounds(scorer, 0);
+    auto clamp = [&limits](double x) { return min(max(x, limits.first), limits.second); };
+    int evaluations = 0;
+    auto score = [&](double x) { evaluations++; return scorer->calculate_score(&x); };
+
+    // walk downhill in growing steps until the score rises again or a bound is reached.
+    // Unscorable values past a bound score infinity, so they close the bracket too
+    double a = clamp(initial[0]);
+    double fa = score(a);
+    double b = clamp(a + BRENT_INITIAL_STEP * value_scale(a));
+    if (b == a)
+        b = clamp(a - BRENT_INITIAL_STEP * value_scale(a));
+    double fb = score(b);
+    if (fb > fa)
+    {
+        swap(a, b);
+        swap(fa, fb);
+    }
+    double c = clamp(b + GOLDEN_RATIO * (b - a));
+    double fc = c == b ? fb : score(c);
+    while (fc < fb && evaluations < pfm->maxiters)
+    {
+        a = b; fa = fb;
+        b = c; fb = fc;
+        c = clamp(b + GOLDEN_RATIO * (b - a));
+        if (c == b)
+            break;
+        fc = score(c);
+    }
+
+    // Brent's method: parabolic steps through the three best points, golden section steps when those misbehave
+    const double golden_section = 2 - GOLDEN_RATIO;
+    double lo = min(a, c), hi = max(a, c);
+    double x = b, fx = fb;
+    if (fc < fx)
+    {
+        x = c; fx = fc;
+    }
+    double w = x, v = x, fw = fx, fv = fx;
+    double step = 0, previous_step = 0;
+    while (evaluations < pfm->maxiters)
+    {
+        double mid = (lo + hi) / 2;
+        double tol = pfm->tolx * value_scale(x);
+        if (fabs(x - mid) <= 2 * tol - (hi - lo) / 2)
+            break;
+
+        bool parabolic = false;
+        if (fabs(previous_step) > tol && !std::isinf(fw) && !std::isinf(fv))
+        {
+            double r1 = (x - w) * (fx - fv);
+            double q = (x - v) * (fx - fw);
+            double p = (x - v) * q - (x - w) * r1;
+            q = 2 * (q - r1);
+            if (q > 0)
+                p = -p;
+            q = fabs(q);
+            double older_step = previous_step;
+            previous_step = step;
+            if (fabs(p) < fabs(q * older_step / 2) && p > q * (lo - x) && p < q * (hi - x))
+            {
+                parabolic = true;
+                step = p / q;
+                double u = x + step;
+                if (u - lo < 2 * tol || hi - u < 2 * tol)
+                    step = mid > x ? tol : -tol;
+            }
+        }
+        if (!parabolic)
+        {
+            previous_step = x >= mid ? lo - x : hi - x;
+            step = golden_section * previous_step;
+        }
+
+        double u = fabs(step) >= tol ? x + step : x + (step > 0 ? tol : -tol);
+        double fu = score(u);
+        if (fu <= fx)
+        {
+            if (u >= x) lo = x; else hi = x;
+            v = w; fv = fw;
+            w = x; fw = fx;
+            x = u; fx = fu;
+        }
+        else
+        {
+            if (u < x) lo = u; else hi = u;
+            if (fu <= fw || w == x)
+            {
+                v = w; fv = fw;
+                w = u; fw = fu;
+            }
+            else if (fu <= fv || v == x || v == w)
+            {
+                v = u; fv = fu;
+            }
+        }
+    }
+
+    pfm->iters = evaluations;
+    r.values = { x };
+    r.score = fx;
+    r.num_iterations = evaluations;
+}
+
+optimizer::result optimizer::optimize(const optimizer_parameters& params)
+{
     if (!quiet)
     {
-        cout << "\nOptimizer strategy: " << strat->Description() << "\n" << endl;
-        cout << "Iterations: " << params.neldermead_iterations << "\nExpansion: " << params.neldermead_expansion << "\nReflection: " << params.neldermead_reflection <<"\n\nStarting Search for Initial Parameter Values\n"<< endl;
+        cout << "\nStarting Search for Initial Parameter Values\n" << endl;
     }
 
     using clock = std::chrono::system_clock;
@@ -554,6 +1218,15 @@ optimizer::result optimizer::optimize(const optimizer_parameters& params)
     auto initial = get_initial_guesses();
     fminsearch_set_equation(pfm, _p_scorer, initial.size());
 
+    // the strategy depends on how many values are being optimized
+    unique_ptr<OptimizerStrategy> strat(get_strategy(params));
+
+    if (!quiet)
+    {
+        cout << "\nOptimizer strategy: " << strat->Description() << "\n" << endl;
+        cout << "Iterations: " << params.neldermead_iterations << "\nExpansion: " << params.neldermead_expansion << "\nReflection: " << params.neldermead_reflection << "\n" << endl;
+    }
+
     strat->Run(pfm, r, initial);
     r.duration = chrono::duration_cast<chrono::seconds>(clock::now() - before);
 
@@ -597,20 +1270,28 @@ OptimizerStrategy *optimizer::get_strategy(const optimizer_parameters& params)
     pfm->rho = params.neldermead_reflection;
     pfm->maxiters = params.neldermead_iterations;
 
+    // a lone value is found faster by a line search than by a two-point simplex
+    if (pfm->variable_count == 1)
+    {
+        pfm->tolx = OPTIMIZER_HIGH_PRECISION;
+        return new BrentSearch();
+    }
+
     switch (params.strategy)
     {
     case RangeWidely:
-        return new RangeWidelyThenHomeIn();
+        return new RangeWidelyThenHomeIn(*this, params.concurrent_starts);
     case InitialVar:
-        return new InitialVariants(*this);
+        return new InitialVariants(*this, params.concurrent_starts);
     case Perturb:
         return new PerturbWhenClose();
     case SimilarityCutoff:
         return new NelderMeadSimilarityCutoff();
     case Standard:
         return new StandardNelderMead();
-    case NLOpt:
     case LBFGS:
+        return new BoundedLBFGS();
+    case NLOpt:
         throw std::runtime_error("Optimizer strategy not supported");
     }
 
@@ -7,6 +7,7 @@
 #include <iosfwd>
 #include <functional>
 #include <deque>
+#include <stdexcept>
 
 //! \defgroup optimizer Optimization
 //! @brief Classes and functions designed to calculate optimal values for various parameters
@@ -26,6 +27,9 @@ struct optimizer_parameters {
     double neldermead_expansion;
     double neldermead_reflection;
     int neldermead_iterations = 300;
+    //! Starting points the InitialVariants and RangeWidelyThenHomeIn strategies search at the same time.
+    //! Below two, they search their starting points one after another
+    int concurrent_starts = 0;
     strategies strategy;
     optimizer_parameters();
 };
@@ -71,6 +75,7 @@ void** calloc_2dim(int row, int col, int size);
 void free_2dim(void** data, int row, int col);
 int __fminsearch_checkV(FMinSearch* pfm);
 int __fminsearch_checkF(FMinSearch* pfm);
+void __fminsearch_score_candidates(FMinSearch* pfm, int first, int last);
 void __fminsearch_min_init(FMinSearch* pfm, double* X0);
 void __fminsearch_x_mean(FMinSearch* pfm);
 double __fminsearch_x_reflection(FMinSearch* pfm);
@@ -82,6 +87,21 @@ void __fminsearch_set_last_element(FMinSearch* pfm, double* x, double f);
 bool threshold_achieved(FMinSearch* pfm);
 int fminsearch_min(FMinSearch* pfm, double* X0, std::function<bool(FMinSearch*)> threshold_func = threshold_achieved);
 
+//! @brief The course of one search of a multi-start optimization
+//! \ingroup optimizer
+struct start_trace {
+    std::vector<double> initial;
+    std::vector<double> values;
+    double score;
+    int iterations;
+
+    //! The search stopped early, having reached the optimum of a search that scored better
+    bool duplicate = false;
+};
+
+std::vector<start_trace> fminsearch_multistart(FMinSearch* pfm, const std::vector<std::vector<double>>& initials);
+std::ostream& operator<<(std::ostream& ost, const start_trace& t);
+
 class OptimizerStrategy;
 
 //! @brief Provides routines allowing the optimization of some function
@@ -152,6 +172,38 @@ public:
     virtual std::string Description() const override { return "Nelder-Mead with similarity cutoff"; };
 };
 
+//! @brief Quasi-Newton search that keeps values within the bounds the scorer reports (L-BFGS-B style)
+//! \ingroup optimizer
+//!
+//! Gradients are estimated by central differences. The 2n candidates of each gradient
+//! are handed to the scorer as one batch, so a model that scores several candidates
+//! at once evaluates them all concurrently.
+class BoundedLBFGS : public OptimizerStrategy
+{
+    std::vector<double> lower, upper;
+public:
+    void Run(FMinSearch* pfm, optimizer::result& r, std::vector<double>& initial) override;
+
+    //! Moves each value inside its bounds
+    void project(std::vector<double>& x) const;
+
+    //! Estimates the gradient of the score at x, whose score is fx
+    std::vector<double> gradient(optimizer_scorer* scorer, const std::vector<double>& x, double fx) const;
+
+    virtual std::string Description() const override { return "Bounded limited-memory BFGS"; };
+};
+
+//! @brief Search for a single value: brackets the minimum within the scorer's bounds,
+//! then narrows the bracket with Brent's method
+//! \ingroup optimizer
+class BrentSearch : public OptimizerStrategy
+{
+public:
+    void Run(FMinSearch* pfm, optimizer::result& r, std::vector<double>& initial) override;
+
+    virtual std::string Description() const override { return "Bracketing and Brent's method"; };
+};
+
 std::ostream& operator<<(std::ostream& ost, const optimizer::result& r);
 
 class OptimizerInitializationFailure : public std::runtime_error {
@@ -163,5 +215,8 @@ public:
 };
 
 #define OPTIMIZER_SIMILARITY_CUTOFF_SIZE    12
+#define LBFGS_HISTORY_SIZE    5
+#define BRENT_INITIAL_STEP    0.1
+#define MULTISTART_SAME_OPTIMUM    1e-2
 
 #endif
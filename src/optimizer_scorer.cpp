@@ -1,6 +1,7 @@
 #include <iomanip>
 #include <iostream>
 #include <random>
+#include <memory>
 
 #include "optimizer_scorer.h"
 #include "clade.h"
@@ -9,6 +10,7 @@
 #include "gamma_core.h"
 #include "gamma.h"
 #include "error_model.h"
+#include "matrix_cache.h"
 
 #define GAMMA_INITIAL_GUESS_EXPONENTIAL_DISTRIBUTION_LAMBDA 1.75
 
@@ -16,10 +18,27 @@ extern std::mt19937 randomizer_engine;
 
 using namespace std;
 
+std::vector<double> inference_optimizer_scorer::score_key(const lambda *p_lambda) const
+{
+    auto result = _p_model->configuration();
+    for (double value : get_lambda_values(p_lambda))
+        result.push_back(matrix_cache_key(0, value, 0).lambda());
+    return result;
+}
+
 double inference_optimizer_scorer::calculate_score(const double *values)
 {
     prepare_calculation(values);
 
+    // the model is prepared even when the score is known, so it is left holding the values last scored
+    auto key = score_key(_p_lambda);
+    auto memo = _score_memo.find(key);
+    if (memo != _score_memo.end())
+    {
+        _p_model->get_monitor().Event_InferenceAttempt_Memoized();
+        return memo->second;
+    }
+
     if (!quiet)
     {
         report_precalculation();
@@ -29,9 +48,83 @@ double inference_optimizer_scorer::calculate_score(const double *values)
 
     if (std::isnan(score)) score = -log(0);
 
+    _score_memo[key] = score;
     return score;
 }
 
+void inference_optimizer_scorer::calculate_scores(const std::vector<const double *>& values, double *scores)
+{
+    vector<unique_ptr<lambda>> lambdas;
+    vector<const lambda *> candidates;
+    for (auto v : values)
+    {
+        lambdas.emplace_back(candidate_lambda(v));
+        if (!lambdas.back())
+            break;
+        candidates.push_back(lambdas.back().get());
+    }
+
+    if (values.size() < 2 || candidates.size() != values.size())
+    {
+        optimizer_scorer::calculate_scores(values, scores);
+        return;
+    }
+
+    // only values not scored before are inferred, each of them once
+    vector<vector<double>> keys;
+    vector<const lambda *> unscored;
+    vector<vector<size_t>> positions;
+    map<vector<double>, size_t> batch_index;
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        auto key = score_key(candidates[i]);
+        auto memo = _score_memo.find(key);
+        if (memo != _score_memo.end())
+        {
+            _p_model->get_monitor().Event_InferenceAttempt_Memoized();
+            scores[i] = memo->second;
+            continue;
+        }
+
+        auto in_batch = batch_index.find(key);
+        if (in_batch != batch_index.end())
+        {
+            _p_model->get_monitor().Event_InferenceAttempt_Memoized();
+            positions[in_batch->second].push_back(i);
+            continue;
+        }
+
+        batch_index[key] = unscored.size();
+        keys.push_back(key);
+        unscored.push_back(candidates[i]);
+        positions.push_back({ i });
+    }
+    if (unscored.empty())
+        return;
+
+    // a model that cannot score the batch leaves each value to calculate_score, which reports it
+    auto results = _p_model->infer_family_likelihoods(_p_distribution, _rootdist_map, unscored);
+    if (!quiet && !results.empty())
+    {
+        for (auto p_lambda : unscored)
+            report_candidate(p_lambda);
+    }
+
+    for (size_t k = 0; k < unscored.size(); ++k)
+    {
+        double score;
+        if (results.empty())
+            score = calculate_score(values[positions[k][0]]);
+        else
+        {
+            score = std::isnan(results[k]) ? -log(0) : results[k];
+            _score_memo[keys[k]] = score;
+        }
+        for (auto i : positions[k])
+            scores[i] = score;
+    }
+}
+
 //Inititial Guess multiplies the 1/longest branch by a random draw from a normal 
 //distribution centered such that it will start around a value for lambda of 0.002
 std::vector<double> lambda_optimizer::initial_guesses()
@@ -56,9 +149,29 @@ void lambda_optimizer::prepare_calculation(const double *values)
     _p_lambda->update(values);
 }
 
+lambda *lambda_optimizer::candidate_lambda(const double *values)
+{
+    lambda *result = _p_lambda->clone();
+    result->update(values);
+    return result;
+}
+
+std::pair<double, double> lambda_optimizer::bounds(int i) const
+{
+    if (_longest_branch <= 0)
+        return inference_optimizer_scorer::bounds(i);
+
+    return { 0.0, 1.0 / _longest_branch };
+}
+
 void lambda_optimizer::report_precalculation()
 {
-    std::cout << "Lambda: " << *_p_lambda << std::endl;
+    report_candidate(_p_lambda);
+}
+
+void lambda_optimizer::report_candidate(const lambda *p_lambda)
+{
+    std::cout << "Lambda: " << *p_lambda << std::endl;
 }
 
 void lambda_optimizer::finalize(double *results)
@@ -105,6 +218,14 @@ void lambda_epsilon_optimizer::finalize(double *results)
     _p_error_model->update_single_epsilon(results[_p_lambda->count()]);
 }
 
+std::pair<double, double> lambda_epsilon_optimizer::bounds(int i) const
+{
+    if (i < _p_lambda->count())
+        return _lambda_optimizer.bounds(i);
+
+    return { 0.0, 1.0 };
+}
+
 gamma_optimizer::gamma_optimizer(gamma_model* p_model, root_equilibrium_distribution* prior, const std::map<int, int>& root_distribution_map) :
     inference_optimizer_scorer(p_model->get_lambda(), p_model, prior, root_distribution_map),
     _p_gamma_model(p_model)
@@ -176,3 +297,10 @@ void gamma_lambda_optimizer::finalize(double *results) {
     _gamma_optimizer.finalize(results + _p_lambda->count());
 }
 
+std::pair<double, double> gamma_lambda_optimizer::bounds(int i) const
+{
+    if (i < _p_lambda->count())
+        return _lambda_optimizer.bounds(i);
+
+    return _gamma_optimizer.bounds(0);
+}
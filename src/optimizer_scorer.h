@@ -3,6 +3,8 @@
 
 #include <vector>
 #include <map>
+#include <limits>
+#include <utility>
 
 class error_model;
 class lambda;
@@ -20,6 +22,19 @@ public:
     virtual std::vector<double> initial_guesses() = 0;
 
     virtual double calculate_score(const double *values) = 0;
+
+    //! Scores several sets of values, which must not depend on each other's scores. By default they are scored one after another
+    virtual void calculate_scores(const std::vector<const double *>& values, double *scores)
+    {
+        for (size_t i = 0; i < values.size(); ++i)
+            scores[i] = calculate_score(values[i]);
+    }
+
+    //! Lowest and highest legal value of the i'th value. By default values are unbounded
+    virtual std::pair<double, double> bounds(int i) const
+    {
+        return { -std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity() };
+    }
 };
 
 //! @brief  Scorer that holds a model and calls its inference method
@@ -30,11 +45,24 @@ protected:
     virtual void prepare_calculation(const double *values) = 0;
     virtual void report_precalculation() = 0;
 
+    //! A new lambda with the given values, leaving the model's own alone. Scorers that optimize more than lambda return NULL
+    virtual lambda *candidate_lambda(const double *values) { return nullptr; }
+
+    //! Reports a candidate of \ref candidate_lambda once the model has scored it along with the rest of its batch
+    virtual void report_candidate(const lambda *p_lambda) {}
+
     lambda *_p_lambda;
     model *_p_model;
     root_equilibrium_distribution *_p_distribution;
     const std::map<int, int>& _rootdist_map;
 
+    //! Scores already calculated, by \ref score_key
+    std::map<std::vector<double>, double> _score_memo;
+
+    //! The model's configuration followed by the lambda values, rounded as \ref matrix_cache_key rounds
+    /// them. Values with the same key have the same transition matrices, and so the same score
+    std::vector<double> score_key(const lambda *p_lambda) const;
+
 public:
     inference_optimizer_scorer(lambda *p_lambda, model* p_model, root_equilibrium_distribution *p_distribution, const std::map<int, int>& root_distribution_map) :
         _p_lambda(p_lambda),
@@ -52,6 +80,15 @@ public:
 
     double calculate_score(const double *values) ;
 
+    //! Scores the values concurrently, each with a lambda of its own, if \ref candidate_lambda and the model support it
+    void calculate_scores(const std::vector<const double *>& values, double *scores) override;
+
+    //! Rates, probabilities and shape parameters are all positive
+    std::pair<double, double> bounds(int i) const override
+    {
+        return { 0.0, std::numeric_limits<double>::infinity() };
+    }
+
     virtual void finalize(double *result) = 0;
 
     bool quiet;
@@ -76,6 +113,11 @@ public:
 
     virtual void prepare_calculation(const double *values) override;
     virtual void report_precalculation() override;
+    virtual void report_candidate(const lambda *p_lambda) override;
+    virtual lambda *candidate_lambda(const double *values) override;
+
+    //! Lambdas lie between zero and the inverse of the longest branch, beyond which transition matrices saturate
+    std::pair<double, double> bounds(int i) const override;
 };
 
 
@@ -106,6 +148,9 @@ public:
     virtual void report_precalculation() override;
 
     virtual void finalize(double *results) override;
+
+    //! Lambdas as for \ref lambda_optimizer, followed by epsilons, which are probabilities
+    std::pair<double, double> bounds(int i) const override;
 };
 
 class gamma_model;
@@ -143,6 +188,8 @@ public:
 
     /// results consists of the desired number of lambdas and one alpha value
     void finalize(double *results) override;
+
+    std::pair<double, double> bounds(int i) const override;
 };
 
 
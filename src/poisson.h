@@ -17,6 +17,12 @@ public:
     virtual std::vector<double> initial_guesses() override;
     virtual double calculate_score(const double * values) override;
 
+    //! A Poisson mean is positive
+    virtual std::pair<double, double> bounds(int i) const override
+    {
+        return { 0.0, std::numeric_limits<double>::infinity() };
+    }
+
     double lnLPoisson(const double* plambda);
 };
 
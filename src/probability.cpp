@@ -6,16 +6,20 @@
 #include <numeric>
 #include <cmath>
 #include <memory>
-
-#ifdef HAVE_VECTOR_EXP
-#include "mkl.h"
-#endif
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <omp.h>
 
 #include "clade.h"
 #include "probability.h"
 #include "matrix_cache.h"
 #include "gene_family.h"
 #include "error_model.h"
+#include "compiled_tree.h"
+#include "pruning_workspace.h"
+#include "family_table.h"
 
 using namespace std;
 
@@ -49,31 +53,40 @@ double gammaln(double a)
 */
 
 
-#define GAMMA_CACHE_SIZE 1024
+//! Largest n for which ln(n!) is tabulated at startup. Matrix caches extend the table to what their size needs
+#define LOG_FACTORIAL_TABLE_SIZE 1024
 
-vector<double> lgamma_cache;
-
-matrix chooseln_cache(100);
+//! ln(k!) for k from 0 to one less than the size of the table
+/*!
+A table is never changed once published. \ref ensure_log_factorial_table replaces it with a larger
+one and keeps the old one alive, so chooseln reads through the pointer from any thread without a
+lock, even while another thread is growing the table.
+*/
+static std::atomic<const vector<double>*> log_factorials{nullptr};
+static std::mutex log_factorials_mutex;
+static vector<unique_ptr<vector<double>>> log_factorial_tables;  //!< every table ever published, guarded by log_factorials_mutex
 
-inline double lgamma2(double n)
+void ensure_log_factorial_table(int max_n)
 {
-    if (n >= 0 && n < GAMMA_CACHE_SIZE && (n - int(n) < 0.00000000001))
-        return lgamma_cache.at(int(n));
+    const vector<double>* p_table = log_factorials.load(std::memory_order_acquire);
+    if (p_table && int(p_table->size()) > max_n)
+        return;
+
+    std::lock_guard<std::mutex> lock(log_factorials_mutex);
+    p_table = log_factorials.load(std::memory_order_acquire);
+    if (p_table && int(p_table->size()) > max_n)
+        return;
 
-    return lgamma(n);
+    unique_ptr<vector<double>> table(new vector<double>(max_n + 1));
+    for (int k = 0; k <= max_n; ++k)
+        (*table)[k] = lgamma(k + 1.0);
+    log_factorials.store(table.get(), std::memory_order_release);
+    log_factorial_tables.push_back(std::move(table));
 }
 
 void init_lgamma_cache()
 {
-    lgamma_cache.resize(GAMMA_CACHE_SIZE);
-    for (int i = 0; i < GAMMA_CACHE_SIZE; ++i)
-    {
-        lgamma_cache[i] = lgamma(i);
-    }
-
-    for (int i = 0; i < chooseln_cache.size(); ++i)
-        for (int j = 0; j < chooseln_cache.size(); ++j)
-            chooseln_cache.set(i, j, lgamma2(i + 1) - lgamma2(j + 1) - lgamma2(i - j + 1));
+    ensure_log_factorial_table(LOG_FACTORIAL_TABLE_SIZE);
 }
 
 double chooseln(double n, double r)
@@ -81,10 +94,16 @@ double chooseln(double n, double r)
   if (r == 0 || (n == 0 && r == 0)) return 0;
   else if (n <= 0 || r <= 0) return log(0);
 
-  if (n >= 0 && r >= 0 && n < chooseln_cache.size() && r < chooseln_cache.size() && (n - int(n) < 0.00000000001) && (r - int(r) < 0.00000000001))
-      return chooseln_cache.get(n, r);
+  const vector<double>* p_table = log_factorials.load(std::memory_order_acquire);
+  int i = int(n), j = int(r);
+  if (p_table && i == n && j == r && size_t(i) < p_table->size())
+  {
+      if (j > i) return log(0);
+      const double *log_factorial = p_table->data();
+      return log_factorial[i] - log_factorial[j] - log_factorial[i - j];
+  }
 
-  return lgamma2(n + 1) - lgamma2(r + 1) - lgamma2(n - r + 1);
+  return lgamma(n + 1) - lgamma(r + 1) - lgamma(n - r + 1);
 }
 
 /* END: Math tools ----------------------- */
@@ -96,50 +115,165 @@ double chooseln(double n, double r)
   coeff = 1 - 2 * alpha;
 */
 
-#define MAX_FAMILY_SIZE_FOR_VECTORIZING 10000
+//! Number of terms of the birth-death series built and summed at a time
+#define BIRTHDEATH_CHUNK_SIZE 256
 
-double birthdeath_rate_with_log_alpha(int s, int c, double log_alpha, double coeff)
+// The vectorized kernels rely on GCC's vector extensions, target attributes and CPU detection
+#if defined(__GNUC__) && !defined(__clang__) && !defined(__INTEL_COMPILER) && defined(__x86_64__)
+#define BIRTHDEATH_SIMD_DISPATCH
+#endif
+
+typedef double (*exp_power_series_kernel)(const double *t, int n, double first_power, double coeff);
+
+static double exp_power_series_scalar(const double *t, int n, double first_power, double coeff)
 {
-    int m = std::min(c, s);
     double result = 0.0;
-    if (m < MAX_FAMILY_SIZE_FOR_VECTORIZING)
-    {
-        int s_add_c = s + c;
-        int s_add_c_sub_1 = s_add_c - 1;
-        int s_sub_1 = s - 1;
+    for (int j = 0; j < n; j++) {
+        result += exp(t[j]) * first_power;
+        first_power *= coeff;
+    }
+    return result;
+}
 
-        double t[MAX_FAMILY_SIZE_FOR_VECTORIZING];
-        for (int j = 0; j <= m; j++) {
-            t[j] = chooseln(s, j) + chooseln(s_add_c_sub_1 - j, s_sub_1) + (s_add_c - 2 * j)*log_alpha;
-        }
+#ifdef BIRTHDEATH_SIMD_DISPATCH
+typedef double double4 __attribute__((vector_size(32)));
+typedef int64_t int64x4 __attribute__((vector_size(32)));
+typedef double double8 __attribute__((vector_size(64)));
+typedef int64_t int64x8 __attribute__((vector_size(64)));
+
+//! exp of each lane, to within about 2.2e-16 relative error
+/*!
+x is split into n*ln(2) + r with |r| <= ln(2)/2, exp(r) is a degree 13 Taylor polynomial, and 2^n
+is built directly in the exponent bits, as 2^(n-1) * 2 so that n = 1024 still fits. Like exp,
+results past the largest double are infinity; results below about 1e-308 are 0 rather than
+subnormal.
+Works in place, since passing wide vectors by value from code built without AVX changes the ABI.
+*/
+template<typename V, typename I>
+static inline __attribute__((always_inline)) void exp_vector(V& x)
+{
+    const double log2e = 1.4426950408889634074;
+    const double ln2_hi = 6.93145751953125e-1;
+    const double ln2_lo = 1.42860682030941723212e-6;
+    const double shifter = 6755399441055744.0;  // 1.5 * 2^52: adding it rounds to an integer, left in the low bits
+
+    const double min_arg = -708.0;
+    const double max_arg = 709.782712893384;    // ln(DBL_MAX)
+
+    V y = x < min_arg ? min_arg : x;
+    y = y > max_arg ? max_arg : y;
+    V fn = y * log2e + shifter;
+    I n = (I)fn;
+    fn -= shifter;
+    V r = y - fn * ln2_hi - fn * ln2_lo;
+
+    V p = r * (1.0 / 6227020800.0) + 1.0 / 479001600.0;
+    p = p * r + 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+    V result = p * (V)((n + 1022) << 52) * 2.0;
+    result = x < min_arg ? 0.0 : result;
+    x = x > max_arg ? HUGE_VAL : result;
+}
 
-        double expT[MAX_FAMILY_SIZE_FOR_VECTORIZING];
-#ifdef HAVE_VECTOR_EXP
-        vdExp(m + 1, t, expT);
-#else
-        std::transform(t, t + m + 1, expT, [](double d) { return exp(d); });
-#endif
+//! As \ref exp_power_series_scalar, one vector of terms at a time. Each lane keeps its own running
+/// power of coeff, multiplied by coeff to the number of lanes at every step
+template<typename V, typename I>
+static inline __attribute__((always_inline)) double exp_power_series_vector(const double *t, int n, double first_power, double coeff)
+{
+    const int lanes = sizeof(V) / sizeof(double);
+    V power, sum = {};
+    double step = 1.0;
+    for (int k = 0; k < lanes; ++k) {
+        power[k] = first_power * step;
+        step *= coeff;
+    }
 
-        double p[10000];
-        for (int j = 0; j <= m; j++) {
-            p[j] = expT[j] * pow(coeff, j); // Note that t is in log scale, therefore we need to do exp(t) to match Eqn. (1)
-        }
-        result = std::accumulate(p, p + m + 1, 0.0);
+    int j = 0;
+    for (; j + lanes <= n; j += lanes) {
+        V v;
+        memcpy(&v, t + j, sizeof(v));
+        exp_vector<V, I>(v);
+        sum += v * power;
+        power *= step;
+    }
+    if (j < n) {
+        // lanes past the end get a term of exp(-710) = 0
+        V v;
+        for (int k = 0; k < lanes; ++k)
+            v[k] = j + k < n ? t[j + k] : -710.0;
+        exp_vector<V, I>(v);
+        sum += v * power;
     }
-    else
+
+    double result = 0.0;
+    for (int k = 0; k < lanes; ++k)
+        result += sum[k];
+    return result;
+}
+
+__attribute__((target("avx2,fma")))
+static double exp_power_series_avx2(const double *t, int n, double first_power, double coeff)
+{
+    return exp_power_series_vector<double4, int64x4>(t, n, first_power, coeff);
+}
+
+__attribute__((target("avx512f")))
+static double exp_power_series_avx512(const double *t, int n, double first_power, double coeff)
+{
+    return exp_power_series_vector<double8, int64x8>(t, n, first_power, coeff);
+}
+#endif
+
+//! Picks the widest kernel the CPU supports
+static exp_power_series_kernel select_exp_power_series_kernel()
+{
+#ifdef BIRTHDEATH_SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return exp_power_series_avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return exp_power_series_avx2;
+#endif
+    return exp_power_series_scalar;
+}
+
+double exp_power_series(const double *t, int n, double first_power, double coeff)
+{
+    static const exp_power_series_kernel kernel = select_exp_power_series_kernel();
+    return kernel(t, n, first_power, coeff);
+}
+
+double birthdeath_rate_with_log_alpha(int s, int c, double log_alpha, double coeff)
+{
+    int m = std::min(c, s);
+    int s_add_c = s + c;
+    int s_add_c_sub_1 = s_add_c - 1;
+    int s_sub_1 = s - 1;
+
+    // the log terms are built a chunk at a time, so the buffer stays small however large the family
+    double t[BIRTHDEATH_CHUNK_SIZE];
+    double result = 0.0;
+    double power = 1.0; // coeff^j for the first term of the chunk, the equivalent of ^j in Eqn. (1)
+    for (int first = 0; first <= m; first += BIRTHDEATH_CHUNK_SIZE)
     {
-        // Calculate sequentially rather than allocating the required memory to vectorize (much slower)
-        double lastterm = 1;
-        int s_add_c = s + c;
-        int s_add_c_sub_1 = s_add_c - 1;
-        int s_sub_1 = s - 1;
-
-        for (int j = 0; j <= m; j++) {
-            double t = chooseln(s, j) + chooseln(s_add_c_sub_1 - j, s_sub_1) + (s_add_c - 2 * j)*log_alpha;
-            result += (exp(t) * lastterm); // Note that t is in log scale, therefore we need to do exp(t) to match Eqn. (1)
-            lastterm *= coeff; // equivalent of ^j in Eqn. (1)
+        int n = std::min(BIRTHDEATH_CHUNK_SIZE, m + 1 - first);
+        for (int k = 0; k < n; k++) {
+            int j = first + k;
+            t[k] = chooseln(s, j) + chooseln(s_add_c_sub_1 - j, s_sub_1) + (s_add_c - 2 * j)*log_alpha;
         }
-
+        // Note that t is in log scale, therefore we need to do exp(t) to match Eqn. (1)
+        result += exp_power_series(t, n, power, coeff);
+        power *= pow(coeff, n);
     }
     return std::max(std::min(result, 1.0), 0.0);
 }
@@ -164,6 +298,46 @@ double the_probability_of_going_from_parent_fam_size_to_c(double lambda, double
 }
 
 
+//! Fill a whole transition matrix for the product lambda*t in O(N^2).
+/*!
+The family at the end of a branch is the sum of s independent lineages, so row s of the matrix is
+the s-fold convolution of the single parent row. With alpha = lambda*t / (1 + lambda*t) the single
+parent row has the generating function (alpha + (1 - 2*alpha) z) / (1 - alpha z). Row s is therefore
+built from row s-1 by multiplying by the numerator (y_c = alpha*r_c + (1-2*alpha)*r_(c-1)) and
+dividing by the denominator (h_c = y_c + alpha*h_(c-1)). Every term is non-negative and alpha < 1/2,
+so the recurrence is stable; it agrees with \ref birthdeath_rate_with_log_alpha to about 1e-12.
+Saturated branches (and lambda*t == 0) produce the same matrix as the per-entry calculation.
+*/
+void fill_matrix_by_recurrence(double lambda_t, matrix& m)
+{
+    int size = m.size();
+    if (size == 0)
+        return;
+
+    m.set(0, 0, 1.0);
+
+    double alpha = lambda_t / (1 + lambda_t);
+    double coeff = 1 - 2 * alpha;
+    if (!(coeff > 0 && coeff != 1))
+        return;
+
+    vector<double> row(size, 0.0);
+    row[0] = 1.0;
+    for (int s = 1; s < size; ++s)
+    {
+        double previous_input = 0.0;    // row[c-1] of the previous row
+        double previous_output = 0.0;   // h[c-1] of the row being built
+        for (int c = 0; c < size; ++c)
+        {
+            double y = alpha * row[c] + coeff * previous_input;
+            previous_input = row[c];
+            row[c] = y + alpha * previous_output;
+            previous_output = row[c];
+            m.set(s, c, std::max(std::min(row[c], 1.0), 0.0));
+        }
+    }
+}
+
 /* END: Birth-death model components ----------------------- */
 
 //! Calculates the probabilities of a given node for a given family size.
@@ -259,6 +433,33 @@ std::vector<int> uniform_dist(int n_draws, int min, int max) {
     return uniform_vec;
 }
 
+//! Prunes the given rows of the table in blocks, each thread using its own workspace, and stores the
+/// largest root likelihood of each family in result
+static void prune_maximum_likelihoods(const clade *p_tree, const family_table& families, const vector<size_t>& rows, int max_root_family_size, int max_family_size, const lambda *p_lambda, const matrix_cache& cache, vector<double>& result)
+{
+    vector<pruning_workspace> workspaces(omp_get_max_threads());
+    int num_blocks = (rows.size() + PRUNING_BLOCK_SIZE - 1) / PRUNING_BLOCK_SIZE;
+#pragma omp parallel for
+    for (int b = 0; b < num_blocks; ++b)
+    {
+        pruning_workspace& workspace = workspaces[omp_get_thread_num()];
+        workspace.prepare(p_tree, PRUNING_BLOCK_SIZE, max_root_family_size, max_family_size);
+
+        size_t first = size_t(b) * PRUNING_BLOCK_SIZE;
+        int n = min(first + PRUNING_BLOCK_SIZE, rows.size()) - first;
+        workspace.prune(families, &rows[first], n, cache, p_lambda, NULL);
+
+        const double *root = workspace.root_likelihoods();
+        for (int j = 0; j < n; ++j)
+        {
+            double best = root[j];
+            for (int s = 1; s < max_root_family_size; ++s)
+                best = max(best, root[s * n + j]);
+            result[first + j] = best;
+        }
+    }
+}
+
 /*! Create a sorted vector of probabilities by generating random trees 
     \param p_tree The structure of the tree to generate
     \param number_of_simulations The number of random probabilities to return
@@ -273,43 +474,29 @@ std::vector<int> uniform_dist(int n_draws, int min, int max) {
 std::vector<double> get_random_probabilities(const clade *p_tree, int number_of_simulations, int root_family_size, int max_family_size, int max_root_family_size, const lambda *p_lambda, const matrix_cache& cache, error_model *p_error_model)
 {
     vector<double> result(number_of_simulations);
-    vector<gene_family> families(number_of_simulations);
-    vector<clademap<std::vector<double>>> pruners(number_of_simulations);
+    compiled_tree tree(p_tree);
+    family_table families(tree, number_of_simulations);
+    vector<int> sizes(tree.size());
 
     // generate families by generating a tree, then storing off the leaf values
     for (size_t i = 0; i < result.size(); ++i)
     {
         // generate a tree with root_family_size at the root
-        clademap<int> sizes;
-        sizes[p_tree] = root_family_size;
-        auto fn = [&](const clade* c) { set_weighted_random_family_size(c, &sizes, p_lambda, p_error_model, max_family_size, cache);};
-        p_tree->apply_prefix_order(fn);
-
-        // create the family by setting the species size from the leaf values
-        for (auto& it : sizes) {
-            if (it.first->is_leaf())
-            {
-                families[i].set_species_size(it.first->get_taxon_name(), it.second);
-            }
+        sizes[0] = root_family_size;
+        for (int node : tree.preorder())
+        {
+            if (tree.is_root(node))
+                continue;
+
+            sizes[node] = random_family_size(sizes[tree.parent(node)], p_lambda->get_value_for_clade(tree.node(node)), tree.branch_length(node), tree.is_leaf(node), p_error_model, max_family_size, cache);
+            if (tree.is_leaf(node))
+                families.set_count(i, tree.leaf_column(node), sizes[node]);
         }
     }
 
-    // initialize the probability vectors in the pruners
-    // Do this outside of the parallel loop as it allocates needed memory
-    for (auto& p : pruners)
-    {
-        // vector of lk's at tips must go from 0 -> _max_possible_family_size, so we must add 1
-        auto fn = [&](const clade* node) { p[node].resize(node->is_root() ? max_root_family_size : max_family_size + 1); };
-        p_tree->apply_reverse_level_order(fn);
-    }
-
-#pragma omp parallel for
-    for (size_t i = 0; i < result.size(); ++i)
-    {
-        auto fn = [&](const clade *c) { compute_node_probability(c, families[i], NULL, pruners[i], max_root_family_size, max_family_size, p_lambda, cache); };
-        p_tree->apply_reverse_level_order(fn);
-        result[i] = *std::max_element(pruners[i].at(p_tree).begin(), pruners[i].at(p_tree).end());
-    }
+    vector<size_t> rows(result.size());
+    iota(rows.begin(), rows.end(), 0);
+    prune_maximum_likelihoods(p_tree, families, rows, max_root_family_size, max_family_size, p_lambda, cache, result);
 
     sort(result.begin(), result.end());
 
@@ -323,10 +510,13 @@ void set_weighted_random_family_size(const clade *node, clademap<int> *sizemap,
         return;
 
     int parent_family_size = (*sizemap)[node->get_parent()];
-    size_t c = 0; // c is the family size we will go to
+    (*sizemap)[node] = random_family_size(parent_family_size, p_lambda->get_value_for_clade(node), node->get_branch_length(), node->is_leaf(), p_error_model, max_family_size, cache);
+}
 
-    double lambda = p_lambda->get_value_for_clade(node);
-    double branch_length = node->get_branch_length();
+//! Pick a random family size for a node, weighted by the probability of reaching it from the parent's family size
+int random_family_size(int parent_family_size, double lambda, double branch_length, bool is_leaf, const error_model *p_error_model, int max_family_size, const matrix_cache& cache)
+{
+    size_t c = 0; // c is the family size we will go to
 
     if (parent_family_size > 0) {
         auto probabilities = cache.get_matrix(branch_length, lambda);
@@ -343,12 +533,12 @@ void set_weighted_random_family_size(const clade *node, clademap<int> *sizemap,
         c = distribution(randomizer_engine);
     }
 
-    if (node->is_leaf())
+    if (is_leaf)
     {
         c = adjust_for_error_model(c, p_error_model);
     }
 
-    (*sizemap)[node] = c;
+    return c;
 }
 
 size_t adjust_for_error_model(size_t c, const error_model *p_error_model)
@@ -388,7 +578,7 @@ double pvalue(double v, const vector<double>& conddist)
     return  idx / (double)conddist.size();
 }
 
-double compute_tree_pvalue(const clade* p_tree, function<void(const clade*)> compute_func, size_t sz, const std::vector<std::vector<double>>& conditional_distribution, clademap<std::vector<double>>& clade_storage)
+double compute_tree_pvalue(const clade* p_tree, function<void(const clade*)> compute_func, size_t sz, const std::vector<std::vector<double>>& conditional_distribution, clademap<std::vector<double>>& clade_storage)
 {
 	for (auto& it : clade_storage)
 	{
@@ -422,20 +612,39 @@ vector<double> compute_pvalues(const clade* p_tree, const std::vector<gene_famil
         conditional_distribution[i] = get_random_probabilities(p_tree, number_of_simulations, i, mx, mxr, p_lambda, cache, NULL);
     }
 
-    vector<double> result(families.size());
+    compiled_tree tree(p_tree);
+    family_table table(tree, families);
 
-	std::map<const clade*, std::vector<double> > family_likelihoods;
+    // families with identical counts have identical pvalues, so only compute one of each
+    auto references = build_reference_list(table);
+    vector<size_t> rows;
+    vector<size_t> slot(families.size());
+    for (size_t i = 0; i < families.size(); ++i)
+    {
+        if (references[i] == i)
+        {
+            slot[i] = rows.size();
+            rows.push_back(i);
+        }
+    }
 
-	auto init_func = [&](const clade* node) { family_likelihoods[node].resize(node->is_root() ? mxr : mx + 1); };
-	p_tree->apply_reverse_level_order(init_func);
+    vector<double> observed_max_likelihoods(rows.size());
+    prune_maximum_likelihoods(p_tree, table, rows, mxr, mx, p_lambda, cache, observed_max_likelihoods);
 
-	transform(families.begin(), families.end(), result.begin(), [&](const gene_family& gf)
+    vector<double> unique_pvalues(rows.size());
+    transform(observed_max_likelihoods.begin(), observed_max_likelihoods.end(), unique_pvalues.begin(), [&](double observed_max_likelihood)
         {
-			auto compute_func = [&](const clade* c) { compute_node_probability(c, gf, NULL, family_likelihoods, mxr, mx, p_lambda, cache); };
-
-			return compute_tree_pvalue(p_tree, compute_func, mxr, conditional_distribution, family_likelihoods);
+            double result = 0;
+            for (int s = 0; s < mxr; s++)
+            {
+                result = max(result, pvalue(observed_max_likelihood, conditional_distribution[s]));
+            }
+            return result;
         });
 
+    vector<double> result(families.size());
+    for (size_t i = 0; i < families.size(); ++i)
+        result[i] = unique_pvalues[slot[references[i]]];
 
 #ifndef SILENT
     cout << "done!\n";
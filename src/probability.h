@@ -15,8 +15,13 @@ class matrix;
 class matrix_cache;
 
 double birthdeath_rate_with_log_alpha(int s, int c, double log_alpha, double coeff);
+//! Sum over j < n of exp(t[j]) * first_power * coeff^j, with the widest vector instructions the CPU supports (AVX-512, AVX2 or none)
+double exp_power_series(const double *t, int n, double first_power, double coeff);
 double the_probability_of_going_from_parent_fam_size_to_c(double lambda, double branch_length, int parent_size, int size);
 double chooseln(double n, double k);
+//! Makes sure chooseln reads ln(n!) from a table for every integer n up to max_n. Safe to call while other threads call chooseln
+void ensure_log_factorial_table(int max_n);
+void fill_matrix_by_recurrence(double lambda_t, matrix& m);
 
 /* START: Likelihood computation ---------------------- */
 
@@ -37,6 +42,7 @@ std::vector<int> uniform_dist(int n_draws, int min, int max);
 /* END: Uniform distribution - */
 
 void set_weighted_random_family_size(const clade *node, clademap<int> *sizemap, const lambda *p_lambda, error_model *p_error_model, int max_family_size, const matrix_cache& cache);
+int random_family_size(int parent_family_size, double lambda, double branch_length, bool is_leaf, const error_model *p_error_model, int max_family_size, const matrix_cache& cache);
 std::vector<double> get_random_probabilities(const clade *p_tree, int number_of_simulations, int root_family_size, int max_family_size, int max_root_family_size, const lambda *p_lambda, const matrix_cache& cache, error_model *p_error_model);
 size_t adjust_for_error_model(size_t c, const error_model *p_error_model);
 
@@ -0,0 +1,340 @@
+#include <algorithm>
+#include <cassert>
+
+#include "pruning_workspace.h"
+#include "clade.h"
+#include "family_table.h"
+#include "lambda.h"
+#include "error_model.h"
+#include "gene_family.h"
+#include "matrix_cache.h"
+
+using namespace std;
+
+template<typename T>
+void pruning_workspace::reserve(std::vector<T>& v, size_t size)
+{
+#ifndef NDEBUG
+    if (size > v.capacity())
+        _allocations++;
+#endif
+    v.resize(size);
+}
+
+void pruning_workspace::prepare(const clade *p_tree, int block_size, int max_root_family_size, int max_family_size, int categories)
+{
+    if (p_tree == _p_tree && block_size <= _block_size && max_root_family_size == _max_root_family_size && max_family_size == _max_family_size && categories == _categories)
+        return;
+
+    _p_tree = p_tree;
+    _block_size = block_size;
+    _max_root_family_size = max_root_family_size;
+    _max_family_size = max_family_size;
+    _categories = categories;
+
+    _p_compiled.reset(new compiled_tree(p_tree));
+    _columns.reset();
+#ifndef NDEBUG
+    _allocations++;
+#endif
+
+    const compiled_tree& tree = *_p_compiled;
+    reserve(_offsets, tree.size());
+    size_t total = 0;
+    for (size_t i = 0; i < tree.size(); ++i)
+    {
+        _offsets[i] = total;
+        if (!tree.is_leaf(i))
+            total += slab_size(i) * categories;
+    }
+
+    reserve(_buffer, total);
+    reserve(_patterns, tree.size() * block_size);
+    reserve(_representatives, tree.size() * block_size);
+    reserve(_pattern_count, tree.size());
+    reserve(_gathered, size_t(max_family_size + 1) * block_size);
+    reserve(_leaf_sizes, block_size);
+    reserve(_factor, size_t(max(max_root_family_size, max_family_size + 1)) * block_size);
+    reserve(_branch_lambdas, tree.size() * categories);
+    reserve(_branch_changed, tree.size());
+    reserve(_recalculated, tree.size());
+    _pruned_n = 0;
+}
+
+//! Groups the n columns of a node by subtree pattern. pattern[j] becomes the index of the group of
+/// column j, and representatives[u] the first column of group u. Returns the number of groups.
+/// The block is small, so comparing against each group found so far is cheaper than hashing
+template<typename Same>
+static int find_patterns(int n, int *pattern, int *representatives, Same same)
+{
+    int m = 0;
+    for (int j = 0; j < n; ++j)
+    {
+        int u = 0;
+        while (u < m && !same(representatives[u], j))
+            ++u;
+
+        if (u == m)
+            representatives[m++] = j;
+        pattern[j] = u;
+    }
+    return m;
+}
+
+void pruning_workspace::prune(const family_table& families, const size_t *rows, int n, const matrix_cache& calc, const lambda *p_lambda, const error_model *p_error_model)
+{
+    prune(families, rows, n, calc, p_lambda, p_error_model, _max_root_family_size, _max_family_size);
+}
+
+void pruning_workspace::prune(const family_table& families, const size_t *rows, int n, const matrix_cache& calc, const lambda *p_lambda, const error_model *p_error_model, int max_root_family_size, int max_family_size)
+{
+    assert(_categories == 1);
+    prune_categories(families, rows, n, calc, &p_lambda, p_error_model, max_root_family_size, max_family_size);
+}
+
+void branch_matrices::resolve(const compiled_tree& tree, const matrix_cache& calc, const lambda * const *p_lambdas, int categories)
+{
+    _categories = categories;
+    _lambdas.resize(tree.size() * categories);
+    _matrices.resize(tree.size() * categories);
+    for (size_t k = 0; k < tree.size(); ++k)
+    {
+        for (int c = 0; c < categories; ++c)
+        {
+            size_t i = k * categories + c;
+            if (tree.is_root(k))
+            {
+                _lambdas[i] = 0;
+                _matrices[i] = nullptr;
+            }
+            else
+            {
+                _lambdas[i] = p_lambdas[c]->get_value_for_clade(tree.node(k));
+                _matrices[i] = calc.get_matrix(tree.branch_length(k), _lambdas[i]);
+            }
+        }
+    }
+}
+
+void pruning_workspace::prune_categories(const family_table& families, const size_t *rows, int n, const matrix_cache& calc, const lambda * const *p_lambdas, const error_model *p_error_model, int max_root_family_size, int max_family_size)
+{
+    _matrices.resolve(*_p_compiled, calc, p_lambdas, _categories);
+    prune_categories(families, rows, n, _matrices, p_error_model, max_root_family_size, max_family_size);
+}
+
+void pruning_workspace::prune_categories(const family_table& families, const size_t *rows, int n, const branch_matrices& matrices, const error_model *p_error_model, int max_root_family_size, int max_family_size)
+{
+    assert(matrices.categories() == _categories);
+    assert(n <= _block_size);
+    assert(max_root_family_size <= _max_root_family_size && max_family_size <= _max_family_size);
+
+    const compiled_tree& tree = *_p_compiled;
+    _columns.resolve(tree, families);
+    for (int k : tree.postorder())
+    {
+        find_patterns(k, families, rows, n);
+        if (!tree.is_leaf(k))
+            compute_node(k, families, rows, matrices, p_error_model, max_root_family_size, max_family_size);
+    }
+    expand_root(n, max_root_family_size);
+
+    _pruned_n = n;
+    _pruned_root_family_size = max_root_family_size;
+    _pruned_family_size = max_family_size;
+    _p_pruned_error_model = p_error_model;
+    _pruned_error_model_revision = p_error_model ? p_error_model->revision() : 0;
+    for (size_t k = 1; k < tree.size(); ++k)    // the root has no branch above it
+        for (int c = 0; c < _categories; ++c)
+            _branch_lambdas[k * _categories + c] = matrices.lambda_value(k, c);
+}
+
+int pruning_workspace::reprune(const family_table& families, const size_t *rows, int n, const matrix_cache& calc, const lambda *p_lambda, const error_model *p_error_model, int max_root_family_size, int max_family_size)
+{
+    _matrices.resolve(*_p_compiled, calc, &p_lambda, 1);
+    return reprune(families, rows, n, _matrices, p_error_model, max_root_family_size, max_family_size);
+}
+
+int pruning_workspace::reprune(const family_table& families, const size_t *rows, int n, const branch_matrices& matrices, const error_model *p_error_model, int max_root_family_size, int max_family_size)
+{
+    assert(_categories == 1);
+    const compiled_tree& tree = *_p_compiled;
+    _columns.resolve(tree, families);
+    bool same_error_model = p_error_model == _p_pruned_error_model && (!p_error_model || p_error_model->revision() == _pruned_error_model_revision);
+    if (n != _pruned_n || max_root_family_size != _pruned_root_family_size || max_family_size != _pruned_family_size || !same_error_model)
+    {
+        prune_categories(families, rows, n, matrices, p_error_model, max_root_family_size, max_family_size);
+        return tree.size() - tree.leaf_count();
+    }
+
+    // A node is recalculated if the branch to one of its children now has a different lambda, or the
+    // child itself was recalculated. The patterns found by the last full prune still hold
+    int recalculated = 0;
+    for (int k : tree.postorder())
+    {
+        if (!tree.is_root(k))
+        {
+            double branch_lambda = matrices.lambda_value(k, 0);
+            _branch_changed[k] = branch_lambda != _branch_lambdas[k];
+            _branch_lambdas[k] = branch_lambda;
+        }
+        _recalculated[k] = false;
+        if (tree.is_leaf(k))
+            continue;
+
+        for (auto child = tree.children_begin(k); child != tree.children_end(k); ++child)
+            _recalculated[k] = _recalculated[k] || _branch_changed[*child] || _recalculated[*child];
+
+        if (_recalculated[k])
+        {
+            compute_node(k, families, rows, matrices, p_error_model, max_root_family_size, max_family_size);
+            recalculated++;
+        }
+    }
+    if (_recalculated[0])
+        expand_root(n, max_root_family_size);
+
+    return recalculated;
+}
+
+void pruning_workspace::find_patterns(int k, const family_table& families, const size_t *rows, int n)
+{
+    const compiled_tree& tree = *_p_compiled;
+    int *pattern = &_patterns[size_t(k) * _block_size];
+    int *representatives = &_representatives[size_t(k) * _block_size];
+    if (tree.is_leaf(k))
+    {
+        int column = tree.leaf_column(k);
+        _pattern_count[k] = ::find_patterns(n, pattern, representatives, [&](int a, int b) {
+            return _columns.count(families, rows[a], column) == _columns.count(families, rows[b], column);
+        });
+    }
+    else
+    {
+        // two families share a pattern here if they share one at every child
+        _pattern_count[k] = ::find_patterns(n, pattern, representatives, [&](int a, int b) {
+            for (auto child = tree.children_begin(k); child != tree.children_end(k); ++child)
+            {
+                const int *child_pattern = &_patterns[size_t(*child) * _block_size];
+                if (child_pattern[a] != child_pattern[b])
+                    return false;
+            }
+            return true;
+        });
+    }
+}
+
+void pruning_workspace::compute_node(int k, const family_table& families, const size_t *rows, const branch_matrices& matrices, const error_model *p_error_model, int max_root_family_size, int max_family_size)
+{
+    const compiled_tree& tree = *_p_compiled;
+    const int *representatives = &_representatives[size_t(k) * _block_size];
+    int m = _pattern_count[k];
+
+    // the root excludes size 0, so its rows run from 1 to max_root_family_size
+    int s_min = tree.is_root(k) ? 1 : 0;
+    int s_max = tree.is_root(k) ? max_root_family_size : max_family_size;
+    size_t count = size_t(s_max - s_min + 1) * m;
+
+    for (int c = 0; c < _categories; ++c)
+    {
+        double *probs = &_buffer[_offsets[k] + c * slab_size(k)];
+        fill(probs, probs + count, 1.0);
+    }
+
+    // the walk over the children, and the species sizes of leaves, are shared by every category
+    for (auto child = tree.children_begin(k); child != tree.children_end(k); ++child)
+    {
+        if (tree.is_leaf(*child))
+        {
+            // leaves need no likelihoods of their own: read the matrix columns of their species sizes
+            int column = tree.leaf_column(*child);
+            for (int u = 0; u < m; ++u)
+                _leaf_sizes[u] = _columns.count(families, rows[representatives[u]], column);
+        }
+
+        for (int c = 0; c < _categories; ++c)
+        {
+            if (tree.is_leaf(*child))
+            {
+                matrices.get(*child, c)->multiply_leaf_block(&_leaf_sizes[0], m, p_error_model, s_min, s_max, max_family_size, &_factor[0]);
+            }
+            else
+            {
+                const double *child_probs = gather(*child, c, representatives, m, max_family_size);
+                matrices.get(*child, c)->multiply_block(child_probs, m, s_min, s_max, 0, max_family_size, &_factor[0]);
+            }
+
+            double *probs = &_buffer[_offsets[k] + c * slab_size(k)];
+            for (size_t i = 0; i < count; ++i)
+                probs[i] *= _factor[i];
+        }
+    }
+}
+
+void pruning_workspace::expand_root(int n, int max_root_family_size)
+{
+    // Spread the root's patterns back out to one column per family. Going backwards, every
+    // read is at or before the position being written, so the expansion can be done in place
+    int m = _pattern_count[0];
+    for (int c = 0; c < _categories; ++c)
+    {
+        double *root = &_buffer[_offsets[0] + c * slab_size(0)];
+        for (int s = max_root_family_size - 1; s >= 0; --s)
+            for (int j = n - 1; j >= 0; --j)
+                root[size_t(s) * n + j] = root[size_t(s) * m + _patterns[j]];
+    }
+}
+
+const double *pruning_workspace::gather(int child, int category, const int *representatives, int m, int max_family_size)
+{
+    const double *child_probs = &_buffer[_offsets[child] + category * slab_size(child)];
+    const int *child_pattern = &_patterns[size_t(child) * _block_size];
+    int child_m = _pattern_count[child];
+
+    bool same_columns = child_m == m;
+    for (int u = 0; u < m && same_columns; ++u)
+        same_columns = child_pattern[representatives[u]] == u;
+    if (same_columns)
+        return child_probs;
+
+    for (int s = 0; s <= max_family_size; ++s)
+        for (int u = 0; u < m; ++u)
+            _gathered[size_t(s) * m + u] = child_probs[size_t(s) * child_m + child_pattern[representatives[u]]];
+
+    return &_gathered[0];
+}
+
+std::pair<int, int> pruning_bounds(int max_count, int max_root_family_size, int max_family_size)
+{
+    int bucket = 1;
+    while (bucket < max_count)
+        bucket *= 2;
+
+    auto limits = family_size_limits(bucket);
+    return std::make_pair(min(limits.first, max_root_family_size), min(limits.second, max_family_size));
+}
+
+template<typename Row>
+static vector<size_t> make_pruning_blocks(const family_table& families, vector<size_t>& items, Row row, int max_root_family_size, int max_family_size)
+{
+    auto bounds = [&](size_t item) { return pruning_bounds(families.max_count(row(item)), max_root_family_size, max_family_size); };
+    stable_sort(items.begin(), items.end(), [&bounds](size_t a, size_t b) { return bounds(a) < bounds(b); });
+
+    vector<size_t> block_starts;
+    for (size_t u = 0; u < items.size(); ++u)
+    {
+        if (block_starts.empty() || u - block_starts.back() == PRUNING_BLOCK_SIZE || bounds(items[u]) != bounds(items[u - 1]))
+            block_starts.push_back(u);
+    }
+    block_starts.push_back(items.size());
+    return block_starts;
+}
+
+vector<size_t> make_pruning_blocks(const family_table& families, vector<size_t>& rows, int max_root_family_size, int max_family_size)
+{
+    return make_pruning_blocks(families, rows, [](size_t row) { return row; }, max_root_family_size, max_family_size);
+}
+
+vector<size_t> make_pruning_blocks(const family_table& families, const vector<size_t>& family_rows, vector<size_t>& indices, int max_root_family_size, int max_family_size)
+{
+    return make_pruning_blocks(families, indices, [&family_rows](size_t i) { return family_rows[i]; }, max_root_family_size, max_family_size);
+}
@@ -0,0 +1,215 @@
+#ifndef PRUNING_WORKSPACE_H
+#define PRUNING_WORKSPACE_H
+
+#include <vector>
+#include <utility>
+#include <memory>
+
+#include "compiled_tree.h"
+#include "family_table.h"
+
+//! Number of families pruned together in one pass over the tree
+#define PRUNING_BLOCK_SIZE 64
+
+//! Most memory a model may use to keep the likelihoods of every block between inferences
+#define PRUNING_CACHE_MEMORY_BUDGET (size_t(512) * 1024 * 1024)
+
+//! Most memory the per-thread workspaces may use together when several lambdas are pruned as categories of one walk
+#define PRUNING_BATCH_MEMORY_BUDGET (size_t(256) * 1024 * 1024)
+
+class clade;
+class lambda;
+class error_model;
+class matrix_cache;
+class matrix;
+
+//! The transition matrix of the branch above each node of a compiled tree, for each of several lambdas
+/*!
+Finding a branch's matrix means finding its lambda (a search by node name for a \ref multiple_lambda)
+and then looking the matrix up in the cache. A model resolves every branch once per evaluation, so
+pruning a block only reads pointers. The root has no branch, and no matrix.
+*/
+class branch_matrices {
+    int _categories = 0;
+    std::vector<double> _lambdas;               //!< lambda of each category on the branch above each node
+    std::vector<const matrix *> _matrices;      //!< entry [node * categories + category]
+public:
+    branch_matrices() {}
+
+    //! Resolves the matrices of every branch of the tree, category c using p_lambdas[c]
+    branch_matrices(const compiled_tree& tree, const matrix_cache& calc, const lambda * const *p_lambdas, int categories)
+    {
+        resolve(tree, calc, p_lambdas, categories);
+    }
+
+    //! As the constructor. Reuses the storage of the last call
+    void resolve(const compiled_tree& tree, const matrix_cache& calc, const lambda * const *p_lambdas, int categories);
+
+    int categories() const {
+        return _categories;
+    }
+
+    const matrix *get(int node, int category) const {
+        return _matrices[size_t(node) * _categories + category];
+    }
+
+    double lambda_value(int node, int category) const {
+        return _lambdas[size_t(node) * _categories + category];
+    }
+};
+
+//! Reusable storage for pruning blocks of families on one tree
+/*!
+The partial likelihoods of every internal node live in one contiguous buffer. Each internal node
+of the \ref compiled_tree owns a slice of rows (one row per family size) of block-size columns
+(one column per family), the layout used by \ref matrix::multiply_block. Leaves have no slice, as
+their parents gather the matrix columns of their species sizes instead. Pruning walks the compiled
+tree's post-order schedule, so it uses plain arrays instead of maps and std::function callbacks.
+
+Families in a block often agree on part of the tree, for example all zeros in an outgroup clade.
+Before computing a node, the columns of the block are grouped by the counts at the leaves below
+it, and the node is computed once per group: its slice holds one column per group rather than one
+per family. Only the root is spread back out to one column per family.
+
+A workspace that keeps pruning the same block can also keep its likelihoods between calls. When
+only some branches' lambdas have changed (as when one lambda of a \ref multiple_lambda moves),
+\ref reprune recalculates just the nodes on the paths from those branches to the root.
+
+A workspace can also be prepared for several categories (the rate categories of a gamma model).
+Each node then holds one slab per category, and \ref prune_categories fills all of them in a
+single walk over the tree.
+
+Families are given as rows of a \ref family_table. The workspace matches the tree's leaves to the
+table's columns on the first prune of a table, and keeps the match until the table's layout changes.
+
+Once a workspace has been prepared for a tree and block size, \ref prune does not touch the heap.
+Each OpenMP thread should own its own workspace. In debug builds (NDEBUG not defined) every
+buffer growth is counted, so callers can check that the steady state is allocation-free.
+*/
+class pruning_workspace {
+    const clade *_p_tree = nullptr;
+    int _block_size = 0;
+    int _max_root_family_size = 0;
+    int _max_family_size = 0;
+    int _categories = 1;
+
+    std::unique_ptr<compiled_tree> _p_compiled; //!< the structure of _p_tree
+    std::vector<size_t> _offsets;               //!< start of each node's slabs in _buffer, one slab per category
+    std::vector<double> _buffer;                //!< partial likelihoods of all nodes
+    std::vector<double> _factor;                //!< one child's contribution to its parent
+    std::vector<int> _patterns;                 //!< for each node and family in the block, the family's subtree pattern
+    std::vector<int> _representatives;          //!< for each node and pattern, the first family with that pattern
+    std::vector<int> _pattern_count;            //!< number of distinct patterns at each node
+    std::vector<double> _gathered;              //!< a child's likelihoods rearranged to its parent's patterns
+    std::vector<int> _leaf_sizes;               //!< a leaf's species sizes in its parent's pattern order
+
+    // what the likelihoods in _buffer were calculated with, so \ref reprune can tell what changed
+    int _pruned_n = 0;                          //!< number of families pruned, 0 if _buffer holds nothing
+    int _pruned_root_family_size = 0;
+    int _pruned_family_size = 0;
+    const error_model *_p_pruned_error_model = nullptr;
+    size_t _pruned_error_model_revision = 0;
+    std::vector<double> _branch_lambdas;        //!< lambda of each category on the branch above each node
+    std::vector<char> _branch_changed;
+    std::vector<char> _recalculated;
+    branch_matrices _matrices;                  //!< resolved by the overloads that are given a cache and lambdas
+    leaf_columns _columns;                      //!< column of each leaf in the table last pruned
+#ifndef NDEBUG
+    size_t _allocations = 0;
+#endif
+
+    template<typename T>
+    void reserve(std::vector<T>& v, size_t size);
+
+    //! Number of values in one category's slab of a node
+    size_t slab_size(int k) const {
+        return size_t(_p_compiled->is_root(k) ? _max_root_family_size : _max_family_size + 1) * _block_size;
+    }
+
+    //! Returns the likelihoods of a child in a category with one column for each of its parent's m patterns
+    const double *gather(int child, int category, const int *representatives, int m, int max_family_size);
+
+    void find_patterns(int k, const family_table& families, const size_t *rows, int n);
+    void compute_node(int k, const family_table& families, const size_t *rows, const branch_matrices& matrices, const error_model *p_error_model, int max_root_family_size, int max_family_size);
+    void expand_root(int n, int max_root_family_size);
+public:
+    //! Lays out the buffers for the tree. Does nothing if the workspace is already set up for these arguments
+    void prepare(const clade *p_tree, int block_size, int max_root_family_size, int max_family_size, int categories = 1);
+
+    //! Prunes up to the prepared block size of families, given as row numbers in the table. The table
+    /// needs a column for each leaf of the tree. p_lambda should already include any multiplier
+    void prune(const family_table& families, const size_t *rows, int n, const matrix_cache& calc, const lambda *p_lambda, const error_model *p_error_model);
+
+    //! As above, calculating only sizes up to the given bounds, which may be below the prepared ones.
+    /// The root likelihoods then have max_root_family_size rows
+    void prune(const family_table& families, const size_t *rows, int n, const matrix_cache& calc, const lambda *p_lambda, const error_model *p_error_model, int max_root_family_size, int max_family_size);
+
+    //! Prunes the families once for each category the workspace was prepared for, category c using p_lambdas[c]
+    /*!
+    The categories share one walk over the tree: patterns are found and leaf sizes are read once,
+    and only the products with each category's matrices are repeated.
+    */
+    void prune_categories(const family_table& families, const size_t *rows, int n, const matrix_cache& calc, const lambda * const *p_lambdas, const error_model *p_error_model, int max_root_family_size, int max_family_size);
+
+    //! As above, with the matrices of every branch already resolved for the categories the workspace was prepared for
+    void prune_categories(const family_table& families, const size_t *rows, int n, const branch_matrices& matrices, const error_model *p_error_model, int max_root_family_size, int max_family_size);
+
+    //! Prunes the same families as the last call again, recalculating only the nodes above branches whose lambda changed
+    /*!
+    The caller must pass the same families and rows as the last prune of this workspace. Anything
+    else that changed (the number of families, the bounds or the error model) makes this a full
+    \ref prune. Returns the number of internal nodes recalculated.
+    */
+    int reprune(const family_table& families, const size_t *rows, int n, const matrix_cache& calc, const lambda *p_lambda, const error_model *p_error_model, int max_root_family_size, int max_family_size);
+
+    //! As above, with the matrices of every branch already resolved
+    int reprune(const family_table& families, const size_t *rows, int n, const branch_matrices& matrices, const error_model *p_error_model, int max_root_family_size, int max_family_size);
+
+    //! The compiled form of the tree the workspace was prepared for
+    const compiled_tree& tree() const {
+        return *_p_compiled;
+    }
+
+    //! Likelihoods at the root after \ref prune: entry [(s - 1) * n + j] is the likelihood of family j having size s
+    const double *root_likelihoods(int category = 0) const {
+        return &_buffer[_offsets[0] + category * slab_size(0)];
+    }
+
+    //! Approximate number of bytes held by the workspace's buffers
+    size_t memory_usage() const {
+        return _buffer.size() * sizeof(double) + (_patterns.size() + _representatives.size()) * sizeof(int);
+    }
+
+    //! Number of distinct subtree patterns at the given node in the last \ref prune
+    int pattern_count(int node) const {
+        return _pattern_count[node];
+    }
+
+#ifndef NDEBUG
+    //! Number of times the workspace had to grow one of its buffers
+    size_t allocation_count() const {
+        return _allocations;
+    }
+#endif
+};
+
+//! Bounds on the root family size and family size worth pruning a family with, given its largest count
+/*!
+The margins are those of \ref family_size_limits, applied to the count rounded up to a power of two
+so that families fall into a few buckets that can be pruned in blocks. The bounds never exceed the
+given ones.
+*/
+std::pair<int, int> pruning_bounds(int max_count, int max_root_family_size, int max_family_size);
+
+//! Splits table rows into blocks to prune together
+/*!
+Sorts the rows by their \ref pruning_bounds, so that small families are pruned with short vectors,
+and splits them into blocks of at most PRUNING_BLOCK_SIZE rows that share bounds. Returns the
+position in rows where each block starts, followed by the number of rows.
+*/
+std::vector<size_t> make_pruning_blocks(const family_table& families, std::vector<size_t>& rows, int max_root_family_size, int max_family_size);
+
+//! As above, for families given by index, where family i is row family_rows[i] of the table. Sorts the indices
+std::vector<size_t> make_pruning_blocks(const family_table& families, const std::vector<size_t>& family_rows, std::vector<size_t>& indices, int max_root_family_size, int max_family_size);
+
+#endif
@@ -2,6 +2,7 @@
 #include <numeric>
 #include <algorithm>
 #include <random>
+#include <stdexcept>
 
 extern std::mt19937 randomizer_engine; // seeding random number engine
 
@@ -45,15 +45,19 @@ clademap<int>* simulator::create_trial(const lambda *p_lambda, const root_distri
         max_family_size_sim = 2 * rd.max();
     }
 
-    (*result)[data.p_tree] = select_root_size(data, rd, family_number);
+    if (!_p_compiled_tree || _p_compiled_tree->node(0) != data.p_tree)
+        _p_compiled_tree.reset(new compiled_tree(data.p_tree));
+    const compiled_tree& tree = *_p_compiled_tree;
 
-
-    auto fn = [&](const clade *c)
+    vector<int> sizes(tree.size());
+    sizes[0] = select_root_size(data, rd, family_number);
+    for (int node : tree.preorder())
     {
-        set_weighted_random_family_size(c, result, p_lambda, data.p_error_model, max_family_size_sim, cache);
-    };
+        if (!tree.is_root(node))
+            sizes[node] = random_family_size(sizes[tree.parent(node)], p_lambda->get_value_for_clade(tree.node(node)), tree.branch_length(node), tree.is_leaf(node), data.p_error_model, max_family_size_sim, cache);
 
-    data.p_tree->apply_prefix_order(fn);
+        (*result)[tree.node(node)] = sizes[node];
+    }
 
     return result;
 }
@@ -87,11 +91,9 @@ void simulator::simulate_processes(model *p_model, std::vector<clademap<int> *>&
     {
         unique_ptr<lambda> sim_lambda(p_model->get_simulation_lambda());
         
+        // only the matrices of branches the trials actually walk are calculated
         matrix_cache cache(max_size);
-        cache.precalculate_matrices(get_lambda_values(sim_lambda.get()), this->data.p_tree->get_branch_lengths());
-
-        if (!quiet)
-            cache.warn_on_saturation(cerr);
+        cache.set_on_demand(true);
 
         int n = 0;
 
@@ -99,6 +101,9 @@ void simulator::simulate_processes(model *p_model, std::vector<clademap<int> *>&
         generate(results.begin()+i, end_it, [this, &sim_lambda, i, &rd, &cache, &n]() mutable {
             return create_trial(sim_lambda.get(), rd, i+n++, cache);
         });
+
+        if (!quiet)
+            cache.warn_on_saturation(cerr);
     }
 }
 
@@ -1,8 +1,11 @@
 #ifndef SIMULATOR_H
 #define SIMULATOR_H
 
+#include <memory>
+
 #include "execute.h"
 #include "clade.h"
+#include "compiled_tree.h"
 
 class root_distribution;
 
@@ -11,6 +14,8 @@ class root_distribution;
 
 class simulator : public action
 {
+    std::unique_ptr<compiled_tree> _p_compiled_tree;   //!< structure of the tree being simulated, built on the first trial
+
     void simulate(std::vector<model *>& models, const input_parameters &my_input_parameters);
 public:
     simulator(user_data& d, const input_parameters& ui);
@@ -42,8 +42,9 @@ void user_data::read_gene_family_data(const input_parameters &my_input_parameter
             max_family_size = this_family_max_size;
     }
 
-    max_root_family_size = std::max(30, static_cast<int>(std::rint(max_family_size*1.25)));
-    max_family_size = max_family_size + std::max(50, max_family_size / 5);
+    auto limits = family_size_limits(max_family_size);
+    max_root_family_size = limits.first;
+    max_family_size = limits.second;
     // cout << "Read input file " << my_input_parameters.input_file_path << "." << endl;
     // cout << "Max (parsed) family size is: " << max_family_size << endl;
     // cout << "Max root family size is: " << max_root_family_size << endl;
@@ -3,6 +3,7 @@
 #include <cmath>
 #include <getopt.h>
 #include <sstream>
+#include <fstream>
 #include <random>
 #include <algorithm>
 
@@ -25,6 +26,10 @@
 #include "src/optimizer.h"
 #include "src/error_model.h"
 #include "src/likelihood_ratio.h"
+#include "src/pruning_workspace.h"
+#include "src/compiled_tree.h"
+#include "src/family_table.h"
+#include "src/matrix_store.h"
 
 #define CPPUTEST_MEM_LEAK_DETECTION_DISABLED
 
@@ -199,6 +204,68 @@ TEST(Options, input_short_space_separated)
     STRCMP_EQUAL("file", actual.input_file_path.c_str());
 }
 
+TEST(Options, matrix_method)
+{
+    initialize({ "cafexp", "--matrix_method", "recurrence" });
+
+    auto actual = read_arguments(argc, values);
+    STRCMP_EQUAL("recurrence", actual.matrix_method.c_str());
+}
+
+TEST(Options, matrix_method_must_be_known)
+{
+    try
+    {
+        input_parameters params;
+        params.matrix_method = "fast";
+        params.check_input();
+        CHECK(false);
+    }
+    catch (runtime_error& err)
+    {
+        STRCMP_EQUAL("Unknown matrix method 'fast'. Use 'sum' or 'recurrence'.", err.what());
+    }
+}
+
+TEST(Options, matrix_tolerance)
+{
+    initialize({ "cafexp", "-T", "1e-8" });
+
+    auto actual = read_arguments(argc, values);
+    DOUBLES_EQUAL(1e-8, actual.matrix_tolerance, 1e-15);
+}
+
+TEST(Options, optimizer_starts)
+{
+    initialize({ "cafexp", "--optimizer_starts", "4" });
+
+    auto actual = read_arguments(argc, values);
+    LONGS_EQUAL(4, actual.optimizer_params.concurrent_starts);
+}
+
+TEST(Options, matrix_store)
+{
+    initialize({ "cafexp", "--matrix_store", "matrices.bin" });
+
+    auto actual = read_arguments(argc, values);
+    STRCMP_EQUAL("matrices.bin", actual.matrix_store_path.c_str());
+}
+
+TEST(Options, matrix_tolerance_must_be_below_one)
+{
+    try
+    {
+        input_parameters params;
+        params.matrix_tolerance = 1.0;
+        params.check_input();
+        CHECK(false);
+    }
+    catch (runtime_error& err)
+    {
+        STRCMP_EQUAL("Matrix tolerance must be at least 0 and less than 1.", err.what());
+    }
+}
+
 TEST(Options, simulate_long)
 {
     initialize({ "cafexp", "--simulate=1000", "-l", "0.05" });
@@ -447,6 +514,29 @@ TEST(GeneFamilies, read_gene_families_reads_cafe_files)
     LONGS_EQUAL(6, families.at(0).get_species_size("D"));
 }
 
+TEST(GeneFamilies, read_gene_families_stores_every_family_in_one_table)
+{
+    std::string str = "Desc\tFamily ID\tA\tB\n\t (null)1\t5\t10\n\t (null)2\t3\t4\n";
+    std::istringstream ist(str);
+    std::vector<gene_family> families;
+    read_gene_families(ist, NULL, families);
+
+    CHECK(families[0].table() == families[1].table());
+    LONGS_EQUAL(0, families[0].row());
+    LONGS_EQUAL(1, families[1].row());
+
+    vector<size_t> rows;
+    CHECK(tabulate(families, rows) == families[0].table());
+    LONGS_EQUAL(1, rows[1]);
+
+    // changing a copy leaves the table alone
+    gene_family copy = families[1];
+    copy.set_species_size("A", 7);
+    LONGS_EQUAL(7, copy.get_species_size("A"));
+    LONGS_EQUAL(3, families[1].get_species_size("A"));
+    CHECK(copy.table() != families[1].table());
+}
+
 TEST(GeneFamilies, read_gene_families_reads_simulation_files)
 {
     std::string str = "#A\n#B\n#AB\n#CD\n#C\n#ABCD\n#D\n35\t36\t35\t35\t36\t34\t34\t1\n98\t96\t97\t98\t98\t98\t98\t1\n";
@@ -643,6 +733,19 @@ TEST(Probability, the_probability_of_going_from_parent_fam_size_to_c)
     DOUBLES_EQUAL(0.194661, the_probability_of_going_from_parent_fam_size_to_c(.006335, 68.7105, 5, 5), 0.00001);
 }
 
+TEST(Probability, chooseln_reads_log_factorials_sized_by_matrix_cache)
+{
+    matrix_cache calc(3000);    // tabulates ln(n!) up to 6000
+    for (int n : { 1, 99, 100, 1023, 1024, 2500, 5999 })
+        for (int r : { 1, 7, n / 2, n - 1, n })
+            DOUBLES_EQUAL(lgamma(n + 1.0) - lgamma(r + 1.0) - lgamma(n - r + 1.0), chooseln(n, r), 1e-9);
+
+    DOUBLES_EQUAL(0.0, chooseln(4000, 0), 0);
+    CHECK(std::isinf(chooseln(5, 7)));
+    CHECK(chooseln(5, 7) < 0);
+    DOUBLES_EQUAL(log(2.5), chooseln(2.5, 1), 1e-12);  // non-integers fall back to lgamma
+}
+
 TEST(Probability, probability_of_matrix)
 {
     matrix_cache calc(5);
@@ -859,7 +962,21 @@ TEST(Inference, precalculate_matrices_calculates_all_lambdas_all_branchlengths)
     std::map<std::string, int> m;
     multiple_lambda lambda(m, vector<double>({ .1, .2, .3, .4 }));
     calc.precalculate_matrices(get_lambda_values(&lambda), set<double>({ 1,2,3 }));
-    LONGS_EQUAL(12, calc.get_cache_size());
+    // 12 combinations, but only 8 distinct values of lambda*t
+    LONGS_EQUAL(8, calc.get_cache_size());
+    LONGS_EQUAL(4, calc.get_deduplicated_count());
+}
+
+TEST(Inference, matrix_cache_shares_matrices_with_equal_lambda_times_branch_length)
+{
+    matrix_cache calc(10);
+    calc.precalculate_matrices({ 0.02 }, set<double>({ 5 }));
+    calc.precalculate_matrices({ 0.05 }, set<double>({ 2 }));
+    LONGS_EQUAL(1, calc.get_cache_size());
+    LONGS_EQUAL(1, calc.get_hit_count());
+    LONGS_EQUAL(1, calc.get_deduplicated_count());
+    POINTERS_EQUAL(calc.get_matrix(5, 0.02), calc.get_matrix(2, 0.05));
+    DOUBLES_EQUAL(the_probability_of_going_from_parent_fam_size_to_c(0.05, 2, 3, 4), calc.get_matrix(5, 0.02)->get(3, 4), 0.0000000001);
 }
 
 TEST_GROUP(Reconstruction)
@@ -1300,6 +1417,53 @@ TEST(Inference, birthdeath_rate_with_log_alpha)
     DOUBLES_EQUAL(0.194661, birthdeath_rate_with_log_alpha(5, 5, -1.1931291703283662, 0.39345841643135504), 0.0001);
 }
 
+TEST(Inference, exp_power_series_matches_scalar_exponentials)
+{
+    vector<double> t;
+    for (int j = 0; j < 40; ++j)
+        t.push_back(5 * sin(j) - 0.3 * j);
+    t[3] = -std::numeric_limits<double>::infinity();
+    t[4] = -800;
+    t[5] = 700;
+
+    for (int n = 1; n <= 40; ++n)
+    {
+        double expected = 0.0, power = 0.7;
+        for (int j = 0; j < n; ++j)
+        {
+            expected += exp(t[j]) * power;
+            power *= 0.95;
+        }
+        DOUBLES_EQUAL(expected, exp_power_series(t.data(), n, 0.7, 0.95), expected * 1e-14);
+    }
+}
+
+TEST(Inference, birthdeath_rate_matches_per_term_exponentials)
+{
+    // the series as it was summed before it was vectorized: one exp and one pow per term
+    auto reference = [](int s, int c, double log_alpha, double coeff) {
+        double result = 0.0;
+        for (int j = 0; j <= min(s, c); ++j)
+            result += exp(chooseln(s, j) + chooseln(s + c - 1 - j, s - 1) + (s + c - 2 * j) * log_alpha) * pow(coeff, j);
+        return max(min(result, 1.0), 0.0);
+    };
+
+    for (double lambda_t : { 0.001, 0.05, 0.4 })
+    {
+        double alpha = lambda_t / (1 + lambda_t);
+        for (int s = 1; s < 60; ++s)
+            for (int c = 0; c < 60; ++c)
+            {
+                double expected = reference(s, c, log(alpha), 1 - 2 * alpha);
+                DOUBLES_EQUAL(expected, birthdeath_rate_with_log_alpha(s, c, log(alpha), 1 - 2 * alpha), expected * 1e-12);
+            }
+    }
+
+    // more terms than are summed at a time
+    double expected = reference(300, 310, log(0.2), 0.6);
+    DOUBLES_EQUAL(expected, birthdeath_rate_with_log_alpha(300, 310, log(0.2), 0.6), expected * 1e-12);
+}
+
 TEST(Inference, create_one_model_if_lambda_is_null)
 {
     input_parameters params;
@@ -1418,6 +1582,55 @@ TEST(Probability, matrix_multiply)
     DOUBLES_EQUAL(220, result[2], .001);
 }
 
+TEST(Probability, matrix_multiply_block)
+{
+    matrix m1(3);
+    build_matrix(m1);
+    // two vectors side by side: (7, 9, 11) and (1, 0, 2)
+    vector<double> block({ 7, 1, 9, 0, 11, 2 });
+    vector<double> result(6);
+    m1.multiply_block(&block[0], 2, 0, 2, 0, 2, &result[0]);
+
+    DOUBLES_EQUAL(58, result[0], .001);
+    DOUBLES_EQUAL(7, result[1], .001);
+    DOUBLES_EQUAL(139, result[2], .001);
+    DOUBLES_EQUAL(16, result[3], .001);
+    DOUBLES_EQUAL(220, result[4], .001);
+    DOUBLES_EQUAL(25, result[5], .001);
+
+    m1.multiply_block(&block[0], 2, 1, 2, 0, 2, &result[0]);
+    DOUBLES_EQUAL(139, result[0], .001);
+    DOUBLES_EQUAL(25, result[3], .001);
+}
+
+TEST(Probability, matrix_multiply_leaf_block_gathers_columns)
+{
+    matrix m1(3);
+    build_matrix(m1);
+    int species_sizes[] = { 2, 0 };
+    vector<double> result(6);
+    m1.multiply_leaf_block(species_sizes, 2, nullptr, 0, 2, 2, &result[0]);
+
+    DOUBLES_EQUAL(3, result[0], .001);
+    DOUBLES_EQUAL(1, result[1], .001);
+    DOUBLES_EQUAL(6, result[2], .001);
+    DOUBLES_EQUAL(4, result[3], .001);
+    DOUBLES_EQUAL(9, result[4], .001);
+    DOUBLES_EQUAL(7, result[5], .001);
+
+    error_model model;
+    model.set_probabilities(0, { .0, .7, .3 });
+    model.set_probabilities(1, { .2, .6, .2 });
+    int error_sizes[] = { 1, 0 };
+    m1.multiply_leaf_block(error_sizes, 2, &model, 0, 2, 2, &result[0]);
+
+    vector<double> expected(6);
+    vector<double> leaves({ .2, .7, .6, .3, .2, 0 });
+    m1.multiply_block(&leaves[0], 2, 0, 2, 0, 2, &expected[0]);
+    for (size_t i = 0; i < expected.size(); ++i)
+        DOUBLES_EQUAL(expected[i], result[i], .00001);
+}
+
 TEST(Probability, error_model_set_probs)
 {
     error_model model;
@@ -1623,149 +1836,906 @@ TEST(Probability, matrix_is_saturated)
     CHECK_FALSE(c.is_saturated(25, 0.01));
 }
 
-TEST(Inference, build_reference_list)
+TEST(Probability, matrix_cache_counts_hits_and_misses)
 {
-    std::string str = "Desc\tFamily ID\tA\tB\n"
-        "\t (null)1\t5\t10\n"
-        "\t (null)2\t5\t7\n"
-        "\t (null)3\t5\t10\n"
-        "\t (null)4\t5\t7\n";
-    std::istringstream ist(str);
-    std::vector<gene_family> families;
-    read_gene_families(ist, NULL, families);
-    auto actual = build_reference_list(families);
-    vector<int> expected({ 0, 1, 0, 1 });
-    LONGS_EQUAL(expected.size(), actual.size());
+    matrix_cache m(10);
+    m.precalculate_matrices({ 0.05 }, { 1, 3 });
+    m.precalculate_matrices({ 0.05 }, { 1, 3, 7 });
+    LONGS_EQUAL(2, m.get_hit_count());
+    LONGS_EQUAL(3, m.get_miss_count());
 
+    ostringstream ost;
+    m.write_statistics(ost);
+    STRCMP_EQUAL("Matrix cache: 2 hits, 3 misses, 0 evictions (3 matrices held, 0 shared by equal lambda*t)\n", ost.str().c_str());
 }
 
-TEST(Inference, prune)
+TEST(Probability, plan_row_blocks_covers_every_row_once_in_blocks_of_similar_cost)
 {
-    ostringstream ost;
-    gene_family fam;
-    fam.set_species_size("A", 3);
-    fam.set_species_size("B", 6);
-    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+    vector<double> lambda_ts{ 0.05, 0.2, 3.0 };    // the last is saturated
+    auto blocks = plan_row_blocks(lambda_ts, 100, 32);
 
-    single_lambda lambda(0.03);
-    matrix_cache cache(21);
-    cache.precalculate_matrices({ 0.045 }, { 1.0,3.0,7.0 });
-    auto actual = inference_prune(fam, cache, &lambda, nullptr, p_tree.get(), 1.5, 20, 20);
+    vector<vector<int>> covered(3, vector<int>(100));
+    for (auto& b : blocks)
+        for (int s = b.begin; s < b.end; ++s)
+            covered[b.matrix][s]++;
+    for (auto& rows : covered)
+        for (int count : rows)
+            LONGS_EQUAL(1, count);
 
-    vector<double> log_expected{ -17.2771, -10.0323 , -5.0695 , -4.91426 , -5.86062 , -7.75163 , -10.7347 , -14.2334 , -18.0458 , 
-        -22.073 , -26.2579 , -30.5639 , -34.9663 , -39.4472 , -43.9935 , -48.595 , -53.2439 , -57.9338 , -62.6597 , -67.4173 };
+    for (size_t i = 1; i < blocks.size(); ++i)
+        CHECK(blocks[i - 1].cost >= blocks[i].cost);
 
-    LONGS_EQUAL(log_expected.size(), actual.size());
-    for (size_t i = 0; i<log_expected.size(); ++i)
+    // the saturated matrix only calculates row 0, so it is one cheap block
+    LONGS_EQUAL(1, count_if(blocks.begin(), blocks.end(), [](const row_block& b) { return b.matrix == 2; }));
+    DOUBLES_EQUAL(1.0, blocks.back().cost, 0);
+
+    // no block holds much more than its share of the work
+    double total = 0;
+    for (auto& b : blocks)
+        total += b.cost;
+    CHECK(blocks.size() >= 30);
+    CHECK(blocks.front().cost < 2 * total / 32);
+}
+
+TEST(Probability, precalculate_matrices_in_row_blocks_matches_whole_matrices_and_records_time)
+{
+    matrix_cache m(40);
+    m.precalculate_matrices({ 0.01, 0.05 }, { 1, 3, 7 });
+
+    for (double lambda : { 0.01, 0.05 })
+        for (double branch_length : { 1, 3, 7 })
+        {
+            auto actual = m.get_matrix(branch_length, lambda);
+            for (int s = 0; s < 40; ++s)
+                for (int c = 0; c < 40; ++c)
+                    DOUBLES_EQUAL(m.get_from_parent_fam_size_to_c(lambda, branch_length, s, c), actual->get(s, c), 1e-14);
+            CHECK(m.get_calculation_seconds(branch_length, lambda) > 0);
+        }
+    CHECK(m.get_calculation_seconds() >= m.get_calculation_seconds(7, 0.05));
+}
+
+TEST(Probability, matrix_cache_evicts_least_recently_used_matrices)
+{
+    matrix_cache m(10, 2 * 10 * 10 * sizeof(double));
+    m.precalculate_matrices({ 0.05 }, { 1 });
+    m.precalculate_matrices({ 0.05 }, { 3 });
+    m.precalculate_matrices({ 0.05 }, { 1 });
+    m.precalculate_matrices({ 0.05 }, { 7 });
+
+    LONGS_EQUAL(2, m.get_cache_size());
+    LONGS_EQUAL(1, m.get_eviction_count());
+    CHECK(m.get_matrix(1, 0.05) != nullptr);
+    CHECK(m.get_matrix(7, 0.05) != nullptr);
+    try
+    {
+        m.get_matrix(3, 0.05);
+        FAIL("Expected matrix to be evicted");
+    }
+    catch (std::runtime_error&)
     {
-        DOUBLES_EQUAL(log_expected[i], log(actual[i]), 0.0001);
     }
 }
 
-TEST(Inference, likelihood_computer_sets_leaf_nodes_correctly)
+TEST(Probability, matrix_cache_keeps_matrices_of_latest_request_over_budget)
 {
-    ostringstream ost;
-    gene_family family;
-    family.set_species_size("A", 3);
-    family.set_species_size("B", 6);
+    matrix_cache m(10, 0);
+    m.precalculate_matrices({ 0.05 }, { 1, 3, 7 });
+    LONGS_EQUAL(3, m.get_cache_size());
+}
 
-    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+TEST(Probability, matrix_cache_finds_every_matrix_among_many)
+{
+    matrix_cache m(4);
+    vector<double> lambdas;
+    for (int i = 1; i <= 200; ++i)
+        lambdas.push_back(0.0001 * i);
+    m.precalculate_matrices(lambdas, { 7 });
+    m.precalculate_matrices({ 0.5 }, { 1 });
+    LONGS_EQUAL(201, m.get_cache_size());
 
-    single_lambda lambda(0.03);
+    for (double lambda : lambdas)
+        DOUBLES_EQUAL(the_probability_of_going_from_parent_fam_size_to_c(lambda, 7, 1, 2), m.get_matrix(7, lambda)->get(1, 2), 1e-12);
+    try
+    {
+        m.get_matrix(3, 0.05);
+        FAIL("Expected no matrix for a branch length that was not precalculated");
+    }
+    catch (std::runtime_error&)
+    {
+    }
+}
 
-    matrix_cache cache(21);
-    std::map<const clade *, std::vector<double> > _probabilities; 
+TEST(Probability, matrix_cache_on_demand_calculates_missing_matrices_once)
+{
+    matrix_cache m(10);
+    m.set_on_demand(true);
+    m.precalculate_matrices({ 0.05 }, { 1 });
 
-    auto init_func = [&](const clade* node) { _probabilities[node].resize(node->is_root() ? 20 : 21); };
-    p_tree->apply_reverse_level_order(init_func);
+    vector<const matrix *> results(64);
+#pragma omp parallel for
+    for (int i = 0; i < 64; ++i)
+        results[i] = m.get_matrix(i % 2 ? 3 : 7, 0.05);
 
-    cache.precalculate_matrices({ 0.045 }, { 1.0,3.0,7.0 });
+    for (int i = 2; i < 64; ++i)
+        POINTERS_EQUAL(results[i % 2], results[i]);
+    LONGS_EQUAL(2, m.get_on_demand_count());
+    DOUBLES_EQUAL(the_probability_of_going_from_parent_fam_size_to_c(0.05, 3, 2, 4), results[1]->get(2, 4), 1e-12);
 
-    auto A = p_tree->find_descendant("A");
-    compute_node_probability(A, family, NULL, _probabilities, 20, 20, &lambda, cache);
-    auto& actual = _probabilities[A];
+    // the next precalculation takes over the matrices calculated on demand
+    m.precalculate_matrices({ 0.05 }, { 1, 3 });
+    LONGS_EQUAL(3, m.get_cache_size());
+    LONGS_EQUAL(1, m.get_miss_count());
+    POINTERS_EQUAL(results[1], m.get_matrix(3, 0.05));
+}
 
-    vector<double> expected{ 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+TEST(Probability, matrix_store_serves_matrices_to_later_caches)
+{
+    const char *path = "matrix_store_test.bin";
+    remove(path);
+    {
+        matrix_store store(path);
+        matrix_cache m(10);
+        m.set_store(&store);
+        m.set_tolerance(1e-6);
+        m.precalculate_matrices({ 0.05 }, { 1, 3 });
+        LONGS_EQUAL(2, store.size());
+        LONGS_EQUAL(0, m.get_loaded_count());
+    }
 
-    LONGS_EQUAL(expected.size(), actual.size());
-    for (size_t i = 0; i<expected.size(); ++i)
+    matrix_store store(path);
+    LONGS_EQUAL(2, store.size());
+    matrix_cache m(10);
+    m.set_store(&store);
+    m.set_tolerance(1e-6);
+    m.precalculate_matrices({ 0.05 }, { 1, 3, 7 });
+    LONGS_EQUAL(2, m.get_loaded_count());
+    LONGS_EQUAL(3, store.size());
+
+    matrix_cache fresh(10);
+    fresh.set_tolerance(1e-6);
+    fresh.precalculate_matrices({ 0.05 }, { 3 });
+    auto expected = fresh.get_matrix(3, 0.05);
+    auto actual = m.get_matrix(3, 0.05);
+    CHECK(actual->is_banded());
+    for (int s = 0; s < 10; ++s)
+        for (int c = 0; c < 10; ++c)
+            DOUBLES_EQUAL(expected->get(s, c), actual->get(s, c), 0);
+
+    // a matrix calculated with a different tolerance is a different matrix
+    matrix_cache dense(10);
+    dense.set_store(&store);
+    dense.precalculate_matrices({ 0.05 }, { 3 });
+    LONGS_EQUAL(0, dense.get_loaded_count());
+    remove(path);
+}
+
+TEST(Probability, matrix_store_skips_records_that_fail_their_checksum)
+{
+    const char *path = "matrix_store_test.bin";
+    remove(path);
     {
-        DOUBLES_EQUAL(expected[i], actual[i], 0.0001);
+        matrix_store store(path);
+        matrix_cache m(10);
+        m.set_store(&store);
+        m.precalculate_matrices({ 0.05 }, { 1 });
     }
 
-    auto B = p_tree->find_descendant("B");
-    compute_node_probability(B, family, NULL, _probabilities, 20, 20, &lambda, cache);
-    actual = _probabilities[B];
+    // corrupt the last stored value, and leave half a record after it
+    {
+        fstream f(path, ios::in | ios::out | ios::binary);
+        f.seekp(-1, ios::end);
+        f.put('x');
+        f.seekp(0, ios::end);
+        f.write("partial", 7);
+    }
 
-    expected = { 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    matrix_store store(path);
+    LONGS_EQUAL(0, store.size());
+    LONGS_EQUAL(1, store.get_rejected_count());
 
-    LONGS_EQUAL(expected.size(), actual.size());
-    for (size_t i = 0; i<expected.size(); ++i)
+    matrix_cache m(10);
+    m.set_store(&store);
+    m.precalculate_matrices({ 0.05 }, { 1 });
+    LONGS_EQUAL(0, m.get_loaded_count());
+    LONGS_EQUAL(1, store.size());
+    remove(path);
+}
+
+TEST(Probability, recurrence_generator_matches_birth_death_sum)
+{
+    matrix_cache sum(60);
+    matrix_cache rec(60);
+    rec.set_generator(Recurrence);
+    sum.precalculate_matrices({ 0.001, 0.01, 0.05 }, { 1, 5, 20, 68.7105 });
+    rec.precalculate_matrices({ 0.001, 0.01, 0.05 }, { 1, 5, 20, 68.7105 });
+
+    for (double lambda : { 0.001, 0.01, 0.05 })
+        for (double t : { 1.0, 5.0, 20.0, 68.7105 })
+        {
+            auto expected = sum.get_matrix(t, lambda);
+            auto actual = rec.get_matrix(t, lambda);
+            for (int s = 0; s < 60; ++s)
+                for (int c = 0; c < 60; ++c)
+                    DOUBLES_EQUAL(expected->get(s, c), actual->get(s, c), 1e-10);
+        }
+}
+
+TEST(Probability, banded_matrices_drop_at_most_the_tolerance)
+{
+    matrix_cache dense(60);
+    dense.precalculate_matrices({ 0.01 }, { 1, 20 });
+    for (matrix_generator generator : { BirthDeathSum, Recurrence })
     {
-        DOUBLES_EQUAL(expected[i], actual[i], 0.0001);
+        matrix_cache banded(60);
+        banded.set_generator(generator);
+        banded.set_tolerance(1e-6);
+        banded.precalculate_matrices({ 0.01 }, { 1, 20 });
+        CHECK(banded.get_dropped_mass() <= 1e-6);
+        CHECK(banded.get_memory_usage() < dense.get_memory_usage() / 2);
+
+        for (double t : { 1.0, 20.0 })
+        {
+            auto expected = dense.get_matrix(t, 0.01);
+            auto actual = banded.get_matrix(t, 0.01);
+            CHECK(actual->is_banded());
+            for (int s = 0; s < 60; ++s)
+                for (int c = 0; c < 60; ++c)
+                    DOUBLES_EQUAL(expected->get(s, c), actual->get(s, c), 1e-6);
+        }
     }
 }
 
-TEST(Inference, likelihood_computer_sets_root_nodes_correctly)
+TEST(Probability, banded_matrix_multiply_block_matches_dense)
 {
-    ostringstream ost;
-    gene_family family;
-    family.set_species_size("A", 3);
-    family.set_species_size("B", 6);
+    matrix_cache cache(30);
+    cache.precalculate_matrices({ 0.02 }, { 3 });
+    matrix dense = *cache.get_matrix(3, 0.02);
+    matrix banded = dense;
+    banded.truncate(1e-9);
+    CHECK(banded.row_end(5) - banded.row_begin(5) < 30);
 
-    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+    vector<double> block(30 * 3);
+    for (size_t i = 0; i < block.size(); ++i)
+        block[i] = double(i % 7) / 7;
+    vector<double> expected(29 * 3), actual(29 * 3);
+    dense.multiply_block(&block[0], 3, 1, 29, 0, 29, &expected[0]);
+    banded.multiply_block(&block[0], 3, 1, 29, 0, 29, &actual[0]);
+    for (size_t i = 0; i < expected.size(); ++i)
+        DOUBLES_EQUAL(expected[i], actual[i], 1e-8);
+}
 
-    single_lambda lambda(0.03);
+TEST(Probability, recurrence_generator_returns_identity_row_for_saturated_branch)
+{
+    matrix_cache rec(10);
+    rec.set_generator(Recurrence);
+    rec.precalculate_matrices({ 2.0 }, { 400 });
+    auto m = rec.get_matrix(400, 2.0);
+    DOUBLES_EQUAL(1.0, m->get(0, 0), 0.0000001);
+    DOUBLES_EQUAL(0.0, m->get(5, 5), 0.0000001);
+}
 
-    matrix_cache cache(21);
-    std::map<const clade *, std::vector<double> > _probabilities;
-    auto init_func = [&](const clade* node) { _probabilities[node].resize(node->is_root() ? 20 : 21); };
-    p_tree->apply_reverse_level_order(init_func);
+TEST(Inference, base_model_reuses_matrices_across_inferences)
+{
+    single_lambda lambda(0.05);
+    base_model core(&lambda, _user_data.p_tree, &_user_data.gene_families, 10, 8, NULL);
 
-    cache.precalculate_matrices({ 0.03 }, { 1.0,3.0,7.0 });
+    uniform_distribution frq;
+    double first = core.infer_family_likelihoods(&frq, std::map<int, int>(), &lambda);
+    double second = core.infer_family_likelihoods(&frq, std::map<int, int>(), &lambda);
+    DOUBLES_EQUAL(first, second, 0.000001);
 
-    auto AB = p_tree->find_descendant("AB");
-    compute_node_probability(p_tree->find_descendant("A"), family, NULL, _probabilities, 20, 20, &lambda, cache);
-    compute_node_probability(p_tree->find_descendant("B"), family, NULL, _probabilities, 20, 20, &lambda, cache);
-    compute_node_probability(AB, family, NULL, _probabilities, 20, 20, &lambda, cache);
+    std::ostringstream ost;
+    core.write_vital_statistics(ost, second);
+    STRCMP_CONTAINS("Matrix cache: 1 hits, 1 misses", ost.str().c_str());
+}
 
-    auto& actual = _probabilities[AB];
+TEST(Inference, base_model_scores_several_lambdas_as_one_inference_each_would)
+{
+    single_lambda model_lambda(0.05);
+    base_model core(&model_lambda, _user_data.p_tree, &_user_data.gene_families, 10, 8, NULL);
+    uniform_distribution frq;
 
-    vector<double> log_expected{ -19.7743, -11.6688, -5.85672, -5.66748, -6.61256, -8.59725, -12.2301, -16.4424, -20.9882, -25.7574, 
-        -30.6888, -35.7439, -40.8971, -46.1299, -51.4289, -56.7837, -62.1863, -67.6304, -73.1106, -78.6228
-    };
+    single_lambda a(0.01), b(0.03), invalid(-0.02), c(0.08);
+    auto scores = core.infer_family_likelihoods(&frq, std::map<int, int>(), vector<const lambda *>{ &a, &b, &invalid, &c });
+    LONGS_EQUAL(4, scores.size());
+    CHECK(std::isinf(scores[2]));
 
-    LONGS_EQUAL(log_expected.size(), actual.size());
-    for (size_t i = 0; i<log_expected.size(); ++i)
+    single_lambda *lambdas[] = { &a, &b, &invalid, &c };
+    for (int k : { 0, 1, 3 })
     {
-        DOUBLES_EQUAL(log_expected[i], log(actual[i]), 0.0001);
+        base_model single(lambdas[k], _user_data.p_tree, &_user_data.gene_families, 10, 8, NULL);
+        DOUBLES_EQUAL(single.infer_family_likelihoods(&frq, std::map<int, int>(), lambdas[k]), scores[k], 1e-9);
     }
+    DOUBLES_EQUAL(0.05, model_lambda.get_single_lambda(), 0);
 }
 
-TEST(Inference, likelihood_computer_sets_leaf_nodes_from_error_model_if_provided)
+class small_cache_model : public base_model
 {
-    ostringstream ost;
-
-    gene_family family;
-    family.set_species_size("A", 3);
-    family.set_species_size("B", 6);
+public:
+    using base_model::base_model;
 
-    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+    void set_cache_budget(size_t bytes)
+    {
+        get_inference_cache().set_memory_budget(bytes);
+    }
 
-    single_lambda lambda(0.03);
+    int lambdas_per_batch()
+    {
+        return batch_size(get_lambda());
+    }
+};
 
-    matrix_cache cache(21);
-    cache.precalculate_matrices({ 0.045 }, { 1.0,3.0,7.0 });
+TEST(Inference, base_model_scores_lambdas_in_chunks_that_fit_the_cache)
+{
+    single_lambda model_lambda(0.05);
+    small_cache_model core(&model_lambda, _user_data.p_tree, &_user_data.gene_families, 10, 8, NULL);
+    CHECK(core.lambdas_per_batch() > 3);
+    core.set_cache_budget(1);
+    LONGS_EQUAL(1, core.lambdas_per_batch());
 
-    string input = "maxcnt: 20\ncntdiff: -1 0 1\n"
-        "0 0.0 0.8 0.2\n"
-        "1 0.2 0.6 0.2\n"
-        "20 0.2 0.6 0.2\n";
-    istringstream ist(input);
-    error_model model;
-    read_error_model_file(ist, &model);
+    uniform_distribution frq;
+    single_lambda a(0.01), b(0.03), c(0.08);
+    auto scores = core.infer_family_likelihoods(&frq, std::map<int, int>(), vector<const lambda *>{ &a, &b, &c });
+    LONGS_EQUAL(3, scores.size());
+
+    single_lambda *lambdas[] = { &a, &b, &c };
+    for (int k = 0; k < 3; ++k)
+    {
+        base_model single(lambdas[k], _user_data.p_tree, &_user_data.gene_families, 10, 8, NULL);
+        DOUBLES_EQUAL(single.infer_family_likelihoods(&frq, std::map<int, int>(), lambdas[k]), scores[k], 1e-9);
+    }
+}
+
+TEST(Inference, lambda_optimizer_scores_candidates_together_without_changing_the_model_lambda)
+{
+    single_lambda model_lambda(0.05);
+    base_model core(&model_lambda, _user_data.p_tree, &_user_data.gene_families, 10, 8, NULL);
+    uniform_distribution frq;
+    lambda_optimizer opt(&model_lambda, &core, &frq, 10, std::map<int, int>());
+
+    vector<double> values{ 0.01, 0.03, 0.08 };
+    vector<double> scores(3);
+    opt.calculate_scores({ &values[0], &values[1], &values[2] }, scores.data());
+    DOUBLES_EQUAL(0.05, model_lambda.get_single_lambda(), 0);
+
+    // a second scorer, so the scores are not simply recalled
+    lambda_optimizer serial(&model_lambda, &core, &frq, 10, std::map<int, int>());
+    for (int i = 0; i < 3; ++i)
+        DOUBLES_EQUAL(serial.calculate_score(&values[i]), scores[i], 1e-9);
+}
+
+TEST(Inference, calculate_score_recalls_values_equal_at_matrix_cache_precision)
+{
+    single_lambda model_lambda(0.05);
+    base_model core(&model_lambda, _user_data.p_tree, &_user_data.gene_families, 10, 8, NULL);
+    uniform_distribution frq;
+    lambda_optimizer opt(&model_lambda, &core, &frq, 10, std::map<int, int>());
+
+    vector<double> values{ 0.01, 0.0100000000001, 0.011 };
+    double first = opt.calculate_score(&values[0]);
+    DOUBLES_EQUAL(first, opt.calculate_score(&values[1]), 0);
+    DOUBLES_EQUAL(0.0100000000001, model_lambda.get_single_lambda(), 0);
+    CHECK(first != opt.calculate_score(&values[2]));
+
+    ostringstream ost;
+    core.get_monitor().summarize(ost);
+    STRCMP_EQUAL("2 values were attempted (0% rejected)\n1 repeated values were scored from earlier attempts\n", ost.str().c_str());
+}
+
+TEST(Inference, calculate_scores_infers_repeated_values_once)
+{
+    single_lambda model_lambda(0.05);
+    base_model core(&model_lambda, _user_data.p_tree, &_user_data.gene_families, 10, 8, NULL);
+    uniform_distribution frq;
+    lambda_optimizer opt(&model_lambda, &core, &frq, 10, std::map<int, int>());
+
+    vector<double> values{ 0.01, 0.03, 0.01, 0.03 };
+    double first = opt.calculate_score(&values[0]);
+    vector<double> scores(4);
+    opt.calculate_scores({ &values[0], &values[1], &values[2], &values[3] }, scores.data());
+    DOUBLES_EQUAL(first, scores[0], 0);
+    DOUBLES_EQUAL(first, scores[2], 0);
+    DOUBLES_EQUAL(scores[1], scores[3], 0);
+
+    ostringstream ost;
+    core.get_monitor().summarize(ost);
+    STRCMP_EQUAL("2 values were attempted (0% rejected)\n3 repeated values were scored from earlier attempts\n", ost.str().c_str());
+}
+
+class reporting_lambda_optimizer : public lambda_optimizer
+{
+public:
+    int reports = 0;
+
+    reporting_lambda_optimizer(lambda *p_lambda, model* p_model, root_equilibrium_distribution *p_distribution, const std::map<int, int>& root_distribution_map) :
+        lambda_optimizer(p_lambda, p_model, p_distribution, 10, root_distribution_map)
+    {
+        quiet = false;
+    }
+
+    void report_precalculation() override
+    {
+        reports++;
+    }
+
+    void report_candidate(const lambda *p_lambda) override
+    {
+        reports++;
+    }
+};
+
+TEST(Inference, calculate_scores_reports_each_candidate_once)
+{
+    uniform_distribution frq;
+    std::map<int, int> rootdist;
+    vector<double> values{ 0.01, 0.03, 0.08 };
+    vector<double> scores(3);
+
+    single_lambda model_lambda(0.05);
+    base_model core(&model_lambda, _user_data.p_tree, &_user_data.gene_families, 10, 8, NULL);
+    reporting_lambda_optimizer batched(&model_lambda, &core, &frq, rootdist);
+    batched.calculate_scores({ &values[0], &values[1], &values[2] }, scores.data());
+    LONGS_EQUAL(3, batched.reports);
+
+    // the gamma model scores the candidates one at a time
+    gamma_model gamma(&model_lambda, _user_data.p_tree, &_user_data.gene_families, 10, 8, 4, 0.25, NULL);
+    reporting_lambda_optimizer serial(&model_lambda, &gamma, &frq, rootdist);
+    serial.calculate_scores({ &values[0], &values[1], &values[2] }, scores.data());
+    LONGS_EQUAL(3, serial.reports);
+}
+
+TEST(Inference, model_configuration_includes_gamma_categories)
+{
+    gamma_model m(_user_data.p_lambda, _user_data.p_tree, &_user_data.gene_families, 10, 10, 4, 0.25, NULL);
+    auto before = m.configuration();
+    m.set_alpha(0.5);
+    CHECK(before != m.configuration());
+}
+
+TEST(Inference, build_reference_list)
+{
+    std::string str = "Desc\tFamily ID\tA\tB\n"
+        "\t (null)1\t5\t10\n"
+        "\t (null)2\t5\t7\n"
+        "\t (null)3\t5\t10\n"
+        "\t (null)4\t5\t7\n";
+    std::istringstream ist(str);
+    std::vector<gene_family> families;
+    read_gene_families(ist, NULL, families);
+    auto actual = build_reference_list(families);
+    vector<int> expected({ 0, 1, 0, 1 });
+    LONGS_EQUAL(expected.size(), actual.size());
+
+}
+
+TEST(Inference, prune)
+{
+    ostringstream ost;
+    gene_family fam;
+    fam.set_species_size("A", 3);
+    fam.set_species_size("B", 6);
+    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+
+    single_lambda lambda(0.03);
+    matrix_cache cache(21);
+    cache.precalculate_matrices({ 0.045 }, { 1.0,3.0,7.0 });
+    auto actual = inference_prune(fam, cache, &lambda, nullptr, p_tree.get(), 1.5, 20, 20);
+
+    vector<double> log_expected{ -17.2771, -10.0323 , -5.0695 , -4.91426 , -5.86062 , -7.75163 , -10.7347 , -14.2334 , -18.0458 , 
+        -22.073 , -26.2579 , -30.5639 , -34.9663 , -39.4472 , -43.9935 , -48.595 , -53.2439 , -57.9338 , -62.6597 , -67.4173 };
+
+    LONGS_EQUAL(log_expected.size(), actual.size());
+    for (size_t i = 0; i<log_expected.size(); ++i)
+    {
+        DOUBLES_EQUAL(log_expected[i], log(actual[i]), 0.0001);
+    }
+}
+
+TEST(Inference, prune_block_matches_prune_of_each_family)
+{
+    vector<gene_family> families(3);
+    families[0].set_species_size("A", 3);
+    families[0].set_species_size("B", 6);
+    families[1].set_species_size("A", 0);
+    families[1].set_species_size("B", 1);
+    families[2].set_species_size("A", 12);
+    families[2].set_species_size("B", 9);
+    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+
+    single_lambda lambda(0.03);
+    matrix_cache cache(21);
+    cache.precalculate_matrices({ 0.045 }, { 1.0,3.0,7.0 });
+    auto actual = inference_prune_block({ &families[0], &families[1], &families[2] }, cache, &lambda, nullptr, p_tree.get(), 1.5, 20, 20);
+
+    LONGS_EQUAL(3, actual.size());
+    for (size_t j = 0; j < families.size(); ++j)
+    {
+        auto expected = inference_prune(families[j], cache, &lambda, nullptr, p_tree.get(), 1.5, 20, 20);
+        LONGS_EQUAL(expected.size(), actual[j].size());
+        for (size_t i = 0; i < expected.size(); ++i)
+            DOUBLES_EQUAL(expected[i], actual[j][i], 1e-15);
+    }
+}
+
+TEST(Inference, pruning_workspace_is_reused_without_allocating)
+{
+    vector<gene_family> families(2);
+    families[0].set_species_size("A", 3);
+    families[0].set_species_size("B", 6);
+    families[1].set_species_size("A", 1);
+    families[1].set_species_size("B", 1);
+    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+    family_table table(compiled_tree(p_tree.get()), families);
+    size_t rows[] = { 0, 1 };
+
+    single_lambda lambda(0.045);
+    matrix_cache cache(21);
+    cache.precalculate_matrices({ 0.045 }, { 1.0,3.0,7.0 });
+
+    pruning_workspace workspace;
+    workspace.prepare(p_tree.get(), 4, 20, 20);
+    workspace.prune(table, rows, 2, cache, &lambda, nullptr);
+#ifndef NDEBUG
+    size_t allocations = workspace.allocation_count();
+#endif
+
+    workspace.prepare(p_tree.get(), 4, 20, 20);
+    workspace.prune(table, rows + 1, 1, cache, &lambda, nullptr);
+    workspace.prune(table, rows, 2, cache, &lambda, nullptr);
+#ifndef NDEBUG
+    LONGS_EQUAL(allocations, workspace.allocation_count());
+#endif
+
+    auto expected = inference_prune(families[1], cache, &lambda, nullptr, p_tree.get(), 1.0, 20, 20);
+    for (size_t s = 0; s < expected.size(); ++s)
+        DOUBLES_EQUAL(expected[s], workspace.root_likelihoods()[s * 2 + 1], 1e-15);
+}
+
+TEST(Inference, inference_prune_reuses_the_callers_workspace)
+{
+    std::string str = "Desc\tFamily ID\tA\tB\n\t (null)1\t3\t6\n\t (null)2\t1\t1\n\t (null)3\t12\t9\n";
+    std::istringstream ist(str);
+    std::vector<gene_family> families;
+    read_gene_families(ist, NULL, families);
+    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+
+    single_lambda lambda(0.045);
+    matrix_cache cache(21);
+    cache.precalculate_matrices({ 0.045 }, { 1.0,3.0,7.0 });
+
+    pruning_workspace workspace;
+    vector<double> actual;
+    inference_prune(families[0], cache, &lambda, nullptr, p_tree.get(), 1.0, 20, 20, workspace, actual);
+#ifndef NDEBUG
+    size_t allocations = workspace.allocation_count();
+#endif
+    for (auto& family : families)
+    {
+        inference_prune(family, cache, &lambda, nullptr, p_tree.get(), 1.0, 20, 20, workspace, actual);
+
+        auto expected = inference_prune(family, cache, &lambda, nullptr, p_tree.get(), 1.0, 20, 20);
+        LONGS_EQUAL(expected.size(), actual.size());
+        for (size_t s = 0; s < expected.size(); ++s)
+            DOUBLES_EQUAL(expected[s], actual[s], 1e-15);
+    }
+#ifndef NDEBUG
+    LONGS_EQUAL(allocations, workspace.allocation_count());
+#endif
+}
+
+TEST(Inference, pruning_workspace_computes_shared_subtree_patterns_once)
+{
+    vector<gene_family> families(3);
+    for (auto& f : families)
+    {
+        f.set_species_size("A", 1);
+        f.set_species_size("B", 2);
+        f.set_species_size("C", 0);
+    }
+    families[1].set_species_size("A", 4);
+    families[2].set_species_size("C", 5);
+    unique_ptr<clade> p_tree(parse_newick("((A:1,B:1):2,C:3)"));
+    family_table table(compiled_tree(p_tree.get()), families);
+    size_t rows[] = { 0, 1, 2 };
+
+    single_lambda lambda(0.03);
+    matrix_cache cache(21);
+    cache.precalculate_matrices({ 0.03 }, { 1.0,2.0,3.0 });
+
+    pruning_workspace workspace;
+    workspace.prepare(p_tree.get(), 4, 20, 20);
+    workspace.prune(table, rows, 3, cache, &lambda, nullptr);
+
+    auto& tree = workspace.tree();
+    LONGS_EQUAL(2, workspace.pattern_count(tree.index(p_tree->find_descendant("A"))));
+    LONGS_EQUAL(1, workspace.pattern_count(tree.index(p_tree->find_descendant("B"))));
+    LONGS_EQUAL(2, workspace.pattern_count(tree.index(p_tree->find_descendant("C"))));
+    LONGS_EQUAL(2, workspace.pattern_count(tree.index(p_tree->find_descendant("A")->get_parent())));
+    LONGS_EQUAL(3, workspace.pattern_count(0));
+
+    for (int j = 0; j < 3; ++j)
+    {
+        auto expected = inference_prune(families[j], cache, &lambda, nullptr, p_tree.get(), 1.0, 20, 20);
+        for (size_t s = 0; s < expected.size(); ++s)
+            DOUBLES_EQUAL(expected[s], workspace.root_likelihoods()[s * 3 + j], 1e-15);
+    }
+}
+
+TEST(Inference, reprune_recalculates_only_nodes_above_changed_branches)
+{
+    vector<gene_family> families(2);
+    for (auto& f : families)
+    {
+        f.set_species_size("A", 1);
+        f.set_species_size("B", 2);
+        f.set_species_size("C", 3);
+    }
+    families[1].set_species_size("C", 5);
+    unique_ptr<clade> p_tree(parse_newick("((A:1,B:1):2,C:3)"));
+    family_table table(compiled_tree(p_tree.get()), families);
+    size_t rows[] = { 0, 1 };
+
+    map<string, int> key;
+    key["A"] = 0;
+    key["B"] = 0;
+    key["AB"] = 0;
+    key["C"] = 1;
+    multiple_lambda lambda(key, { .01, .02 });
+    matrix_cache cache(21);
+    cache.precalculate_matrices({ .01, .02, .03 }, { 1.0,2.0,3.0 });
+
+    pruning_workspace workspace;
+    workspace.prepare(p_tree.get(), 2, 20, 20);
+    LONGS_EQUAL(2, workspace.reprune(table, rows, 2, cache, &lambda, nullptr, 20, 20));
+    LONGS_EQUAL(0, workspace.reprune(table, rows, 2, cache, &lambda, nullptr, 20, 20));
+
+    double changed[] = { .01, .03 };
+    lambda.update(changed);
+    LONGS_EQUAL(1, workspace.reprune(table, rows, 2, cache, &lambda, nullptr, 20, 20));
+
+    pruning_workspace fresh;
+    fresh.prepare(p_tree.get(), 2, 20, 20);
+    fresh.prune(table, rows, 2, cache, &lambda, nullptr);
+    for (int i = 0; i < 20 * 2; ++i)
+        DOUBLES_EQUAL(fresh.root_likelihoods()[i], workspace.root_likelihoods()[i], 1e-15);
+
+    double moved[] = { .02, .03 };
+    lambda.update(moved);
+    LONGS_EQUAL(2, workspace.reprune(table, rows, 2, cache, &lambda, nullptr, 20, 20));
+
+    // matrices resolved once for the whole tree give the same result
+    const class lambda *p_lambda = &lambda;
+    branch_matrices matrices(workspace.tree(), cache, &p_lambda, 1);
+    POINTERS_EQUAL(cache.get_matrix(3.0, .03), matrices.get(workspace.tree().index(p_tree->find_descendant("C")), 0));
+    LONGS_EQUAL(0, workspace.reprune(table, rows, 2, matrices, nullptr, 20, 20));
+}
+
+TEST(Inference, prune_categories_matches_pruning_each_category)
+{
+    vector<gene_family> families(2);
+    families[0].set_species_size("A", 3);
+    families[0].set_species_size("B", 6);
+    families[1].set_species_size("A", 1);
+    families[1].set_species_size("B", 2);
+    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+    family_table table(compiled_tree(p_tree.get()), families);
+    size_t rows[] = { 0, 1 };
+
+    single_lambda slow(0.01), fast(0.05);
+    const lambda *lambdas[] = { &slow, &fast };
+    matrix_cache cache(21);
+    cache.precalculate_matrices({ 0.01, 0.05 }, { 1.0,3.0,7.0 });
+
+    pruning_workspace fused;
+    fused.prepare(p_tree.get(), 2, 20, 20, 2);
+    fused.prune_categories(table, rows, 2, cache, lambdas, nullptr, 20, 20);
+
+    for (int c = 0; c < 2; ++c)
+    {
+        pruning_workspace single;
+        single.prepare(p_tree.get(), 2, 20, 20);
+        single.prune(table, rows, 2, cache, lambdas[c], nullptr);
+        for (int i = 0; i < 20 * 2; ++i)
+            DOUBLES_EQUAL(single.root_likelihoods()[i], fused.root_likelihoods(c)[i], 1e-15);
+    }
+}
+
+TEST(Inference, pruning_bounds_round_the_largest_count_up_to_a_bucket)
+{
+    CHECK(make_pair(30, 54) == pruning_bounds(3, 625, 550));
+    CHECK(make_pair(30, 54) == pruning_bounds(4, 625, 550));
+    CHECK(make_pair(160, 178) == pruning_bounds(100, 625, 550));
+    CHECK(make_pair(20, 20) == pruning_bounds(3, 20, 20));
+}
+
+TEST(Inference, pruning_within_bounds_matches_full_pruning_for_small_families)
+{
+    vector<gene_family> families(1);
+    families[0].set_species_size("A", 3);
+    families[0].set_species_size("B", 1);
+    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+    family_table table(compiled_tree(p_tree.get()), families);
+    size_t row = 0;
+
+    single_lambda lambda(0.01);
+    matrix_cache cache(201);
+    cache.precalculate_matrices({ 0.01 }, { 1.0,3.0,7.0 });
+
+    pruning_workspace full, bounded;
+    full.prepare(p_tree.get(), 1, 150, 200);
+    full.prune(table, &row, 1, cache, &lambda, nullptr);
+    bounded.prepare(p_tree.get(), 1, 150, 200);
+    auto bounds = pruning_bounds(3, 150, 200);
+    bounded.prune(table, &row, 1, cache, &lambda, nullptr, bounds.first, bounds.second);
+
+    for (int s = 0; s < bounds.first; ++s)
+        DOUBLES_EQUAL(full.root_likelihoods()[s], bounded.root_likelihoods()[s], 1e-12);
+    for (int s = bounds.first; s < 150; ++s)
+        CHECK(full.root_likelihoods()[s] < 1e-12);
+}
+
+TEST(GeneFamilies, family_table_resolves_species_to_leaf_columns)
+{
+    vector<gene_family> families(2);
+    families[0].set_id("first");
+    families[0].set_species_size("a", 3);
+    families[0].set_species_size("B", 6);
+    families[0].set_species_size("C", 2);
+    families[1].set_id("second");
+    families[1].set_species_size("B", 6);
+    families[1].set_species_size("C", 2);
+    unique_ptr<clade> p_tree(parse_newick("((A:1,B:1):1,C:3);"));
+    compiled_tree tree(p_tree.get());
+
+    family_table table(tree, families);
+    LONGS_EQUAL(2, table.size());
+    LONGS_EQUAL(3, table.species_count());
+    LONGS_EQUAL(3, table.count(0, tree.leaf_column(tree.index(p_tree->find_descendant("A")))));
+    LONGS_EQUAL(6, table.count(0, tree.leaf_column(tree.index(p_tree->find_descendant("B")))));
+    LONGS_EQUAL(6, table.max_count(0));
+    STRCMP_EQUAL("second", table.id(1).c_str());
+
+    try
+    {
+        table.count(1, tree.leaf_column(tree.index(p_tree->find_descendant("A"))));
+        CHECK(false);
+    }
+    catch (runtime_error& err)
+    {
+        STRCMP_EQUAL("A was not found in gene family second", err.what());
+    }
+}
+
+TEST(GeneFamilies, build_reference_list_from_family_table)
+{
+    vector<gene_family> families(3);
+    for (auto& f : families)
+    {
+        f.set_species_size("A", 3);
+        f.set_species_size("B", 6);
+    }
+    families[1].set_species_size("B", 7);
+    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+
+    auto actual = build_reference_list(family_table(compiled_tree(p_tree.get()), families));
+    vector<size_t> expected({ 0, 1, 0 });
+    CHECK(expected == actual);
+}
+
+TEST(GeneFamilies, hashed_reference_list_compares_items_with_the_same_hash)
+{
+    vector<int> items({ 4, 7, 4, 9, 7 });
+    auto actual = hashed_reference_list(items.size(),
+        [](size_t) { return size_t(0); },
+        [&items](size_t a, size_t b) { return items[a] == items[b]; });
+    vector<size_t> expected({ 0, 1, 0, 3, 1 });
+    CHECK(expected == actual);
+}
+
+TEST(Inference, likelihood_computer_sets_leaf_nodes_correctly)
+{
+    ostringstream ost;
+    gene_family family;
+    family.set_species_size("A", 3);
+    family.set_species_size("B", 6);
+
+    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+
+    single_lambda lambda(0.03);
+
+    matrix_cache cache(21);
+    std::map<const clade *, std::vector<double> > _probabilities; 
 
-    std::map<const clade *, std::vector<double> > _probabilities;
+    auto init_func = [&](const clade* node) { _probabilities[node].resize(node->is_root() ? 20 : 21); };
+    p_tree->apply_reverse_level_order(init_func);
+
+    cache.precalculate_matrices({ 0.045 }, { 1.0,3.0,7.0 });
+
+    auto A = p_tree->find_descendant("A");
+    compute_node_probability(A, family, NULL, _probabilities, 20, 20, &lambda, cache);
+    auto& actual = _probabilities[A];
+
+    vector<double> expected{ 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    LONGS_EQUAL(expected.size(), actual.size());
+    for (size_t i = 0; i<expected.size(); ++i)
+    {
+        DOUBLES_EQUAL(expected[i], actual[i], 0.0001);
+    }
+
+    auto B = p_tree->find_descendant("B");
+    compute_node_probability(B, family, NULL, _probabilities, 20, 20, &lambda, cache);
+    actual = _probabilities[B];
+
+    expected = { 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    LONGS_EQUAL(expected.size(), actual.size());
+    for (size_t i = 0; i<expected.size(); ++i)
+    {
+        DOUBLES_EQUAL(expected[i], actual[i], 0.0001);
+    }
+}
+
+TEST(Inference, likelihood_computer_sets_root_nodes_correctly)
+{
+    ostringstream ost;
+    gene_family family;
+    family.set_species_size("A", 3);
+    family.set_species_size("B", 6);
+
+    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+
+    single_lambda lambda(0.03);
+
+    matrix_cache cache(21);
+    std::map<const clade *, std::vector<double> > _probabilities;
+    auto init_func = [&](const clade* node) { _probabilities[node].resize(node->is_root() ? 20 : 21); };
+    p_tree->apply_reverse_level_order(init_func);
+
+    cache.precalculate_matrices({ 0.03 }, { 1.0,3.0,7.0 });
+
+    auto AB = p_tree->find_descendant("AB");
+    compute_node_probability(p_tree->find_descendant("A"), family, NULL, _probabilities, 20, 20, &lambda, cache);
+    compute_node_probability(p_tree->find_descendant("B"), family, NULL, _probabilities, 20, 20, &lambda, cache);
+    compute_node_probability(AB, family, NULL, _probabilities, 20, 20, &lambda, cache);
+
+    auto& actual = _probabilities[AB];
+
+    vector<double> log_expected{ -19.7743, -11.6688, -5.85672, -5.66748, -6.61256, -8.59725, -12.2301, -16.4424, -20.9882, -25.7574, 
+        -30.6888, -35.7439, -40.8971, -46.1299, -51.4289, -56.7837, -62.1863, -67.6304, -73.1106, -78.6228
+    };
+
+    LONGS_EQUAL(log_expected.size(), actual.size());
+    for (size_t i = 0; i<log_expected.size(); ++i)
+    {
+        DOUBLES_EQUAL(log_expected[i], log(actual[i]), 0.0001);
+    }
+}
+
+TEST(Inference, likelihood_computer_sets_leaf_nodes_from_error_model_if_provided)
+{
+    ostringstream ost;
+
+    gene_family family;
+    family.set_species_size("A", 3);
+    family.set_species_size("B", 6);
+
+    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+
+    single_lambda lambda(0.03);
+
+    matrix_cache cache(21);
+    cache.precalculate_matrices({ 0.045 }, { 1.0,3.0,7.0 });
+
+    string input = "maxcnt: 20\ncntdiff: -1 0 1\n"
+        "0 0.0 0.8 0.2\n"
+        "1 0.2 0.6 0.2\n"
+        "20 0.2 0.6 0.2\n";
+    istringstream ist(input);
+    error_model model;
+    read_error_model_file(ist, &model);
+
+    std::map<const clade *, std::vector<double> > _probabilities;
     auto init_func = [&](const clade* node) { _probabilities[node].resize(node->is_root() ? 20 : 21); };
     p_tree->apply_reverse_level_order(init_func);
 
@@ -1783,6 +2753,46 @@ TEST(Inference, likelihood_computer_sets_leaf_nodes_from_error_model_if_provided
     }
 }
 
+TEST(Clade, compiled_tree_numbers_nodes_in_prefix_order)
+{
+    unique_ptr<clade> p_tree(parse_newick("((A:1,B:1):1,(C:1,D:1):2);"));
+    compiled_tree tree(p_tree.get());
+
+    LONGS_EQUAL(7, tree.size());
+    LONGS_EQUAL(4, tree.leaf_count());
+
+    vector<string> expected_order;
+    p_tree->apply_prefix_order([&expected_order](const clade *c) { expected_order.push_back(c->get_taxon_name()); });
+    for (size_t i = 0; i < tree.size(); ++i)
+        STRCMP_EQUAL(expected_order[i].c_str(), tree.node(i)->get_taxon_name().c_str());
+
+    CHECK(tree.is_root(0));
+    LONGS_EQUAL(-1, tree.parent(0));
+    LONGS_EQUAL(2, tree.children_end(0) - tree.children_begin(0));
+
+    int c = tree.index(p_tree->find_descendant("C"));
+    CHECK(tree.is_leaf(c));
+    LONGS_EQUAL(2, tree.leaf_column(c));
+    DOUBLES_EQUAL(1.0, tree.branch_length(c), 0.00001);
+    int cd = tree.parent(c);
+    DOUBLES_EQUAL(2.0, tree.branch_length(cd), 0.00001);
+    LONGS_EQUAL(-1, tree.leaf_column(cd));
+    LONGS_EQUAL(0, tree.parent(cd));
+
+    // every node is visited after its parent in preorder and after its children in postorder
+    vector<int> preorder_position(tree.size()), postorder_position(tree.size());
+    for (size_t i = 0; i < tree.size(); ++i)
+    {
+        preorder_position[tree.preorder()[i]] = i;
+        postorder_position[tree.postorder()[i]] = i;
+    }
+    for (size_t i = 1; i < tree.size(); ++i)
+    {
+        CHECK(preorder_position[tree.parent(i)] < preorder_position[i]);
+        CHECK(postorder_position[tree.parent(i)] > postorder_position[i]);
+    }
+}
+
 TEST(Clade, get_lambda_index_throws_from_branch_length_tree)
 {
     ostringstream ost;
@@ -2200,6 +3210,29 @@ TEST(Inference, lambda_epsilon_optimizer)
     CHECK(expected == actual);
 }
 
+TEST(Inference, set_families_infers_the_new_families)
+{
+    unique_ptr<clade> p_tree(parse_newick("(A:1,B:3):7"));
+    vector<gene_family> first(1), second(1);
+    first[0].set_id("first");
+    first[0].set_species_size("A", 3);
+    first[0].set_species_size("B", 6);
+    second[0].set_id("second");
+    second[0].set_species_size("A", 10);
+    second[0].set_species_size("B", 1);
+
+    single_lambda lam(0.01);
+    uniform_distribution frq;
+    base_model core(&lam, p_tree.get(), &first, 20, 20, NULL);
+    double first_score = core.infer_family_likelihoods(&frq, std::map<int, int>(), &lam);
+    core.set_families(&second);
+    double second_score = core.infer_family_likelihoods(&frq, std::map<int, int>(), &lam);
+
+    CHECK(first_score != second_score);
+    base_model fresh(&lam, p_tree.get(), &second, 20, 20, NULL);
+    DOUBLES_EQUAL(fresh.infer_family_likelihoods(&frq, std::map<int, int>(), &lam), second_score, 1e-9);
+}
+
 TEST(Inference, lambda_per_family)
 {
     user_data ud;
@@ -2223,7 +3256,7 @@ TEST(Inference, lambda_per_family)
     m.set_tree(ud.p_tree);
     ostringstream ost;
     v.estimate_lambda_per_family(&m, ost);
-    STRCMP_EQUAL("test\t0.00053526736161992\n", ost.str().c_str());
+    STRCMP_EQUAL("test\t0.00079706923655761\n", ost.str().c_str());
 }
 
 TEST(Inference, estimator_compute_pvalues)
@@ -2402,6 +3435,19 @@ TEST(Inference, event_monitor_shows_rejected_attempts)
     STRCMP_EQUAL("2 values were attempted (50% rejected)\n", ost.str().c_str());
 }
 
+TEST(Inference, event_monitor_shows_memoized_attempts)
+{
+    event_monitor evm;
+
+    evm.Event_InferenceAttempt_Started();
+    evm.Event_InferenceAttempt_Memoized();
+    evm.Event_InferenceAttempt_Memoized();
+    ostringstream ost;
+
+    evm.summarize(ost);
+    STRCMP_EQUAL("1 values were attempted (0% rejected)\n2 repeated values were scored from earlier attempts\n", ost.str().c_str());
+}
+
 TEST(Inference, event_monitor_shows_poor_performing_families)
 {
     event_monitor evm;
@@ -2733,6 +3779,87 @@ TEST(Optimizer, fminsearch_min_init)
     DOUBLES_EQUAL(15.75, fm.candidates[2]->score, 0.0001);
 }
 
+class batch_recording_scorer : public multiplier_scorer
+{
+public:
+    vector<size_t> batches;
+    virtual void calculate_scores(const std::vector<const double *>& values, double *scores) override
+    {
+        batches.push_back(values.size());
+        optimizer_scorer::calculate_scores(values, scores);
+    }
+};
+
+TEST(Optimizer, fminsearch_scores_initial_and_shrunk_vertices_in_one_batch)
+{
+    batch_recording_scorer scorer;
+    FMinSearch* pfm = fminsearch_new_with_eq(&scorer, 2);
+    auto init = scorer.initial_guesses();
+    __fminsearch_min_init(pfm, &init[0]);
+    LONGS_EQUAL(1, scorer.batches.size());
+    LONGS_EQUAL(3, scorer.batches[0]);
+    DOUBLES_EQUAL(15, pfm->candidates[0]->score, 0.0001);
+
+    __fminsearch_x_shrink(pfm);
+    LONGS_EQUAL(2, scorer.batches.size());
+    LONGS_EQUAL(2, scorer.batches[1]);
+    for (auto c : pfm->candidates)
+        DOUBLES_EQUAL(c->values[0] * c->values[1], c->score, 0.0001);
+    fminsearch_free(pfm);
+}
+
+class unscorable_above_scorer : public optimizer_scorer
+{
+public:
+    int evaluations = 0;
+    vector<size_t> batches;
+
+    virtual std::vector<double> initial_guesses() override
+    {
+        return { 5, 3, 2 };
+    }
+
+    //! The first value cannot be scored above its initial guess
+    virtual double calculate_score(const double * values) override
+    {
+        evaluations++;
+        if (values[0] > 5)
+            return std::numeric_limits<double>::infinity();
+        return values[0] * values[1] * values[2];
+    }
+
+    virtual void calculate_scores(const std::vector<const double *>& values, double *scores) override
+    {
+        batches.push_back(values.size());
+        optimizer_scorer::calculate_scores(values, scores);
+    }
+};
+
+TEST(Optimizer, fminsearch_min_init_rescores_only_the_vertex_after_an_unscorable_one)
+{
+    unscorable_above_scorer scorer;
+    FMinSearch* pfm = fminsearch_new_with_eq(&scorer, 3);
+    auto init = scorer.initial_guesses();
+    __fminsearch_min_init(pfm, &init[0]);
+
+    // all four vertices together, then the one after the unscorable vertex again
+    LONGS_EQUAL(1, scorer.batches.size());
+    LONGS_EQUAL(4, scorer.batches[0]);
+    LONGS_EQUAL(5, scorer.evaluations);
+
+    bool moved = false;
+    for (auto c : pfm->candidates)
+    {
+        if (c->values[1] == 3 * (1 + pfm->delta * 100))
+        {
+            moved = true;
+            DOUBLES_EQUAL(5 * c->values[1] * 2, c->score, 0.0001);
+        }
+    }
+    CHECK(moved);
+    fminsearch_free(pfm);
+}
+
 TEST(Optimizer, __fminsearch_x_mean)
 {
     fm.variable_count = 2;
@@ -2954,6 +4081,233 @@ TEST(Optimizer, NelderMeadSimilarityCutoff__threshold__returns_true_if_attempt_v
     CHECK_TRUE(strat.threshold_achieved_checking_similarity(&fm));
 }
 
+class quadratic_scorer : public optimizer_scorer
+{
+public:
+    vector<double> center{ 2.0, 0.005 };
+    vector<double> weights{ 1.0, 10000.0 };
+    double upper = std::numeric_limits<double>::infinity();
+    double unscorable_above = std::numeric_limits<double>::infinity();
+    int evaluations = 0;
+    vector<size_t> batches;
+
+    virtual std::vector<double> initial_guesses() override
+    {
+        return vector<double>({ 1.0, 0.001 });
+    }
+    virtual double calculate_score(const double * values) override
+    {
+        evaluations++;
+        if (values[0] > unscorable_above)
+            return std::numeric_limits<double>::infinity();
+        double result = 0;
+        for (size_t i = 0; i < center.size(); ++i)
+            result += weights[i] * (values[i] - center[i]) * (values[i] - center[i]);
+        return result;
+    }
+    virtual void calculate_scores(const std::vector<const double *>& values, double *scores) override
+    {
+        batches.push_back(values.size());
+        optimizer_scorer::calculate_scores(values, scores);
+    }
+    virtual std::pair<double, double> bounds(int i) const override
+    {
+        return { 0.0, upper };
+    }
+};
+
+TEST(Optimizer, BoundedLBFGS_finds_minimum_of_badly_scaled_quadratic)
+{
+    quadratic_scorer scorer;
+    FMinSearch* pfm = fminsearch_new_with_eq(&scorer, 2);
+    pfm->maxiters = 300;
+    optimizer::result r;
+    auto initial = scorer.initial_guesses();
+
+    BoundedLBFGS strat;
+    strat.Run(pfm, r, initial);
+
+    DOUBLES_EQUAL(2.0, r.values[0], 0.0001);
+    DOUBLES_EQUAL(0.005, r.values[1], 0.000001);
+    DOUBLES_EQUAL(0.0, r.score, 1e-6);
+    CHECK(scorer.evaluations < 100);
+    fminsearch_free(pfm);
+}
+
+TEST(Optimizer, BoundedLBFGS_scores_each_gradient_as_one_batch)
+{
+    quadratic_scorer scorer;
+    FMinSearch* pfm = fminsearch_new_with_eq(&scorer, 2);
+    pfm->maxiters = 300;
+    optimizer::result r;
+    auto initial = scorer.initial_guesses();
+
+    BoundedLBFGS strat;
+    strat.Run(pfm, r, initial);
+
+    CHECK_FALSE(scorer.batches.empty());
+    for (auto b : scorer.batches)
+        LONGS_EQUAL(4, b);
+    fminsearch_free(pfm);
+}
+
+TEST(Optimizer, BoundedLBFGS_stops_at_upper_bound)
+{
+    quadratic_scorer scorer;
+    scorer.upper = 1.5;
+    FMinSearch* pfm = fminsearch_new_with_eq(&scorer, 2);
+    pfm->maxiters = 300;
+    optimizer::result r;
+    auto initial = scorer.initial_guesses();
+
+    BoundedLBFGS strat;
+    strat.Run(pfm, r, initial);
+
+    CHECK(r.values[0] < 1.5);
+    DOUBLES_EQUAL(1.5, r.values[0], 1e-6);
+    DOUBLES_EQUAL(0.005, r.values[1], 0.000001);
+    fminsearch_free(pfm);
+}
+
+TEST(Optimizer, get_strategy_builds_bounded_lbfgs)
+{
+    mock_scorer s;
+    optimizer opt(&s);
+    optimizer_parameters params;
+    params.strategy = LBFGS;
+    unique_ptr<OptimizerStrategy> strat(opt.get_strategy(params));
+    STRCMP_EQUAL("Bounded limited-memory BFGS", strat->Description().c_str());
+}
+
+TEST(Optimizer, BrentSearch_finds_minimum_of_single_value)
+{
+    quadratic_scorer scorer;
+    scorer.center = { 0.005 };
+    scorer.weights = { 10000.0 };
+    FMinSearch* pfm = fminsearch_new_with_eq(&scorer, 1);
+    pfm->maxiters = 300;
+    pfm->tolx = OPTIMIZER_HIGH_PRECISION;
+    optimizer::result r;
+    vector<double> initial{ 0.001 };
+
+    BrentSearch strat;
+    strat.Run(pfm, r, initial);
+
+    DOUBLES_EQUAL(0.005, r.values[0], 1e-8);
+    DOUBLES_EQUAL(0.0, r.score, 1e-8);
+    LONGS_EQUAL(scorer.evaluations, r.num_iterations);
+    CHECK(scorer.evaluations < 25);
+    fminsearch_free(pfm);
+}
+
+TEST(Optimizer, BrentSearch_stays_below_upper_bound_and_unscorable_values)
+{
+    quadratic_scorer scorer;
+    scorer.center = { 0.02 };
+    scorer.weights = { 10000.0 };
+    scorer.upper = 0.01;
+    scorer.unscorable_above = 0.01;
+    FMinSearch* pfm = fminsearch_new_with_eq(&scorer, 1);
+    pfm->maxiters = 300;
+    pfm->tolx = OPTIMIZER_HIGH_PRECISION;
+    optimizer::result r;
+    vector<double> initial{ 0.002 };
+
+    BrentSearch strat;
+    strat.Run(pfm, r, initial);
+
+    CHECK(r.values[0] < 0.01);
+    DOUBLES_EQUAL(0.01, r.values[0], 1e-6);
+    CHECK_FALSE(std::isinf(r.score));
+    fminsearch_free(pfm);
+}
+
+TEST(Optimizer, get_strategy_chooses_brent_for_a_single_value)
+{
+    mock_scorer s;
+    optimizer opt(&s);
+    optimizer_parameters params;
+    params.strategy = LBFGS;
+    opt.optimize(params);
+    unique_ptr<OptimizerStrategy> strat(opt.get_strategy(params));
+    STRCMP_EQUAL("Bracketing and Brent's method", strat->Description().c_str());
+}
+
+TEST(Optimizer, fminsearch_multistart_scores_all_starts_together)
+{
+    quadratic_scorer scorer;
+    FMinSearch* pfm = fminsearch_new_with_eq(&scorer, 2);
+    pfm->tolx = 1e-6;
+    pfm->tolf = 1e-8;
+    vector<vector<double>> initials{ { 1.0, 0.001 }, { 3.0, 0.009 }, { 0.5, 0.02 } };
+
+    auto traces = fminsearch_multistart(pfm, initials);
+
+    LONGS_EQUAL(3, traces.size());
+    LONGS_EQUAL(9, scorer.batches[0]);
+    auto best = min_element(traces.begin(), traces.end(), [](const start_trace& a, const start_trace& b) { return a.score < b.score; });
+    DOUBLES_EQUAL(2.0, best->values[0], 0.001);
+    DOUBLES_EQUAL(0.005, best->values[1], 0.0001);
+    DOUBLES_EQUAL(3.0, traces[1].initial[0], 0.0);
+    fminsearch_free(pfm);
+}
+
+TEST(Optimizer, fminsearch_multistart_stops_a_start_that_reaches_a_better_optimum)
+{
+    quadratic_scorer scorer;
+    FMinSearch* pfm = fminsearch_new_with_eq(&scorer, 2);
+    pfm->tolx = 1e-6;
+    pfm->tolf = 1e-8;
+    vector<vector<double>> initials{ { 1.0, 0.001 }, { 1.0, 0.001 } };
+
+    auto traces = fminsearch_multistart(pfm, initials);
+
+    CHECK_FALSE(traces[0].duplicate);
+    CHECK_TRUE(traces[1].duplicate);
+    CHECK(traces[1].iterations < traces[0].iterations);
+
+    ostringstream ost;
+    ost << traces[1];
+    STRCMP_CONTAINS("stopping at the optimum of a better start", ost.str().c_str());
+    fminsearch_free(pfm);
+}
+
+class throwing_scorer : public quadratic_scorer
+{
+public:
+    size_t batches_before_throwing = 0;
+
+    virtual void calculate_scores(const std::vector<const double *>& values, double *scores) override
+    {
+        if (batches.size() == batches_before_throwing)
+            throw std::runtime_error("scorer failed");
+        quadratic_scorer::calculate_scores(values, scores);
+    }
+};
+
+TEST(Optimizer, fminsearch_multistart_rethrows_a_scorer_exception_after_stopping_every_search)
+{
+    for (size_t batches : { 0, 3 })
+    {
+        throwing_scorer scorer;
+        scorer.batches_before_throwing = batches;
+        FMinSearch* pfm = fminsearch_new_with_eq(&scorer, 2);
+        vector<vector<double>> initials{ { 1.0, 0.001 }, { 3.0, 0.009 }, { 0.5, 0.02 } };
+
+        try
+        {
+            fminsearch_multistart(pfm, initials);
+            CHECK(false);
+        }
+        catch (runtime_error& err)
+        {
+            STRCMP_EQUAL("scorer failed", err.what());
+        }
+        LONGS_EQUAL(batches, scorer.batches.size());
+        fminsearch_free(pfm);
+    }
+}
+
 TEST_GROUP(LikelihoodRatioTest)
 {
 };